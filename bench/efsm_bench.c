@@ -0,0 +1,880 @@
+/**
+ * \file efsm_bench.c
+ * \brief Microbenchmarks for efsm
+ * \author Jason Carey
+ *
+ * Times the hot paths of the library: send + run at various fsa counts, through
+ * a static engine, with inline payloads, with batch callbacks, into bounded
+ * mailboxes, with some failing, traced and to ids, dispatch against the number
+ * of transitions per state, efsm creation with and without a shared def or
+ * verification, adding and removing rules under live fsa's, rebuilding fsa's
+ * one at a time against restoring a snapshot, efsm_pp against streaming a large
+ * machine out with efsm_graph, fsa churn and self sending chains, with and
+ * without run to completion.  Each benchmark is repeated and reports the median
+ * ns/op along with percentiles over the repetitions and heap allocations per
+ * op.
+ *
+ * Allocations are counted by wrapping malloc and friends at link time (see
+ * the bench target in the Makefile), so only calls made from efsm and this
+ * file are seen.
+ *
+ * Usage: efsm_bench [-j] [filter]
+ *
+ *   -j      emit one JSON object per benchmark instead of a table, suitable
+ *           for diffing between releases
+ *   filter  only run benchmarks whose name contains filter
+ */
+
+#include <efsm.h>
+#include <efsm_static.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define ASIZE(a) (sizeof(a) / sizeof(*a))
+
+/** Heap calls made since the counters were last reset */
+static size_t n_allocs;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+void __real_free(void *ptr);
+
+void *__wrap_malloc(size_t size)
+{
+    n_allocs++;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t n, size_t size)
+{
+    n_allocs++;
+    return __real_calloc(n, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+    n_allocs++;
+    return __real_realloc(ptr, size);
+}
+
+void __wrap_free(void *ptr)
+{
+    __real_free(ptr);
+}
+
+/** Reads the monotonic clock in nanoseconds */
+static long long now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/** A benchmark body, which runs ops operations and returns */
+typedef void (*bench_fn_t) (void *ctx, size_t ops);
+
+/** A benchmark and its fixture */
+typedef struct bench {
+    const char *name;
+    void *(*setup) (long param);        // may be NULL
+    bench_fn_t fn;
+    void (*teardown) (void *ctx);       // may be NULL
+    long param;                 // passed to setup
+    size_t ops;                 // operations per repetition
+    int reps;                   // repetitions
+} bench_t;
+
+static int json;
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/** Picks the p'th percentile out of sorted samples */
+static double percentile(double *samples, int n, double p)
+{
+    int i = (int)(p * (n - 1) + 0.5);
+
+    return samples[i];
+}
+
+/** Runs a benchmark's repetitions and prints a line for it */
+static void run_bench(bench_t * b)
+{
+    double samples[64];
+    size_t allocs = 0;
+    int i;
+
+    void *ctx = b->setup ? b->setup(b->param) : NULL;
+
+    // one untimed repetition to warm up pools and caches
+    b->fn(ctx, b->ops);
+
+    for (i = 0; i < b->reps; i++) {
+        n_allocs = 0;
+        long long start = now();
+        b->fn(ctx, b->ops);
+        long long elapsed = now() - start;
+        allocs += n_allocs;
+
+        samples[i] = (double)elapsed / b->ops;
+    }
+
+    if (b->teardown)
+        b->teardown(ctx);
+
+    qsort(samples, b->reps, sizeof(*samples), cmp_double);
+
+    double p50 = percentile(samples, b->reps, 0.5);
+    double p90 = percentile(samples, b->reps, 0.9);
+    double p99 = percentile(samples, b->reps, 0.99);
+    double allocs_per_op = (double)allocs / ((double)b->ops * b->reps);
+
+    if (json) {
+        printf("{\"name\":\"%s\",\"ops\":%zu,\"reps\":%d,\"ns_per_op\":%.2f,"
+               "\"p50\":%.2f,\"p90\":%.2f,\"p99\":%.2f,\"min\":%.2f,"
+               "\"allocs_per_op\":%.4f}\n", b->name, b->ops, b->reps, p50,
+               p50, p90, p99, samples[0], allocs_per_op);
+    } else {
+        printf("%-32s %10.2f %10.2f %10.2f %10.2f %12.4f\n", b->name, p50,
+               samples[0], p90, p99, allocs_per_op);
+    }
+    fflush(stdout);
+}
+
+enum STATES {
+    STATE_A,
+    STATE_B,
+    STATE_DESTROY,
+};
+
+enum MSGS {
+    MSG_A,
+    MSG_B,
+    MSG_DESTROY,
+};
+
+static int noop(efsm_fsa_t * fsa, void *fsa_data, void *transition_data,
+                int type, void *msg_data)
+{
+    return 0;
+}
+
+static int chain_a(efsm_fsa_t * fsa, void *fsa_data, void *transition_data,
+                   int type, void *msg_data)
+{
+    efsm_fsa_send(fsa, MSG_B, NULL);
+    return 0;
+}
+
+static int chain_b(efsm_fsa_t * fsa, void *fsa_data, void *transition_data,
+                   int type, void *msg_data)
+{
+    efsm_fsa_send(fsa, MSG_DESTROY, NULL);
+    return 0;
+}
+
+static int chain_destroy(efsm_fsa_t * fsa, void *fsa_data,
+                         void *transition_data, int type, void *msg_data)
+{
+    return 1;
+}
+
+/** Fails the messages that have data */
+static int fail_marked(efsm_fsa_t * fsa, void *fsa_data, void *transition_data,
+                       int type, void *msg_data)
+{
+    return msg_data ? -1 : 0;
+}
+
+static efsm_transition_rules_t loop_rules[] = {
+    {STATE_A, MSG_A, &noop, NULL, STATE_A},
+    {-1},
+};
+
+static efsm_transition_rules_t chain_rules[] = {
+    {STATE_A, MSG_A, &chain_a, NULL, STATE_B},
+    {STATE_B, MSG_B, &chain_b, NULL, STATE_DESTROY},
+    {STATE_DESTROY, MSG_DESTROY, &chain_destroy, NULL, -1},
+    {-1},
+};
+
+/** loop_rules again, compiled into an engine */
+#define STATIC_LOOP_RULES(X) \
+    X(STATE_A, MSG_A, &noop, NULL, STATE_A)
+
+EFSM_STATIC_DEFINE(static_loop, STATIC_LOOP_RULES)
+
+/** A efsm with a set of fsa's that loop on MSG_A */
+typedef struct fixture {
+    efsm_t *efsm;
+    efsm_fsa_t **fsas;
+    size_t n_fsas;
+    int n_threads;
+    efsm_msg_t *msgs;
+} fixture_t;
+
+static void *fixture_new(efsm_transition_rules_t * rules, efsm_opts_t * opts,
+                         size_t n_fsas, size_t ring)
+{
+    fixture_t *f = calloc(sizeof(*f), 1);
+    size_t i;
+
+    f->efsm = efsm_new(rules, opts);
+    f->fsas = malloc(sizeof(*f->fsas) * (n_fsas ? n_fsas : 1));
+    f->n_fsas = n_fsas;
+
+    efsm_fsa_opts_t fsa_opts = { 0 };
+    fsa_opts.mailbox_capacity = ring;
+
+    for (i = 0; i < n_fsas; i++)
+        f->fsas[i] = efsm_fsa_new(f->efsm, STATE_A, &fsa_opts);
+
+    while (efsm_run(f->efsm) > 0) ;
+
+    return f;
+}
+
+static void fixture_destroy(void *ctx)
+{
+    fixture_t *f = ctx;
+
+    efsm_destroy(f->efsm);
+    free(f->fsas);
+    free(f->msgs);
+    free(f);
+}
+
+static void *setup_fsas(long n_fsas)
+{
+    return fixture_new(loop_rules, NULL, n_fsas, 0);
+}
+
+static void *setup_static_fsas(long n_fsas)
+{
+    efsm_opts_t opts = { 0 };
+    opts.engine = &static_loop_engine;
+
+    return fixture_new(static_loop_rules, &opts, n_fsas, 0);
+}
+
+static void *setup_inline_fsas(long n_fsas)
+{
+    efsm_opts_t opts = { 0 };
+    opts.inline_size = 16;
+
+    return fixture_new(loop_rules, &opts, n_fsas, 0);
+}
+
+static void noop_batch(efsm_fsa_t ** fsas, void **fsa_data,
+                       void *transition_data, int type, void **msg_data,
+                       int *results, size_t n)
+{
+    memset(results, 0, sizeof(*results) * n);
+}
+
+static efsm_batch_rule_t loop_batch[] = {
+    {STATE_A, MSG_A, &noop_batch},
+};
+
+static void *setup_batch_fsas(long n_fsas)
+{
+    efsm_opts_t opts = { 0 };
+    opts.batch = loop_batch;
+    opts.n_batch = ASIZE(loop_batch);
+
+    return fixture_new(loop_rules, &opts, n_fsas, 0);
+}
+
+static void *setup_ring_fsas(long n_fsas)
+{
+    return fixture_new(loop_rules, NULL, n_fsas, 4);
+}
+
+/** Mailboxes that hold 16, so a flood keeps dropping the oldest */
+static void *setup_bounded_fsas(long n_fsas)
+{
+    efsm_opts_t opts = { 0 };
+    opts.mailbox_limit = 16;
+    opts.overflow = EFSM_OVERFLOW_DROP_OLDEST;
+
+    return fixture_new(loop_rules, &opts, n_fsas, 0);
+}
+
+static efsm_transition_rules_t failing_rules[] = {
+    {STATE_A, MSG_A, &fail_marked, NULL, STATE_A},
+    {STATE_A, MSG_B, &noop, NULL, STATE_A},
+    {-1},
+};
+
+/** Messages that fail go to an error transition on MSG_B */
+static void *setup_failing_fsas(long n_fsas)
+{
+    efsm_opts_t opts = { 0 };
+    opts.on_error = EFSM_ERROR_MSG;
+    opts.error_msg = MSG_B;
+
+    return fixture_new(failing_rules, &opts, n_fsas, 0);
+}
+
+/** Transitions go into a trace ring, one in sample of them */
+static void *setup_traced_fsas(long sample)
+{
+    efsm_opts_t opts = { 0 };
+    opts.trace_records = 1 << 16;
+    opts.trace_sample = sample;
+
+    return fixture_new(loop_rules, &opts, 1000, 0);
+}
+
+/** One message to each fsa in turn, then runs everything */
+static void bench_send_run(void *ctx, size_t ops)
+{
+    fixture_t *f = ctx;
+    size_t i;
+
+    for (i = 0; i < ops; i++)
+        efsm_fsa_send(f->fsas[i % f->n_fsas], MSG_A, NULL);
+
+    if (f->n_threads)
+        while (efsm_run_parallel(f->efsm, f->n_threads) > 0) ;
+    else
+        while (efsm_run(f->efsm) > 0) ;
+}
+
+/** send_run with one message in 64 failing */
+static void bench_send_run_failing(void *ctx, size_t ops)
+{
+    fixture_t *f = ctx;
+    size_t i;
+
+    for (i = 0; i < ops; i++)
+        efsm_fsa_send(f->fsas[i % f->n_fsas], MSG_A,
+                      i % 64 ? NULL : (void *)f);
+
+    while (efsm_run(f->efsm) > 0) ;
+}
+
+/** send_run with a 16 byte payload copied into each message */
+static void bench_send_inline_run(void *ctx, size_t ops)
+{
+    fixture_t *f = ctx;
+    char payload[16] = { 0 };
+    size_t i;
+
+    for (i = 0; i < ops; i++)
+        efsm_fsa_send_inline(f->fsas[i % f->n_fsas], MSG_A, payload,
+                             sizeof(payload));
+
+    while (efsm_run(f->efsm) > 0) ;
+}
+
+/** Like setup_fsas, but the fsa's are ids that are parked while idle */
+static void *setup_ids(long n_ids)
+{
+    fixture_t *f = fixture_new(loop_rules, NULL, 0, 0);
+    long i;
+
+    for (i = 0; i < n_ids; i++)
+        efsm_id_new(f->efsm, STATE_A, NULL);
+    f->n_fsas = n_ids;
+
+    return f;
+}
+
+static void bench_id_send_run(void *ctx, size_t ops)
+{
+    fixture_t *f = ctx;
+    size_t i;
+
+    for (i = 0; i < ops; i++)
+        efsm_id_send(f->efsm, i % f->n_fsas, MSG_A, NULL);
+
+    while (efsm_run(f->efsm) > 0) ;
+}
+
+/** One fsa busy among many idle ones, with a run per message */
+static void bench_idle_run(void *ctx, size_t ops)
+{
+    fixture_t *f = ctx;
+    size_t i;
+
+    for (i = 0; i < ops; i++) {
+        efsm_fsa_send(f->fsas[i & 1 ? f->n_fsas - 1 : 0], MSG_A, NULL);
+        efsm_run(f->efsm);
+    }
+}
+
+static void *setup_parallel(long n_threads)
+{
+    fixture_t *f = fixture_new(loop_rules, NULL, 100000, 0);
+
+    f->n_threads = n_threads;
+
+    return f;
+}
+
+/** A single state with param transitions, hit by a spread of messages */
+static void *setup_dispatch(long param)
+{
+    int n_transitions = param & 0xffff;
+    efsm_opts_t opts = { 0 };
+    opts.dispatch = (efsm_dispatch_t) (param >> 16);
+
+    efsm_transition_rules_t *rules =
+        calloc(sizeof(*rules), n_transitions + 1);
+    int i;
+    for (i = 0; i < n_transitions; i++) {
+        rules[i].current_state = STATE_A;
+        rules[i].msg_type = i;
+        rules[i].code = &noop;
+        rules[i].next_state = STATE_A;
+    }
+    rules[n_transitions].current_state = -1;
+
+    fixture_t *f = fixture_new(rules, &opts, 1, 1024);
+    free(rules);
+
+    f->msgs = malloc(sizeof(*f->msgs) * 1024);
+    for (i = 0; i < 1024; i++) {
+        // Spread over the table so the linear scan pays its average cost
+        f->msgs[i].type = (i * 7919) % n_transitions;
+        f->msgs[i].data = NULL;
+    }
+
+    return f;
+}
+
+static void bench_dispatch(void *ctx, size_t ops)
+{
+    fixture_t *f = ctx;
+    size_t i;
+
+    for (i = 0; i < ops; i += 1024) {
+        efsm_fsa_send_many(f->fsas[0], f->msgs, 1024);
+        while (efsm_run(f->efsm) > 0) ;
+    }
+}
+
+/** A def with param transitions, and the rules it was compiled from */
+typedef struct def_fixture {
+    efsm_transition_rules_t *rules;
+    efsm_def_t *def;
+} def_fixture_t;
+
+static void *setup_def(long param)
+{
+    def_fixture_t *f = calloc(sizeof(*f), 1);
+    int i;
+
+    f->rules = calloc(sizeof(*f->rules), param + 1);
+    for (i = 0; i < param; i++) {
+        f->rules[i].current_state = i % 16;
+        f->rules[i].msg_type = i / 16;
+        f->rules[i].code = &noop;
+        f->rules[i].next_state = (i + 1) % 16;
+    }
+    f->rules[param].current_state = -1;
+
+    f->def = efsm_def_compile(f->rules, NULL);
+
+    return f;
+}
+
+static void def_fixture_destroy(void *ctx)
+{
+    def_fixture_t *f = ctx;
+
+    efsm_def_release(f->def);
+    free(f->rules);
+    free(f);
+}
+
+/** setup_def's rules, with 1k fsa's live under them */
+static void *setup_edit(long param)
+{
+    def_fixture_t *d = setup_def(param);
+    fixture_t *f = fixture_new(d->rules, NULL, 1000, 0);
+
+    def_fixture_destroy(d);
+
+    return f;
+}
+
+/** The first of setup_def's rules, put back after each removal */
+static efsm_transition_rules_t edit_rule[] = {
+    {0, 0, &noop, NULL, 1},
+    {-1},
+};
+
+/** Takes a rule out and puts it back, each a recompile and swap */
+static void bench_edit(void *ctx, size_t ops)
+{
+    fixture_t *f = ctx;
+    size_t i;
+
+    for (i = 0; i < ops; i += 2) {
+        efsm_remove_rule(f->efsm, 0, 0);
+        efsm_add_rules(f->efsm, edit_rule);
+    }
+}
+
+/** Compiles the rules for every efsm */
+static void bench_new(void *ctx, size_t ops)
+{
+    def_fixture_t *f = ctx;
+    size_t i;
+
+    for (i = 0; i < ops; i++)
+        efsm_destroy(efsm_new(f->rules, NULL));
+}
+
+/** Compiles them with every state checked reachable */
+static void bench_new_verify(void *ctx, size_t ops)
+{
+    def_fixture_t *f = ctx;
+    efsm_opts_t opts = { 0 };
+    size_t i;
+
+    opts.verify = EFSM_VERIFY_UNREACHABLE;
+    for (i = 0; i < ops; i++)
+        efsm_destroy(efsm_new(f->rules, &opts));
+}
+
+/** Shares one compiled def */
+static void bench_new_from_def(void *ctx, size_t ops)
+{
+    def_fixture_t *f = ctx;
+    size_t i;
+
+    for (i = 0; i < ops; i++)
+        efsm_destroy(efsm_new_from_def(f->def, NULL));
+}
+
+/** An efsm of fsa's with a queued inline message each, and its snapshot */
+typedef struct snap_fixture {
+    efsm_opts_t opts;
+    long n_fsas;
+    char *buf;
+    size_t len;
+    size_t pos;
+} snap_fixture_t;
+
+static int snap_write(void *ctx, const void *buf, size_t len)
+{
+    snap_fixture_t *f = ctx;
+
+    f->buf = realloc(f->buf, f->len + len);
+    memcpy(f->buf + f->len, buf, len);
+    f->len += len;
+
+    return 0;
+}
+
+static int snap_read(void *ctx, void *buf, size_t len)
+{
+    snap_fixture_t *f = ctx;
+
+    memcpy(buf, f->buf + f->pos, len);
+    f->pos += len;
+
+    return 0;
+}
+
+/** Queues n_fsas worth of state the way a node would rebuild it */
+static void snap_populate(snap_fixture_t * f, efsm_t * efsm)
+{
+    long i;
+
+    for (i = 0; i < f->n_fsas; i++)
+        efsm_fsa_send_inline(efsm_fsa_new(efsm, STATE_A, NULL), MSG_A, &i,
+                             sizeof(i));
+}
+
+static void *setup_snapshot(long n_fsas)
+{
+    snap_fixture_t *f = calloc(sizeof(*f), 1);
+    efsm_writer_t w = { &snap_write, f, NULL, NULL };
+
+    f->opts.inline_size = 16;
+    f->n_fsas = n_fsas;
+
+    efsm_t *efsm = efsm_new(loop_rules, &f->opts);
+    snap_populate(f, efsm);
+    efsm_snapshot(efsm, &w);
+    efsm_destroy(efsm);
+
+    return f;
+}
+
+static void snap_fixture_destroy(void *ctx)
+{
+    snap_fixture_t *f = ctx;
+
+    free(f->buf);
+    free(f);
+}
+
+/** Rebuilds the fsa's one efsm_fsa_new and send at a time */
+static void bench_rebuild(void *ctx, size_t ops)
+{
+    snap_fixture_t *f = ctx;
+    size_t i;
+
+    for (i = 0; i < ops; i += f->n_fsas) {
+        efsm_t *efsm = efsm_new(loop_rules, &f->opts);
+        snap_populate(f, efsm);
+        efsm_destroy(efsm);
+    }
+}
+
+/** Rebuilds them from the snapshot */
+static void bench_restore(void *ctx, size_t ops)
+{
+    snap_fixture_t *f = ctx;
+    efsm_reader_t r = { &snap_read, f, NULL, NULL, NULL };
+    size_t i;
+
+    for (i = 0; i < ops; i += f->n_fsas) {
+        efsm_t *efsm = efsm_new(loop_rules, &f->opts);
+        f->pos = 0;
+        efsm_restore(efsm, &r);
+        efsm_destroy(efsm);
+    }
+}
+
+/** A machine of GRAPH_STATES states with 4 rules each, named s0... and m0...
+ *  for efsm_pp, and the efsm_graph options to export it with */
+#define GRAPH_STATES 4096
+
+typedef struct graph_fixture {
+    efsm_t *efsm;
+    char **state_names;
+    char *msg_names[4];
+    efsm_graph_opts_t opts;
+} graph_fixture_t;
+
+/** Drops the output, so only the formatting is timed */
+static int null_write(void *ctx, const void *buf, size_t len)
+{
+    return 0;
+}
+
+/** param is the efsm_graph_format_t, or'd with 1 << 16 for counts */
+static void *setup_graph(long param)
+{
+    graph_fixture_t *f = calloc(sizeof(*f), 1);
+    efsm_transition_rules_t *rules =
+        calloc(sizeof(*rules), GRAPH_STATES * 4 + 1);
+    char name[16];
+    int i;
+
+    for (i = 0; i < GRAPH_STATES * 4; i++) {
+        rules[i].current_state = i / 4;
+        rules[i].msg_type = i % 4;
+        rules[i].code = &noop;
+        rules[i].next_state = (i / 4 + i % 4 + 1) % GRAPH_STATES;
+    }
+    rules[i].current_state = -1;
+
+    f->efsm = efsm_new(rules, NULL);
+    free(rules);
+
+    f->state_names = malloc(sizeof(*f->state_names) * GRAPH_STATES);
+    for (i = 0; i < GRAPH_STATES; i++) {
+        snprintf(name, sizeof(name), "s%d", i);
+        f->state_names[i] = strdup(name);
+    }
+    for (i = 0; i < 4; i++) {
+        snprintf(name, sizeof(name), "m%d", i);
+        f->msg_names[i] = strdup(name);
+    }
+
+    f->opts.format = param & 0xffff;
+    f->opts.counts = param >> 16;
+    f->opts.state_names = (const char *const *)f->state_names;
+    f->opts.n_state_names = GRAPH_STATES;
+    f->opts.msg_names = (const char *const *)f->msg_names;
+    f->opts.n_msg_names = 4;
+
+    return f;
+}
+
+static void graph_fixture_destroy(void *ctx)
+{
+    graph_fixture_t *f = ctx;
+    int i;
+
+    for (i = 0; i < GRAPH_STATES; i++)
+        free(f->state_names[i]);
+    for (i = 0; i < 4; i++)
+        free(f->msg_names[i]);
+    free(f->state_names);
+    efsm_destroy(f->efsm);
+    free(f);
+}
+
+/** Builds the whole dot string, an op per transition */
+static void bench_pp(void *ctx, size_t ops)
+{
+    graph_fixture_t *f = ctx;
+    size_t i;
+
+    for (i = 0; i < ops; i += GRAPH_STATES * 4)
+        free(efsm_pp(f->efsm, f->state_names, f->msg_names));
+}
+
+/** Streams it to a writer instead */
+static void bench_graph(void *ctx, size_t ops)
+{
+    graph_fixture_t *f = ctx;
+    efsm_writer_t w = { &null_write, NULL, NULL, NULL };
+    size_t i;
+
+    for (i = 0; i < ops; i += GRAPH_STATES * 4)
+        efsm_graph(f->efsm, &w, &f->opts);
+}
+
+static void *setup_empty(long param)
+{
+    return fixture_new(loop_rules, NULL, 0, 0);
+}
+
+static void bench_churn(void *ctx, size_t ops)
+{
+    fixture_t *f = ctx;
+    size_t i;
+
+    for (i = 0; i < ops; i++)
+        efsm_fsa_destroy(efsm_fsa_new(f->efsm, STATE_A, NULL));
+}
+
+static void *setup_chain(long param)
+{
+    return fixture_new(chain_rules, NULL, 0, 0);
+}
+
+static void *setup_chain_rtc(long param)
+{
+    efsm_opts_t opts = { 0 };
+    opts.run_to_completion = 2;
+
+    return fixture_new(chain_rules, &opts, 0, 0);
+}
+
+/** Creates ops fsa's, each of which runs A -> B -> DESTROY */
+static void bench_chain(void *ctx, size_t ops)
+{
+    fixture_t *f = ctx;
+    size_t i;
+
+    for (i = 0; i < ops; i++)
+        efsm_fsa_send(efsm_fsa_new(f->efsm, STATE_A, NULL), MSG_A, NULL);
+
+    while (efsm_run(f->efsm) > 0) ;
+}
+
+#define DISPATCH(name, n, layout) \
+    { name, &setup_dispatch, &bench_dispatch, &fixture_destroy, \
+      (long)(layout) << 16 | (n), 1 << 16, 15 }
+
+static bench_t benches[] = {
+    {"send_run/1", &setup_fsas, &bench_send_run, &fixture_destroy, 1,
+     1 << 16, 15},
+    {"send_run/1k", &setup_fsas, &bench_send_run, &fixture_destroy, 1000,
+     1 << 16, 15},
+    {"send_run/1M", &setup_fsas, &bench_send_run, &fixture_destroy, 1000000,
+     1000000, 5},
+    {"id_send_run/1M", &setup_ids, &bench_id_send_run, &fixture_destroy,
+     1000000, 1000000, 5},
+    {"idle_run/1M", &setup_fsas, &bench_idle_run, &fixture_destroy, 1000000,
+     1 << 16, 5},
+    {"send_run_static/1k", &setup_static_fsas, &bench_send_run,
+     &fixture_destroy, 1000, 1 << 16, 15},
+    {"send_inline_run/1k", &setup_inline_fsas, &bench_send_inline_run,
+     &fixture_destroy, 1000, 1 << 16, 15},
+    {"send_run_batch/1k", &setup_batch_fsas, &bench_send_run,
+     &fixture_destroy, 1000, 1 << 16, 15},
+    {"send_run_bounded/1k", &setup_bounded_fsas, &bench_send_run,
+     &fixture_destroy, 1000, 1 << 16, 15},
+    {"send_run_failing_1_in_64/1k", &setup_failing_fsas,
+     &bench_send_run_failing, &fixture_destroy, 1000, 1 << 16, 15},
+    {"send_run_traced/1k", &setup_traced_fsas, &bench_send_run,
+     &fixture_destroy, 1, 1 << 16, 15},
+    {"send_run_traced_1_in_16/1k", &setup_traced_fsas, &bench_send_run,
+     &fixture_destroy, 16, 1 << 16, 15},
+    {"send_run_ring/1k", &setup_ring_fsas, &bench_send_run, &fixture_destroy,
+     1000, 1 << 16, 15},
+    {"send_run_parallel/4", &setup_parallel, &bench_send_run,
+     &fixture_destroy, 4, 400000, 9},
+    DISPATCH("dispatch_dense/4", 4, EFSM_DISPATCH_DENSE),
+    DISPATCH("dispatch_dense/64", 64, EFSM_DISPATCH_DENSE),
+    DISPATCH("dispatch_dense/256", 256, EFSM_DISPATCH_DENSE),
+    DISPATCH("dispatch_hash/4", 4, EFSM_DISPATCH_HASH),
+    DISPATCH("dispatch_hash/64", 64, EFSM_DISPATCH_HASH),
+    DISPATCH("dispatch_hash/256", 256, EFSM_DISPATCH_HASH),
+    DISPATCH("dispatch_linear/4", 4, EFSM_DISPATCH_LINEAR),
+    DISPATCH("dispatch_linear/64", 64, EFSM_DISPATCH_LINEAR),
+    DISPATCH("dispatch_linear/256", 256, EFSM_DISPATCH_LINEAR),
+    {"efsm_new/256", &setup_def, &bench_new, &def_fixture_destroy, 256,
+     1 << 12, 15},
+    {"efsm_new_verify/256", &setup_def, &bench_new_verify,
+     &def_fixture_destroy, 256, 1 << 12, 15},
+    {"efsm_new_from_def/256", &setup_def, &bench_new_from_def,
+     &def_fixture_destroy, 256, 1 << 12, 15},
+    {"rule_edit/256", &setup_edit, &bench_edit, &fixture_destroy, 256,
+     1 << 12, 15},
+    {"rebuild/64k", &setup_snapshot, &bench_rebuild, &snap_fixture_destroy,
+     1 << 16, 1 << 18, 9},
+    {"restore/64k", &setup_snapshot, &bench_restore, &snap_fixture_destroy,
+     1 << 16, 1 << 18, 9},
+    {"efsm_pp/16k", &setup_graph, &bench_pp, &graph_fixture_destroy,
+     EFSM_GRAPH_DOT, 1 << 18, 9},
+    {"graph_dot/16k", &setup_graph, &bench_graph, &graph_fixture_destroy,
+     EFSM_GRAPH_DOT, 1 << 18, 9},
+    {"graph_dot_counts/16k", &setup_graph, &bench_graph,
+     &graph_fixture_destroy, 1 << 16 | EFSM_GRAPH_DOT, 1 << 18, 9},
+    {"graph_json/16k", &setup_graph, &bench_graph, &graph_fixture_destroy,
+     EFSM_GRAPH_JSON, 1 << 18, 9},
+    {"graph_binary_counts/16k", &setup_graph, &bench_graph,
+     &graph_fixture_destroy, 1 << 16 | EFSM_GRAPH_BINARY, 1 << 18, 9},
+    {"fsa_churn", &setup_empty, &bench_churn, &fixture_destroy, 0, 1 << 16,
+     15},
+    {"chain_abd/1k", &setup_chain, &bench_chain, &fixture_destroy, 0, 1000,
+     15},
+    {"chain_abd_rtc/1k", &setup_chain_rtc, &bench_chain, &fixture_destroy, 0,
+     1000, 15},
+};
+
+int main(int argc, char **argv)
+{
+    const char *filter = NULL;
+    int i;
+
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-j") == 0)
+            json = 1;
+        else
+            filter = argv[i];
+    }
+
+    if (!json)
+        printf("%-32s %10s %10s %10s %10s %12s\n", "benchmark", "ns/op",
+               "min", "p90", "p99", "allocs/op");
+
+    for (i = 0; i < (int)ASIZE(benches); i++) {
+        if (filter && !strstr(benches[i].name, filter))
+            continue;
+        run_bench(benches + i);
+    }
+
+    return 0;
+}
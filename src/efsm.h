@@ -37,6 +37,9 @@
 #ifndef EFSM_H
 #define EFSM_H
 
+#include <stddef.h>
+#include <stdint.h>
+
 typedef struct efsm {
     void *data;
 } efsm_t;
@@ -45,6 +48,11 @@ typedef struct efsm_fsa {
     void *data;
 } efsm_fsa_t;
 
+/** a compiled set of rules that any number of efsm's can be made from */
+typedef struct efsm_def {
+    void *data;
+} efsm_def_t;
+
 /**
  * efsm transition code callback
  *
@@ -59,6 +67,33 @@ typedef void (*efsm_transition_cb_t) (int pre_state, int msg, int post_state);
 
 typedef void (*efsm_fsa_dcb_t) (void *data);
 
+/** called with each message a fsa throws away unprocessed */
+typedef void (*efsm_fsa_drop_cb_t) (void *fsa_data, int type, void *msg_data);
+
+/** called with a message that failed in state, before it goes to drop_cb
+ *
+ * \see efsm_opts_t.on_error
+ */
+typedef void (*efsm_fsa_error_cb_t) (void *fsa_data, int state, int type,
+                                     void *msg_data);
+
+/** Number of priority lanes in each mailbox.  Lane 0 is where messages go
+ *  by default and higher lanes are always drained first */
+#define EFSM_PRIO_LANES 4
+
+/** or'd into a priority, delivering the message first drops everything
+ *  queued in lower lanes */
+#define EFSM_PRIO_FLUSH 0x100
+
+/** a rule's current_state or msg_type that matches anything.  Lookups take
+ *  the nearest match: the state's own rule for the message, then its
+ *  EFSM_ANY message rule, then the same in each ancestor (see
+ *  efsm_opts_t.state_parents) and finally the EFSM_ANY state rules */
+#define EFSM_ANY (-2)
+
+/** a next_state that leaves the fsa in whatever state it was in */
+#define EFSM_SAME (-3)
+
 typedef struct efsm_transition_rules {
     int current_state;
     int msg_type;
@@ -67,15 +102,306 @@ typedef struct efsm_transition_rules {
     int next_state;
 } efsm_transition_rules_t;
 
+/** a compiled stand in for a rules table's lookup and callbacks, usually
+ *  generated with EFSM_STATIC_DEFINE from efsm_static.h
+ *
+ * Runs the transition for type in state, calling transition_cb (if set) and
+ * then the rule's callback directly.
+ *
+ * \param[out] rule the index in the rules passed to efsm_new of the rule
+ *             that ran, or -1 if state doesn't handle type
+ *
+ * \return what the callback returned
+ */
+typedef int (*efsm_engine_t) (efsm_fsa_t * fsa, void *fsa_data, int state,
+                              int type, void *msg_data,
+                              efsm_transition_cb_t transition_cb, int *rule);
+
+/** a transition callback that takes every fsa due the same transition in a
+ *  pass of efsm_run at once, so the work can be done across them (with SIMD,
+ *  say) instead of one call per message
+ *
+ * fsas, fsa_data and msg_data hold n of each, in run queue order, and every
+ * message has the same type.  Each fsa's transition_cb has already been
+ * called.
+ *
+ * \param[out] results what an efsm_cb_t would have returned for each
+ */
+typedef void (*efsm_batch_cb_t) (efsm_fsa_t ** fsas, void **fsa_data,
+                                 void *transition_data, int type,
+                                 void **msg_data, int *results, size_t n);
+
+/** attaches a batch callback to the rule for (current_state, msg_type) */
+typedef struct efsm_batch_rule {
+    int current_state;          // may be EFSM_ANY
+    int msg_type;               // can't be EFSM_ANY
+    efsm_batch_cb_t code;
+} efsm_batch_rule_t;
+
+/** How efsm_new lays out its (state, msg) -> transition lookup */
+typedef enum efsm_dispatch {
+    EFSM_DISPATCH_AUTO = 0,     // dense when the table is dense enough, else hash
+    EFSM_DISPATCH_DENSE,        // [n_states][n_msgs] table, one indexed load
+    EFSM_DISPATCH_HASH,         // perfect hash on (state, msg), one probe
+    EFSM_DISPATCH_LINEAR,       // scan each state's transitions
+} efsm_dispatch_t;
+
+/** A message for the batch send APIs */
+typedef struct efsm_msg {
+    int type;
+    void *data;
+} efsm_msg_t;
+
+/** What a full mailbox does with another message
+ *
+ * \see efsm_fsa_opts_t.mailbox_limit
+ */
+typedef enum efsm_overflow {
+    EFSM_OVERFLOW_REJECT = 0,   // the send fails with errno EAGAIN
+    EFSM_OVERFLOW_DROP_OLDEST,  // the oldest lane 0 message makes room
+    EFSM_OVERFLOW_COALESCE,     // replaces the newest of its type, else reject
+    EFSM_OVERFLOW_NOTIFY,       // dropped, but the fsa is sent overflow_msg
+} efsm_overflow_t;
+
+/** What the efsm_run's do with a message that fails: no rule handles it, or
+ *  its callback returned -1 (or 1 with a next state other than -1)
+ *
+ * \see efsm_opts_t.on_error
+ */
+typedef enum efsm_on_error {
+    EFSM_ERROR_STOP = 0,        // return -1 at once, the message left queued
+    EFSM_ERROR_QUARANTINE,      // drop it and set the fsa aside
+    EFSM_ERROR_MSG,             // drop it and queue error_msg in its place
+} efsm_on_error_t;
+
 typedef struct efsm_opts {
     efsm_transition_cb_t transition_cb;
+
+    /** forces a dispatch layout.  The default picks based on density */
+    efsm_dispatch_t dispatch;
+
+    /** messages carved out of the first message slab.  0 for the default */
+    size_t msg_pool_initial;
+
+    /** upper bound on pooled messages.  Once it's hit efsm_fsa_send fails.
+     *  0 for unbounded */
+    size_t msg_pool_max;
+
+    /** fsa's carved out of the first fsa slab.  0 for the default */
+    size_t fsa_pool_initial;
+
+    /** time every transition callback for the latency histograms in
+     *  efsm_stats_t.  This reads the clock twice per transition
+     */
+    int stats_latency;
+
+    /** bytes of zeroed per fsa context allocated in the same block as each
+     *  fsa.  It's the fsa's data unless a hint is passed to efsm_fsa_new
+     *
+     * \see efsm_fsa_ctx
+     */
+    size_t fsa_ctx_size;
+
+    /** per message type priorities (a lane, optionally with EFSM_PRIO_FLUSH)
+     *  for efsm_fsa_send and the sends built on it, indexed by message type.
+     *  Types past n_msg_prio go in lane 0.  The table is copied
+     *
+     * \see efsm_fsa_send_prio
+     */
+    const int *msg_prio;
+    size_t n_msg_prio;
+
+    /** message types that coalesce, at most 64 of them.  Sending one of
+     *  these to a fsa that already has one queued is a no-op (the new data
+     *  goes to the fsa's drop_cb), so level triggered events like READABLE
+     *  cost one message and one callback however often they're sent.  A
+     *  type stops being pending just before its callback runs, so the
+     *  callback can send it again.  The array is copied
+     */
+    const int *coalesce;
+    size_t n_coalesce;
+
+    /** runs transitions in place of the dispatch table and the callbacks in
+     *  rules, which it has to have been generated from.  The table is still
+     *  built for everything else
+     *
+     * \see efsm_static.h
+     */
+    efsm_engine_t engine;
+
+    /** the largest payload efsm_fsa_send_inline takes.  Every pooled
+     *  message grows by this much (rounded up to a multiple of 8), as does
+     *  each ring slot once a ring gets its first inline message
+     */
+    size_t inline_size;
+
+    /** the parent of each state, or -1, indexed by state.  A state falls
+     *  back to its parent's rules for messages it has none for.  Parents
+     *  can't form a cycle, efsm_new fails if they do.  The array is read
+     *  during efsm_new only
+     */
+    const int *state_parents;
+    size_t n_state_parents;
+
+    /** the most self sends each message may chain, 0 to turn it off.  A by
+     *  reference, lane 0 send from a callback to its own fsa, with nothing
+     *  else queued behind the message being delivered, is delivered as soon
+     *  as the callback returns, from a small queue on the stack.  That
+     *  takes no pooled message and no extra pass, so an A -> B -> DESTROY
+     *  chain runs in one efsm_run.  Order is the same as without it, and
+     *  sends that don't qualify queue as usual.  efsm_run_parallel ignores
+     *  it
+     */
+    unsigned int run_to_completion;
+
+    /** batch callbacks, which replace the callbacks of the rules they
+     *  match (those can be NULL).  Each pass of efsm_run starts by grouping
+     *  the fsa's whose next message has one by transition, resolving each
+     *  (state, type) once per run of equal ones, and delivering every group
+     *  with one call.  Those fsa's get one message in that pass.  Every
+     *  other delivery, including efsm_run_budget and efsm_run_parallel,
+     *  calls them with n of 1.  efsm_new fails if one matches no rule or
+     *  there's an engine.  The array is read during efsm_new only
+     */
+    const efsm_batch_rule_t *batch;
+    size_t n_batch;
+
+    /** bytes each efsm_id_new fsa keeps its state in, 2 or 4 (the default).
+     *  States have to be below 0xffff with 2
+     */
+    size_t id_state_size;
+
+    /** give each id a void * of data, which is the fsa_data its callbacks
+     *  get.  Without it they get NULL
+     */
+    int id_data;
+
+    /** the destroy_cb, drop_cb and mailbox limit for every id */
+    const struct efsm_fsa_opts *id_fsa_opts;
+
+    /** the mailbox_limit, overflow and overflow_msg of fsa's that don't
+     *  have a mailbox_limit of their own.  0 for unbounded
+     *
+     * \see efsm_fsa_opts_t
+     */
+    size_t mailbox_limit;
+    efsm_overflow_t overflow;
+    int overflow_msg;
+
+    /** records in each thread's ring of transitions, rounded up to a power
+     *  of 2.  0 for no tracing
+     *
+     * \see efsm_trace_dump
+     */
+    size_t trace_records;
+
+    /** record one transition in every trace_sample, per thread, to keep the
+     *  cost of reading the clock down under load.  0 or 1 records them all.
+     *  Batch callbacks are always recorded
+     */
+    unsigned int trace_sample;
+
+    /** the states fsa's are created in, which efsm_verify follows the rules
+     *  from.  Without any, state 0.  The array is copied
+     */
+    const int *start_states;
+    size_t n_start_states;
+
+    /** the message types fsa's are sent, which efsm_verify checks each
+     *  state it reaches against.  Without any, every type a rule names.
+     *  The array is copied
+     */
+    const int *msg_types;
+    size_t n_msg_types;
+
+    /** EFSM_VERIFY_ flags for the findings that make efsm_new fail, along
+     *  with any efsm_add_rules or efsm_remove_rule that would leave one.
+     *  0 to check nothing
+     *
+     * \see efsm_verify
+     */
+    unsigned int verify;
+
+    /** what happens to a fsa whose message fails.  With anything but
+     *  EFSM_ERROR_STOP the pass carries on with every other fsa, and the
+     *  message goes to the fsa's error_cb and then its drop_cb
+     *
+     * o EFSM_ERROR_QUARANTINE: the fsa is taken off the run queue until
+     *   efsm_fsa_resume.  Sends still queue, but wait with the rest of its
+     *   mailbox, which isn't counted as pending
+     * o EFSM_ERROR_MSG: error_msg (with NULL data, in its usual lane) is
+     *   queued for the fsa's rules to handle, as an error transition.  An
+     *   error_msg that fails quarantines the fsa
+     *
+     * Failures in efsm_run_parallel are handled on the calling thread once
+     * the pass is over.  efsm_stats_t.errors counts them
+     */
+    efsm_on_error_t on_error;
+    int error_msg;
 } efsm_opts_t;
 
+/** counters for a slab pool
+ *
+ * \see efsm_msg_pool_stats
+ */
+typedef struct efsm_pool_stats {
+    size_t hits;                // allocations served from the freelist
+    size_t misses;              // allocations that had to grow (or failed)
+    size_t high_water;          // most elements ever in use at once
+    size_t in_use;              // elements currently handed out
+    size_t capacity;            // elements carved out of slabs
+} efsm_pool_stats_t;
+
 typedef struct efsm_fsa_opts {
     void *hint;
     efsm_fsa_dcb_t destroy_cb;
+
+    /** starting capacity of an inline ring buffer mailbox, which doubles
+     *  whenever it fills.  0 queues pooled messages in a list instead */
+    size_t mailbox_capacity;
+
+    /** called for messages dropped by EFSM_PRIO_FLUSH, by overflow or
+     *  still queued when the fsa is destroyed, so their data can be
+     *  released */
+    efsm_fsa_drop_cb_t drop_cb;
+
+    /** called for messages that fail with efsm_opts_t.on_error set */
+    efsm_fsa_error_cb_t error_cb;
+
+    /** the most messages the mailbox holds, counting every lane, before
+     *  sends go by overflow.  0 takes efsm_opts_t.mailbox_limit
+     *
+     * o EFSM_OVERFLOW_REJECT: the send fails with errno EAGAIN
+     * o EFSM_OVERFLOW_DROP_OLDEST: the oldest lane 0 message (not counting
+     *   one being delivered) goes to drop_cb, or it's a reject if there
+     *   isn't one
+     * o EFSM_OVERFLOW_COALESCE: the newest message of the same type in the
+     *   same lane goes to drop_cb and the new one takes its place, or it's
+     *   a reject if there isn't one
+     * o EFSM_OVERFLOW_NOTIFY: the message goes to drop_cb and overflow_msg
+     *   (with NULL data, in its usual lane) is queued past the limit, once
+     *   per time the mailbox fills
+     *
+     * Sends that can't fail back to their sender, from efsm_fsa_send_async
+     * or efsm_run_parallel's workers, go to drop_cb when they're rejected.
+     * Timers retry on the next tick.
+     */
+    size_t mailbox_limit;
+    efsm_overflow_t overflow;
+    int overflow_msg;
 } efsm_fsa_opts_t;
 
+/** A handle on a message scheduled with efsm_fsa_send_after
+ *
+ * Handles are plain values.  A handle whose timer already fired or was
+ * cancelled is simply stale, so it's always safe to pass to
+ * efsm_timer_cancel.  A zeroed handle refers to no timer.
+ */
+typedef struct efsm_timer {
+    void *timer;
+    unsigned long long id;
+} efsm_timer_t;
+
 /** sends a message to a fsa
  *
  * Messages aren't processed directly out of this function, efsm_run must be
@@ -84,10 +410,195 @@ typedef struct efsm_fsa_opts {
  * \param type the message type
  * \param data an opaque pointer that will be made available in the transition callback
  *
- * \return 0 for success, -1 for failure
+ * \return 0 for success, -1 for failure, with errno EAGAIN if the mailbox is
+ *         full and rejects it
+ *
+ * \see efsm_fsa_opts_t.mailbox_limit
  */
 int efsm_fsa_send(efsm_fsa_t * fsa, int type, void *data);
 
+/** \return the messages queued for a fsa, for producers to throttle on.
+ *          Workers of efsm_run_parallel only see their own fsa's right */
+size_t efsm_fsa_pending(efsm_fsa_t * fsa);
+
+/** sends a batch of messages to a fsa
+ *
+ * Equivalent to calling efsm_fsa_send for each message in order, but makes
+ * room in the mailbox once for the whole batch.  Either all of the messages
+ * are queued or none are, unless it would go over a mailbox_limit with a
+ * policy other than EFSM_OVERFLOW_REJECT, which then applies to each
+ * message in turn.  The batch always goes in lane 0.
+ *
+ * \param msgs the messages, in the order they'll be delivered
+ * \param n the number of messages
+ *
+ * \return 0 for success, -1 for failure
+ */
+int efsm_fsa_send_many(efsm_fsa_t * fsa, const efsm_msg_t * msgs, size_t n);
+
+/** sends the same message to a set of fsa's
+ *
+ * \param fsas the fsa's to deliver to, which must all belong to one efsm
+ * \param n the number of fsa's
+ *
+ * \return 0 for success, -1 if any fsa couldn't queue the message (it's still
+ *         delivered to the others)
+ */
+int efsm_fsa_send_multi(efsm_fsa_t ** fsas, size_t n, int type, void *data);
+
+/** sends the same message to every fsa in the efsm
+ *
+ * This walks the efsm's list of every fsa, so it costs one push per fsa.
+ *
+ * \return 0 for success, -1 if any fsa couldn't queue the message (it's still
+ *         delivered to the others)
+ */
+int efsm_broadcast(efsm_t * efsm, int type, void *data);
+
+/** sends a message to a fsa in a priority lane
+ *
+ * Each mailbox is drained highest lane first and in order within a lane.
+ * Lanes above 0 hold pooled messages, even for fsa's with a ring mailbox, so
+ * they're for the occasional CLOSE or ERROR rather than bulk traffic.  A
+ * message in a higher lane is picked up by the current pass if one is
+ * draining the fsa, ahead of whatever is still queued below it.
+ *
+ * \param prio a lane below EFSM_PRIO_LANES, optionally or'd with
+ *        EFSM_PRIO_FLUSH so the lanes below are emptied (through the fsa's
+ *        drop_cb) when this message comes up
+ *
+ * \return 0 for success, -1 for failure
+ */
+int efsm_fsa_send_prio(efsm_fsa_t * fsa, int prio, int type, void *data);
+
+/** sends a message whose payload is copied into the mailbox
+ *
+ * Like efsm_fsa_send, but up to efsm_opts_t.inline_size bytes of buf are
+ * copied into the message slot itself (a pooled message or the ring) and the
+ * callback's msg_data points at that copy.  It stays valid until the
+ * callback returns, or drop_cb returns for a dropped message, so there's
+ * nothing to allocate or free per message.  Copies are 8 byte aligned.
+ *
+ * \param buf the payload
+ * \param len its size, at most inline_size
+ *
+ * \return 0 for success, -1 for failure or if len is too big
+ */
+int efsm_fsa_send_inline(efsm_fsa_t * fsa, int type, const void *buf,
+                         size_t len);
+
+/** sends a message to a fsa from any thread
+ *
+ * Unlike everything else in efsm, this is safe to call concurrently with
+ * itself and with the thread driving the efsm.  Messages land in a lock free
+ * inbox on the efsm that efsm_run splices into the fsa mailboxes at the start
+ * of each pass.  Messages from a single thread arrive in the order they were
+ * sent.
+ *
+ * The fsa must not be destroyed while sends to it may still be in flight.
+ *
+ * \param type the message type
+ * \param data an opaque pointer that will be made available in the transition callback
+ *
+ * \return 0 for success, -1 for failure
+ */
+int efsm_fsa_send_async(efsm_fsa_t * fsa, int type, void *data);
+
+/** sends a message to a fsa once a delay has passed
+ *
+ * Timers live in a hierarchical timer wheel on the efsm with millisecond
+ * ticks.  Due timers are turned into ordinary sends at the start of efsm_run,
+ * efsm_run_budget and efsm_run_parallel, so a timer fires no earlier than its
+ * delay and no later than the first run after it.  Destroying the fsa cancels
+ * any of its timers that are still pending.
+ *
+ * \param delay_ms milliseconds from now
+ * \param type the message type
+ * \param data an opaque pointer that will be made available in the transition callback
+ *
+ * \return a handle for efsm_timer_cancel, with a NULL timer if out of memory
+ *
+ * \see efsm_next_timeout
+ */
+efsm_timer_t efsm_fsa_send_after(efsm_fsa_t * fsa, long long delay_ms,
+                                 int type, void *data);
+
+/** cancels a timer from efsm_fsa_send_after
+ *
+ * \param fsa the fsa the timer was set on
+ *
+ * \return 0 if the timer was cancelled, -1 if it had already fired or been
+ *         cancelled
+ */
+int efsm_timer_cancel(efsm_fsa_t * fsa, efsm_timer_t timer);
+
+/** reports when the next timer is due
+ *
+ * \return milliseconds until the earliest pending timer, 0 if one is already
+ *         due and -1 if there are none.  This is the timeout poll and
+ *         epoll_wait expect
+ */
+int efsm_next_timeout(efsm_t * efsm);
+
+/** Readiness to watch for with efsm_fsa_watch_fd */
+#define EFSM_FD_IN   0x1        // readable, hung up or in error
+#define EFSM_FD_OUT  0x2        // writable
+#define EFSM_FD_EDGE 0x4        // report each change once rather than while it holds
+
+/** turns readiness on an fd into messages for a fsa
+ *
+ * The fd is registered with the efsm's epoll set, with the watch itself as
+ * the event's data, so efsm_loop goes straight from a ready fd to a send into
+ * the fsa's mailbox.  The message's data is the fd.  Hang ups and errors are
+ * reported as msg_in if watching EFSM_FD_IN, else as msg_out.
+ *
+ * Watching an fd the fsa already watches replaces the events and messages.
+ * Watches go away with the fsa, but an fd has to be unwatched before it's
+ * closed.
+ *
+ * \param fd the fd to watch
+ * \param events EFSM_FD_IN and/or EFSM_FD_OUT, optionally with EFSM_FD_EDGE
+ * \param msg_in the message sent when the fd is readable
+ * \param msg_out the message sent when the fd is writable
+ *
+ * \return 0 for success, -1 for failure
+ *
+ * \see efsm_loop
+ */
+int efsm_fsa_watch_fd(efsm_fsa_t * fsa, int fd, int events, int msg_in,
+                      int msg_out);
+
+/** stops a fsa watching an fd
+ *
+ * \return 0 for success, -1 if the fsa wasn't watching it
+ */
+int efsm_fsa_unwatch_fd(efsm_fsa_t * fsa, int fd);
+
+/** runs one iteration of the event loop
+ *
+ * Waits for watched fds, due timers or async sends, delivers what's ready as
+ * messages and calls efsm_run once.  It doesn't wait at all if messages are
+ * already pending, and never waits past the next timer.
+ *
+ * \param timeout_ms the longest to wait, -1 for no limit
+ *
+ * \return the number of fd events delivered, -1 on error
+ */
+int efsm_loop_once(efsm_t * efsm, int timeout_ms);
+
+/** runs the event loop
+ *
+ * Calls efsm_loop_once until efsm_loop_stop is called or there's nothing left
+ * that could produce a message (no watched fds, timers or pending messages).
+ *
+ * \return 0 once stopped, -1 on error
+ */
+int efsm_loop(efsm_t * efsm);
+
+/** makes efsm_loop return after its current iteration.  Meant to be called
+ *  from transition callbacks */
+void efsm_loop_stop(efsm_t * efsm);
+
 /** Creates a new fsa
  *
  * The standard invocation looks like:
@@ -99,6 +610,68 @@ int efsm_fsa_send(efsm_fsa_t * fsa, int type, void *data);
  */
 efsm_fsa_t *efsm_fsa_new(efsm_t * efsm, int state, efsm_fsa_opts_t * opts);
 
+/** A fsa from efsm_id_new */
+typedef unsigned int efsm_id_t;
+
+/** What efsm_id_new returns on failure */
+#define EFSM_ID_NONE ((efsm_id_t)-1)
+
+/** creates a fsa that's stored as an id into dense tables rather than as an
+ *  efsm_fsa_t, for efsm's with millions of mostly idle fsa's
+ *
+ * While it's idle an id costs id_state_size bytes, plus a pointer with
+ * id_data, and nothing else: no fsa, no mailbox, no list links.  Sending
+ * it a message materializes it into a pooled fsa (about 240 bytes, found
+ * through a table of live ids at 16 bytes each) that runs exactly like one
+ * from efsm_fsa_new, and it's parked back into the tables the next time it
+ * runs out of messages without timers or fd watches.  Destroyed ids are
+ * reused.
+ *
+ * Ids don't take part in efsm_broadcast or efsm_snapshot and don't get a
+ * fsa_ctx_size context.
+ *
+ * \param data its data, if the efsm was created with id_data
+ *
+ * \return the id, or EFSM_ID_NONE if out of memory or state doesn't fit
+ */
+efsm_id_t efsm_id_new(efsm_t * efsm, int state, void *data);
+
+/** sends a message to an id, as efsm_fsa_send
+ *
+ * \return 0 for success, -1 if the id doesn't exist or out of memory
+ */
+int efsm_id_send(efsm_t * efsm, efsm_id_t id, int type, void *data);
+
+/** \return an id's state, or -1 if it doesn't exist */
+int efsm_id_state(efsm_t * efsm, efsm_id_t id);
+
+/** destroys an id, as efsm_fsa_destroy */
+void efsm_id_destroy(efsm_t * efsm, efsm_id_t id);
+
+/** materializes an id, for the efsm_fsa_t APIs
+ *
+ * The handle is good until the fsa next goes idle without timers or
+ * watches, so it isn't for efsm_fsa_send_async.  One nothing was sent to
+ * by the time the next efsm_run starts is parked then, so get it again
+ * after a run rather than keep it.  A fsa's callbacks can always use the
+ * one they're passed.
+ *
+ * \return the handle, or NULL if the id doesn't exist or out of memory
+ */
+efsm_fsa_t *efsm_id_fsa(efsm_t * efsm, efsm_id_t id);
+
+/** \return the id behind a fsa, or EFSM_ID_NONE if it's from efsm_fsa_new */
+efsm_id_t efsm_fsa_id(efsm_fsa_t * fsa);
+
+/** returns the context co-allocated with a fsa
+ *
+ * \return fsa_ctx_size bytes that live as long as the fsa, or NULL if the
+ *         efsm was created without a fsa_ctx_size or it's an id
+ *
+ * \see efsm_opts_t
+ */
+void *efsm_fsa_ctx(efsm_fsa_t * fsa);
+
 /** destroys a fsa
  *
  * This will call the fsa's destroy callback if one was supplied
@@ -107,6 +680,13 @@ efsm_fsa_t *efsm_fsa_new(efsm_t * efsm, int state, efsm_fsa_opts_t * opts);
  */
 void efsm_fsa_destroy(efsm_fsa_t * fsa);
 
+/** puts a fsa quarantined by EFSM_ERROR_QUARANTINE back to work on what's
+ *  left in its mailbox
+ *
+ * \return 0 for success, -1 if it isn't quarantined
+ */
+int efsm_fsa_resume(efsm_fsa_t * fsa);
+
 /** creates a new efsm
  *
  * The standard invocation looks like:
@@ -123,6 +703,71 @@ void efsm_fsa_destroy(efsm_fsa_t * fsa);
  */
 efsm_t *efsm_new(efsm_transition_rules_t * rules, efsm_opts_t * opts);
 
+/** compiles rules into a definition efsm's can share
+ *
+ * Only the parts of opts that describe the machine are read: dispatch,
+ * engine, state_parents, batch, start_states, msg_types and verify.  The
+ * result is read only, so efsm's made from it can be used on different
+ * threads at once, and it's reference counted so it can be released as soon
+ * as they're made.
+ *
+ * \return a def with one reference, or NULL on failure
+ *
+ * \see efsm_new_from_def
+ */
+efsm_def_t *efsm_def_compile(efsm_transition_rules_t * rules,
+                             efsm_opts_t * opts);
+
+/** takes another reference to a def.  Safe from any thread
+ *
+ * \return def
+ */
+efsm_def_t *efsm_def_ref(efsm_def_t * def);
+
+/** drops a reference to a def, freeing it with the last.  Safe from any
+ *  thread */
+void efsm_def_release(efsm_def_t * def);
+
+/** creates a new efsm from a compiled def, which it holds a reference to
+ *
+ * Nothing is compiled, so this is just pools and counters.  The machine
+ * parts of opts (those efsm_def_compile reads) are ignored in favour of the
+ * def's.  efsm_new(rules, opts) is efsm_def_compile and this.
+ *
+ * \param opts an optional pointer with parameters to new
+ */
+efsm_t *efsm_new_from_def(efsm_def_t * def, efsm_opts_t * opts);
+
+/** adds rules to an efsm that's already running
+ *
+ * A rule replaces any the efsm has for the same (state, type).  The rules
+ * are compiled, with the ones the efsm already has, into a new def that
+ * takes the place of the efsm's, leaving every fsa and message where it is
+ * and carrying the counters of the rules that stay over.  From a callback
+ * the new def waits for the efsm_run (or efsm_run_budget or
+ * efsm_run_parallel pass) to finish on the old one, after which every
+ * worker uses it.  Other efsm's made from the same def keep it.  Call it
+ * from the thread that runs the efsm, not from efsm_run_parallel callbacks
+ * on its other threads.
+ *
+ * \param rules an array of transition_rules ending with a rule with a state of -1
+ *
+ * \return 0 for success, -1 if the efsm has an engine made from its rules,
+ *         the new rules fail efsm_opts_t.verify or compiling fails
+ */
+int efsm_add_rules(efsm_t * efsm, efsm_transition_rules_t * rules);
+
+/** removes an efsm's rules for (state, type), the way efsm_add_rules adds
+ *
+ * Either can be EFSM_ANY, for the rules written with it.  States stay even
+ * once no rule mentions them, so fsa's in them just stop handling type.
+ *
+ * \return 0 for success, -1 if there's no rule for state and type, the efsm
+ *         has an engine, what's left fails efsm_opts_t.verify or compiling
+ *         fails
+ */
+int efsm_remove_rule(efsm_t * efsm, int state, int type);
+
 /** destroys an efsm
  * 
  * This calls efsm_fsa_destroy on each current fsa before returning
@@ -141,6 +786,368 @@ void efsm_destroy(efsm_t * efsm);
  */
 int efsm_run(efsm_t * efsm);
 
+/** reports the dispatch layout efsm_new settled on
+ *
+ * Never returns EFSM_DISPATCH_AUTO
+ */
+efsm_dispatch_t efsm_dispatch(efsm_t * efsm);
+
+/** reports usage of the efsm's message pool
+ *
+ * \param[out] stats filled in with the current counters
+ */
+void efsm_msg_pool_stats(efsm_t * efsm, efsm_pool_stats_t * stats);
+
+/** runs the efsm for a bounded amount of work
+ *
+ * Processes at most max_msgs messages or for about max_ns nanoseconds,
+ * whichever comes first, then returns.  The next call picks up round robin
+ * from where this one stopped, so a chatty fsa that used up the budget goes
+ * to the back of the line.  Unlike efsm_run, this keeps starting new passes
+ * over the fsa's with work until the budget is spent.
+ *
+ * \param max_msgs most messages to process.  0 for no limit
+ * \param max_ns rough time limit, checked between fsa's and every few
+ *        messages.  0 for no limit
+ *
+ * \return the number of messages still queued (async sends not yet picked
+ *         up count as 1), so 0 if no more work to do.  -1 on error
+ */
+long efsm_run_budget(efsm_t * efsm, size_t max_msgs, long long max_ns);
+
+/** runs the efsm on a pool of worker threads
+ *
+ * This is one pass of efsm_run spread over n_threads threads, counting the
+ * caller, which works as well.  Active fsa's are sharded across the workers
+ * by id and workers that run out of their own fsa's steal whole fsa's from
+ * the others, so all of a fsa's callbacks in a pass happen on one thread.
+ * The worker threads stick around between calls and are joined by
+ * efsm_destroy.
+ *
+ * While a pass is running:
+ * o efsm_fsa_send from callbacks is buffered per worker and delivered once
+ *   every worker is done, so every message waits for the next pass
+ * o efsm_fsa_destroy from callbacks is deferred the same way, as is the
+ *   destroy for callbacks that return 1 (destroy callbacks run on the
+ *   calling thread)
+ * o efsm_fsa_new from callbacks is serialized with a lock
+ * o transition_cb may be called from any of the workers
+ *
+ * \param n_threads the number of threads to run on.  1 or less is efsm_run
+ *
+ * \return 0 if no more work to do.  1 if more work to do. -1 on error
+ */
+int efsm_run_parallel(efsm_t * efsm, int n_threads);
+
+/** reports usage of the efsm's fsa pool
+ *
+ * \param[out] stats filled in with the current counters
+ */
+void efsm_fsa_pool_stats(efsm_t * efsm, efsm_pool_stats_t * stats);
+
+/** Number of log2 buckets in the histograms in efsm_stats_t */
+#define EFSM_STATS_BUCKETS 32
+
+/** Counters for one transition in a efsm_stats_t */
+typedef struct efsm_stats_transition {
+    int state;
+    int msg_type;
+    int next_state;
+
+    /** times the transition's callback was invoked */
+    unsigned long long count;
+
+    /** bucket b counts callbacks that took [2^b, 2^(b+1)) nanoseconds.  All
+     *  zero unless the efsm was created with stats_latency */
+    unsigned long long latency[EFSM_STATS_BUCKETS];
+} efsm_stats_transition_t;
+
+/** A snapshot of an efsm's counters
+ *
+ * \see efsm_stats_get
+ */
+typedef struct efsm_stats {
+    /** one entry per transition rule */
+    int n_transitions;
+    efsm_stats_transition_t *transitions;
+
+    /** the deepest any mailbox has been */
+    size_t mailbox_high_water;
+
+    /** calls to efsm_run, efsm_run_budget and efsm_run_parallel, and the
+     *  messages they processed */
+    unsigned long long runs;
+    unsigned long long msgs;
+
+    /** messages that failed and were handled by efsm_opts_t.on_error */
+    unsigned long long errors;
+
+    /** bucket b counts runs that processed [2^b, 2^(b+1)) messages, with
+     *  runs that processed none in bucket 0 */
+    unsigned long long run_msgs[EFSM_STATS_BUCKETS];
+} efsm_stats_t;
+
+/** snapshots the efsm's counters
+ *
+ * Counting is one increment per transition on the thread doing the work and
+ * can be compiled out altogether with -DEFSM_NO_STATS.  Per thread counters
+ * from efsm_run_parallel's workers are merged here, so call it from the
+ * thread driving the efsm, outside of a run.
+ *
+ * \param[out] stats filled in with the counters.  Release it with
+ *              efsm_stats_release
+ *
+ * \return 0 for success, -1 if out of memory or the stats are compiled out
+ */
+int efsm_stats_get(efsm_t * efsm, efsm_stats_t * stats);
+
+/** frees the memory held by a snapshot from efsm_stats_get */
+void efsm_stats_release(efsm_stats_t * stats);
+
+#define EFSM_VERIFY_UNREACHABLE 0x1     // states no start state leads to
+#define EFSM_VERIFY_MISSING     0x2     // types a reached state has no rule for
+#define EFSM_VERIFY_DEAD_MSGS   0x4     // types no reached state has a rule for
+#define EFSM_VERIFY_NO_EXIT     0x8     // reached states that can't be left
+#define EFSM_VERIFY_ALL         0xf
+
+/** a message type a state has no rule for */
+typedef struct efsm_verify_gap {
+    int state;
+    int msg_type;
+} efsm_verify_gap_t;
+
+/** What efsm_verify found, each list in state or type order
+ *
+ * \see efsm_verify
+ */
+typedef struct efsm_verify_report {
+    /** states none of the start states lead to */
+    int *unreachable;
+    size_t n_unreachable;
+
+    /** (state, type) pairs a reached state can't deliver */
+    efsm_verify_gap_t *missing;
+    size_t n_missing;
+
+    /** message types nothing reached has a rule for */
+    int *dead_msgs;
+    size_t n_dead_msgs;
+
+    /** reached states with no rule to another state, or to destroy, so
+     *  their fsa's stay in them for good */
+    int *no_exit;
+    size_t n_no_exit;
+} efsm_verify_report_t;
+
+/** checks an efsm's rules against its start_states and msg_types
+ *
+ * This walks the compiled table, resolving each message type in each state
+ * the way delivery does, wildcard rules and parents included, and following
+ * every rule it finds to its next state.  It's what efsm_opts_t.verify runs
+ * at efsm_new, which fails without saying why; this says.
+ *
+ * \param[out] report filled in with the findings.  Release it with
+ *              efsm_verify_release
+ *
+ * \return the number of findings, or -1 if out of memory
+ */
+long efsm_verify(efsm_t * efsm, efsm_verify_report_t * report);
+
+/** frees the lists in a report from efsm_verify */
+void efsm_verify_release(efsm_verify_report_t * report);
+
+/** where efsm_snapshot sends a snapshot */
+typedef struct efsm_writer {
+    /** appends len bytes to the snapshot
+     *
+     * \return 0 for success, -1 to abort the snapshot
+     */
+    int (*write) (void *ctx, const void *buf, size_t len);
+    void *ctx;
+
+    /** optional, serializes a fsa's data into *blob, which has to stay
+     *  valid until the next call.  Context from fsa_ctx_size is saved
+     *  without it
+     */
+    int (*save_fsa) (void *ctx, efsm_fsa_t * fsa, void *fsa_data,
+                     const void **blob, size_t *len);
+
+    /** optional, the same for the data of a queued message that wasn't sent
+     *  inline.  Without it the pointer itself is saved, which is only good
+     *  for restoring into the same process
+     */
+    int (*save_msg) (void *ctx, efsm_fsa_t * fsa, int type, void *msg_data,
+                     const void **blob, size_t *len);
+} efsm_writer_t;
+
+/** where efsm_restore reads a snapshot from */
+typedef struct efsm_reader {
+    /** reads exactly len bytes of the snapshot
+     *
+     * \return 0 for success, -1 to abort the restore
+     */
+    int (*read) (void *ctx, void *buf, size_t len);
+    void *ctx;
+
+    /** optional, rebuilds a fsa's data from what save_fsa wrote.
+     *  *fsa_data starts out as the fsa's restored context, or NULL
+     */
+    int (*load_fsa) (void *ctx, efsm_fsa_t * fsa, const void *blob,
+                     size_t len, void **fsa_data);
+
+    /** optional, rebuilds a message's data from what save_msg wrote */
+    int (*load_msg) (void *ctx, efsm_fsa_t * fsa, int type, const void *blob,
+                     size_t len, void **msg_data);
+
+    /** the destroy_cb, drop_cb and mailbox limit for restored fsa's.  They
+     *  get back the mailbox kind and capacity they had */
+    efsm_fsa_opts_t *fsa_opts;
+} efsm_reader_t;
+
+/** saves every fsa: its state, context, data (through save_fsa) and queued
+ *  messages, with inline payloads
+ *
+ * The format is a header followed by one record per fsa, each made of fixed
+ * size headers and length prefixed blobs padded to 8 bytes, so it can be
+ * streamed or mapped and read in place.  It's in native byte order and only
+ * restores into an efsm built from the same rules with at least the same
+ * inline_size and fsa_ctx_size.  Pending timers and fd watches aren't
+ * saved.  Call it between runs.
+ *
+ * \return 0 for success, -1 if a callback failed
+ */
+int efsm_snapshot(efsm_t * efsm, efsm_writer_t * writer);
+
+/** recreates the fsa's in a snapshot, after any the efsm already has
+ *
+ * The fsa's, and the messages they had queued, are carved out of the pools
+ * in one go rather than an efsm_fsa_new at a time.  If any part of the
+ * snapshot can't be read or loaded the fsa's restored so far are destroyed.
+ *
+ * \return the number of fsa's restored, or -1 on failure
+ */
+long efsm_restore(efsm_t * efsm, efsm_reader_t * reader);
+
+/** or'd into efsm_trace_rec_t.fsa for an fsa from efsm_id_new, whose
+ *  efsm_id_t is the rest */
+#define EFSM_TRACE_ID (1ULL << 63)
+
+/** A transition in a trace ring.  Ticks are the TSC where there is one and
+ *  nanoseconds otherwise, efsm_trace_hdr_t has what's needed to convert
+ *
+ * Batch callbacks split their time equally between their fsa's.
+ */
+typedef struct efsm_trace_rec {
+    uint64_t start;             // ticks when the callback started
+    uint64_t fsa;               // the fsa's id, which is unique in the efsm
+    int32_t pre_state;
+    int32_t msg;
+    int32_t post_state;         // -1 if it was destroyed, pre_state on error
+    uint32_t ticks;             // how long the callback took, saturating
+} efsm_trace_rec_t;
+
+/** What an efsm_trace_dump starts with
+ *
+ * Two (ticks, CLOCK_MONOTONIC nanoseconds) pairs, from when the efsm was
+ * created and from the dump, map ticks onto the clock.  Then each ring
+ * follows as an efsm_trace_ring_t and its records, oldest first.
+ */
+typedef struct efsm_trace_hdr {
+    char magic[8];              // EFSM_TRACE_MAGIC, not terminated
+    uint64_t ticks0, ns0;
+    uint64_t ticks1, ns1;
+    uint32_t n_rings;
+    uint32_t record_size;       // sizeof(efsm_trace_rec_t)
+} efsm_trace_hdr_t;
+
+#define EFSM_TRACE_MAGIC "efsmtrc1"
+
+typedef struct efsm_trace_ring {
+    uint32_t thread;            // 0 outside efsm_run_parallel, else 1 + worker
+    uint32_t pad;
+    uint64_t n_records;
+    uint64_t n_lost;            // overwritten by newer ones
+} efsm_trace_ring_t;
+
+/** writes out the trace rings kept with efsm_opts_t.trace_records
+ *
+ * Each thread that runs transitions (the one calling efsm_run and
+ * friends, and each of efsm_run_parallel's workers) has its own ring that
+ * only it writes, so recording is a few stores into a fixed 32 byte record.
+ * Call this from the thread driving the efsm, outside of a run.  The rings
+ * are left as they are.  tools/efsm_trace.c converts dumps into Chrome
+ * trace or plain text.
+ *
+ * \return 0 for success, -1 if the efsm isn't tracing or the writer failed
+ */
+int efsm_trace_dump(efsm_t * efsm, efsm_writer_t * writer);
+
+#define EFSM_GRAPH_MAGIC "efsmgrf1"
+
+/** what efsm_graph writes */
+typedef enum efsm_graph_format {
+    /** dot for graphviz, as efsm_pp prints it */
+    EFSM_GRAPH_DOT = 0,
+
+    /** one object with a "states" array of {"id","name"} and an "edges"
+     *  array of {"from","msg","to","label"}, plus "count" with counts.
+     *  States and types hold the values rules use: EFSM_ANY, EFSM_SAME and
+     *  -1 for destroy */
+    EFSM_GRAPH_JSON,
+
+    /** an efsm_graph_hdr_t, (n_states + 1) uint32_t offsets into the edges
+     *  padded to 8 bytes, then n_edges efsm_graph_edge_t.  The edges of
+     *  state i are [offsets[i], offsets[i + 1]) */
+    EFSM_GRAPH_BINARY,
+} efsm_graph_format_t;
+
+/** What an EFSM_GRAPH_BINARY export starts with, in native byte order */
+typedef struct efsm_graph_hdr {
+    char magic[8];              // EFSM_GRAPH_MAGIC, not terminated
+    uint32_t n_states;          // including the EFSM_ANY one, if any
+    int32_t any_state;          // the index holding EFSM_ANY rules, or -1
+    uint32_t n_edges;
+    uint32_t edge_size;         // sizeof(efsm_graph_edge_t)
+} efsm_graph_hdr_t;
+
+/** A transition in an EFSM_GRAPH_BINARY export */
+typedef struct efsm_graph_edge {
+    int32_t msg_type;           // EFSM_ANY for wildcard rules
+    int32_t next_state;         // -1 for destroy, or EFSM_SAME
+    uint64_t count;             // 0 without efsm_graph_opts_t.counts
+} efsm_graph_edge_t;
+
+/** Options for efsm_graph, all optional */
+typedef struct efsm_graph_opts {
+    efsm_graph_format_t format;
+
+    /** names to print for the first n_state_names states and n_msg_names
+     *  message types.  Anything past them, or NULL, prints as its number */
+    const char *const *state_names;
+    size_t n_state_names;
+    const char *const *msg_names;
+    size_t n_msg_names;
+
+    /** overlays each transition's count from efsm_stats_get: in the label
+     *  and as a penwidth scaled to the busiest transition for dot, as a
+     *  field otherwise */
+    int counts;
+} efsm_graph_opts_t;
+
+/** streams the efsm's transitions to a writer as a graph
+ *
+ * Output goes out in chunks of a few kilobytes as it's formatted, so
+ * machines of any size export in constant memory, one pass over the
+ * compiled table.  With counts, call it where efsm_stats_get can be.
+ *
+ * \param opts NULL for dot with states and types as numbers
+ *
+ * \return 0 for success, -1 if the writer failed, out of memory or counts
+ *         were asked for with the stats compiled out
+ */
+int efsm_graph(efsm_t * efsm, efsm_writer_t * writer,
+               const efsm_graph_opts_t * opts);
+
 /** pretty prints the efsm in dot notation
  *
  * This produces a string suitable to pass to graphviz in the form of dot syntax.
@@ -153,6 +1160,10 @@ int efsm_run(efsm_t * efsm);
  *
  * \param state_names the names of the states used in the machine
  * \param transition_names the names of the messages used in the machine
+ *
+ * \return the string, which the caller frees, or NULL if out of memory
+ *
+ * \see efsm_graph, which streams instead and needn't name everything
  */
 char *efsm_pp(efsm_t * efsm, char **state_names, char **transition_names);
 
@@ -8,73 +8,672 @@
  *
  * \see efsm.h
  */
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+
 #include "efsm.h"
 
 /** Valid fsa statuses */
 enum efsm__fsa_status {
-    EFSM_FSA_NEW,               // New fsa or with a new message in an iteration of run
-    EFSM_FSA_ACTIVE,            // Has messages in queue
-    EFSM_FSA_INACTIVE,          // no messages in queue
+    EFSM_FSA_IDLE,              // no messages in queue, not on the run queue
+    EFSM_FSA_RUNNABLE,          // on the run queue, or being drained off it
+    EFSM_FSA_QUARANTINED,       // off the run queue after a failed message
+    EFSM_FSA_DEAD,              // destroyed, async messages may still name it
 };
 
 struct efsm;
 struct efsm__fsa;
 struct efsm__msg;
+struct efsm__wheel;
+struct efsm__loop;
+
+/** Wraps statements that only exist when stats are compiled in */
+#ifdef EFSM_NO_STATS
+#define EFSM__STATS(x)
+#else
+#define EFSM__STATS(x) x
+#endif
+
+/** A block of counters, one per thread doing work
+ *
+ * \see efsm_stats_get
+ */
+typedef struct efsm__stats {
+    unsigned long long *transitions;    // per packed transition
+    unsigned long long *latency;        // EFSM_STATS_BUCKETS per transition, if timing
+
+    unsigned long long runs;
+    unsigned long long msgs;
+    unsigned long long run_msgs[EFSM_STATS_BUCKETS];
+    unsigned long long errors;
+
+    size_t mailbox_high_water;
+} efsm__stats_t;
+
+/** An element sitting on a pool's freelist, overlaid on the element itself */
+typedef struct efsm__pool_free {
+    struct efsm__pool_free *next;
+} efsm__pool_free_t;
+
+/** Header for a chunk of elements carved out of a single allocation */
+typedef struct efsm__pool_slab {
+    struct efsm__pool_slab *next;
+} efsm__pool_slab_t;
+
+/** A fixed element size slab allocator with an intrusive freelist */
+typedef struct efsm__pool {
+    size_t size;                // element size, rounded for alignment
+    size_t initial;             // elements in the first slab
+    size_t max;                 // max elements across all slabs, 0 for unbounded
 
-/** Transitions between state A -> B */
+    efsm__pool_free_t *free;
+    efsm__pool_slab_t *slabs;
+
+    efsm_pool_stats_t stats;
+} efsm__pool_t;
+
+/** Transitions between state A -> B
+ *
+ * This is the hot half of a transition, the only part dispatch touches.  The
+ * callback lives at the same index in the cold efsm__transition_code_t array
+ */
 typedef struct efsm__transition {
     int msg_type;               // The msg type to match from efsm_fsa_send
-    efsm_cb_t code;             // callback that's run
-    void *data;                 // parameter to the callbac
     int next_state;             // Where we transition to
 } efsm__transition_t;
 
-/** States, which are really just a list of possible transitions */
-typedef struct efsm__state {
+/** The cold half of a transition, only touched once it fires */
+typedef struct efsm__transition_code {
+    efsm_cb_t code;             // callback that's run
+    void *data;                 // parameter to the callbac
+    efsm_batch_cb_t batch;      // run instead of code if set
+} efsm__transition_code_t;
+
+/** A slot in the perfect hash dispatch table */
+typedef struct efsm__hash_slot {
+    int state;                  // -1 for an empty slot
+    int msg_type;
+    int transition;             // index into the packed transitions
+} efsm__hash_slot_t;
+
+/** A message sent with efsm_fsa_send_async, waiting in the efsm's inbox */
+typedef struct efsm__async {
+    struct efsm__fsa *fsa;
+    int prio;
+    int type;
+    void *data;
+    long len;                   // -1, or the size of payload for data
+
+    struct efsm__async *next;
+
+    /** A copy of an inline send's payload */
+    unsigned char payload[];
+} efsm__async_t;
+
+/** A send or destroy made from a callback during efsm_run_parallel */
+typedef struct efsm__deferred {
+    struct efsm__fsa *fsa;
+    int prio;
+    int type;
+    void *data;
+    long len;                   // -1, or the size of an inline payload
+    size_t offset;              // of the payload in the worker's payload
+    int destroy;                // efsm_fsa_destroy rather than a send
+} efsm__deferred_t;
+
+/** A thread in efsm_run_parallel, along with the shard of fsa's it owns
+ *
+ * Anything a worker would do to state shared across fsa's is recorded here
+ * instead and applied by the calling thread once every worker is done.
+ */
+typedef struct efsm__worker {
+    struct efsm_ *efsm;
+    int index;
+    pthread_t thread;
+
+    /** The shard, and the next unclaimed fsa in it.  Thieves claim from the
+     *  same counter */
+    struct efsm__fsa **fsas;
+    unsigned int n_fsas;
+    _Atomic unsigned int next;
+
+    /** Buffered sends and destroys from callbacks */
+    efsm__deferred_t *deferred;
+    size_t n_deferred;
+    size_t deferred_size;
+
+    /** Copies of the payloads of buffered inline sends */
+    unsigned char *payload;
+    size_t payload_len;
+    size_t payload_size;
+
+    /** Counters for transitions run on this worker */
+    efsm__stats_t stats;
+
+    /** List mailbox messages drained in this pass, for the message pool,
+     *  and the number of messages drained in total */
+    efsm__pool_free_t *consumed;
+    size_t n_drained;
+
+    /** Whether a destroy wasn't buffered and went on the fsa's
+     *  destroy_asked instead */
+    int lost_destroys;
+
+    /** Keep workers off each other's cache lines */
+    char pad[64];
+} efsm__worker_t;
+
+/** State for efsm_run_parallel's worker pool */
+typedef struct efsm__par {
+    int n_threads;
+    efsm__worker_t *workers;    // workers[0] is the calling thread
+
+    /** Active fsa's for the pass, grouped by shard */
+    struct efsm__fsa **fsas;
+    size_t fsas_size;
+
+    /** fsa's to destroy once the pass is over */
+    struct efsm__fsa **doomed;
+    size_t n_doomed;
+    size_t doomed_size;
+
+    /** Set if doomed couldn't grow, so some are only marked doomed */
+    int doom_scan;
+
+    /** Set when a fsa fails so workers stop claiming new ones */
+    atomic_int failed;
+
+    /** Serializes efsm_fsa_new from callbacks */
+    pthread_mutex_t lock;
+
+    /** Starts and finishes passes.  Bumping generation starts a pass */
+    pthread_mutex_t mutex;
+    pthread_cond_t start;
+    pthread_cond_t done;
+    unsigned int generation;
+    int n_running;
+    int stop;
+} efsm__par_t;
+
+/** A compiled machine definition
+ *
+ * Read only once efsm_def_compile returns, so any number of efsm's on any
+ * number of threads can share it.  Each holds a reference.
+ */
+typedef struct efsm__def {
+    efsm_def_t wrapper;
+    atomic_int refs;
+
+    /** States in CSR form.  State i's transitions are packed in
+     *  transitions[offsets[i]] to transitions[offsets[i + 1]] */
+    int n_states;
     int n_transitions;
+    int *offsets;               // n_states + 1 entries
     efsm__transition_t *transitions;
-} efsm__state_t;
+    efsm__transition_code_t *codes;
+
+    /** Compiled (state, msg) -> transition lookup */
+    efsm_dispatch_t dispatch;
+    int n_msgs;                 // msg types covered by the dense table
+    int *dense;                 // [n_states * n_msgs] of transition index or -1
+    efsm__hash_slot_t *hash;    // 1 << hash_bits slots
+    int hash_bits;
+    unsigned int hash_seed;
+
+    /** Wildcard and inherited rules, NULL without any.  A lookup that
+     *  misses in a state tries its (state, EFSM_ANY) rule, then moves up to
+     *  the nearest ancestor with rules of its own, ending at root: the
+     *  extra last state that EFSM_ANY state rules are packed under */
+    int *any_msg;               // [n_states] transition index or -1
+    int *up;                    // [n_states] next state to try or -1
+    int root;                   // -1 without EFSM_ANY state rules
+
+    /** efsm_opts_t.engine, with the packed transition of each rule it
+     *  reports */
+    efsm_engine_t engine;
+    int *rule_map;              // [n_transitions]
+
+    /** Transitions with a batch callback */
+    int n_batch;
+
+    /** What efsm_add_rules recompiles with: the dispatch asked for, which
+     *  may have been auto, and copies of the state parents and of what
+     *  efsm_verify checks against */
+    efsm_dispatch_t dispatch_opt;
+    int *parents;
+    size_t n_parents;
+    int *start_states;
+    size_t n_start_states;
+    int *msg_types;
+    size_t n_msg_types;
+    unsigned int verify;
+} efsm__def_t;
+
+/** efsm_run's scratch for delivering batches, grown to the largest pass */
+typedef struct efsm__batch {
+    size_t *counts;             // [n_transitions] fsa's due each transition
+    size_t *offsets;            // [n_transitions] where its group goes
+    int *groups;                // transitions with any, in the order seen
+
+    /** Each group's fsa's, and what's handed to its callback */
+    struct efsm__fsa **members;
+    int *prios;                 // the lane each message was peeked from
+    efsm_fsa_t **fsas;
+    void **fsa_data;
+    void **msg_data;
+    int *results;
+    size_t size;
+} efsm__batch_t;
+
+/** Self sends a fsa's callbacks make with run to completion on */
+#define EFSM__RTC_SLOTS 8
+
+/** The continuation queue on the stack of a serial drain
+ *
+ * A callback's by reference lane 0 send to its own fsa lands here instead of
+ * the mailbox as long as that doesn't reorder it, which is while nothing but
+ * the message being delivered is queued.  Anything else the fsa is sent
+ * first spills the queue into the mailbox.
+ */
+typedef struct efsm__rtc {
+    struct efsm__fsa *fsa;      // the fsa being drained
+    unsigned int queued;        // 1 while a mailbox message is delivered
+    unsigned int left;          // continuations the message may still add
+    unsigned int head;
+    unsigned int n;             // including the one being delivered
+    unsigned int busy;          // 1 while the head is being delivered
+    struct {
+        int type;
+        void *data;
+    } slots[EFSM__RTC_SLOTS];
+} efsm__rtc_t;
+
+/** A materialized id, in efsm__ids_t's table of them */
+typedef struct efsm__id_live {
+    efsm_id_t id;
+    struct efsm__fsa *fsa;      // NULL for an empty slot
+} efsm__id_live_t;
+
+/** fsa's from efsm_id_new
+ *
+ * An idle id is just its entries in states and data.  One that's got
+ * messages, or a handle from efsm_id_fsa, is materialized into a fsa from
+ * the fsa pool, found through live, and parked back into the tables once
+ * it's idle again, or at the next run for a handle nothing was sent to.
+ */
+typedef struct efsm__ids {
+    size_t state_size;          // 2 or 4
+    void *states;               // uint16_t or uint32_t, all ones when free
+    void **data;                // NULL without id_data
+    size_t n;                   // ids handed out, freed ones included
+    size_t capacity;
+
+    /** Destroyed ids, reused last in first out */
+    efsm_id_t *free;
+    size_t n_free;
+    size_t free_size;
+
+    /** Open addressed on the id with linear probing */
+    efsm__id_live_t *live;
+    size_t live_mask;
+    size_t n_live;
+
+    /** Materialized by efsm_id_fsa, parked at the next efsm_run if they're
+     *  still idle then */
+    efsm_id_t *handed;
+    size_t n_handed;
+    size_t handed_size;
+
+    /** efsm_opts_t.id_fsa_opts, zeroed without them */
+    efsm_fsa_opts_t opts;
+} efsm__ids_t;
+
+/** A thread's ring of trace records, which only that thread writes */
+typedef struct efsm__trace {
+    efsm_trace_rec_t *recs;
+    unsigned long long n;       // records ever written, the newest at n - 1
+
+    /** Transitions until the next one that's recorded */
+    unsigned int countdown;
+} efsm__trace_t;
 
 /** The internal efsm struct */
 typedef struct efsm_ {
-    int n_states;
-    struct efsm__state *states;
+    /** The rules, compiled */
+    efsm__def_t *def;
+
+    /** A def from efsm_add_rules or efsm_remove_rule made during a pass,
+     *  swapped in once it's over, and how many efsm_run's are under way */
+    efsm__def_t *def_next;
+    int in_run;
+
+    /** Every fsa, in creation order */
+    struct efsm__fsa *fsas;
 
-    struct efsm__fsa *queued;
-    struct efsm__fsa *actives;
-    struct efsm__fsa *inactives;
+    /** fsa's with messages, each added once when its mailbox stops being
+     *  empty.  A pass of efsm_run works off the head until it reaches fsa's
+     *  stamped with the pass's number, which were queued during it */
+    struct efsm__fsa *runq;
+    unsigned long pass;
 
     /** An optional callback for each transition */
     efsm_transition_cb_t transition_cb;
+
+    /** Counters for work done on the thread driving the efsm */
+    efsm__stats_t stats;
+    int stats_latency;
+
+    /** Backing store for every efsm__msg_t */
+    efsm__pool_t msg_pool;
+
+    /** Backing store for every efsm__fsa_t, each followed by fsa_ctx_size
+     *  bytes of context at ctx_offset */
+    efsm__pool_t fsa_pool;
+    size_t fsa_ctx_size;
+    size_t ctx_offset;
+
+    /** Messages from efsm_fsa_send_async, newest first.  Producers push with
+     *  a CAS and efsm_run takes the whole stack with an exchange */
+    _Atomic(efsm__async_t *) inbox;
+
+    /** Inbox messages, oldest first, we couldn't deliver yet */
+    efsm__async_t *backlog;
+
+    /** fsa's destroyed while async messages were in flight, linked by next.
+     *  The next splice drops what's theirs and hands them back to the pool */
+    struct efsm__fsa *dead;
+
+    /** Messages queued across every mailbox but quarantined fsa's */
+    size_t n_pending;
+
+    /** efsm_opts_t.msg_prio */
+    int *msg_prio;
+    size_t n_msg_prio;
+
+    /** For each message type up to n_coalesce, its bit in a fsa's coalesced
+     *  mask, or -1 if it doesn't coalesce */
+    signed char *coalesce;
+    size_t n_coalesce;
+
+    /** efsm_opts_t.inline_size, rounded up to keep payloads aligned */
+    size_t inline_size;
+
+    /** Source of fsa ids */
+    unsigned long next_id;
+
+    /** Timers from efsm_fsa_send_after, NULL until the first one */
+    struct efsm__wheel *wheel;
+
+    /** The event loop, NULL until an fd is watched or efsm_loop is called.
+     *  efsm_fsa_send_async reads it from other threads */
+    _Atomic(struct efsm__loop *) loop;
+
+    /** The worker pool for efsm_run_parallel, NULL until it's first used */
+    efsm__par_t *par;
+
+    /** efsm_opts_t.run_to_completion, and the queue of the drain that's
+     *  underway outside of efsm_run_parallel */
+    unsigned int rtc_hops;
+    efsm__rtc_t *rtc;
+
+    /** Scratch for batch callbacks, empty until a pass needs it */
+    efsm__batch_t batch;
+
+    /** efsm_id_new's tables, and efsm_opts_t.id_data */
+    efsm__ids_t ids;
+    int id_data;
+
+    /** efsm_opts_t.mailbox_limit and friends, as fsa opts */
+    efsm_fsa_opts_t limits;
+
+    /** efsm_opts_t.on_error and error_msg */
+    efsm_on_error_t on_error;
+    int error_msg;
+
+    /** Trace rings, NULL without efsm_opts_t.trace_records.  traces[0] is
+     *  written outside of efsm_run_parallel and traces[1 + i] by worker i.
+     *  Ticks and nanoseconds are from when tracing started */
+    efsm__trace_t *traces;
+    int n_traces;
+    size_t trace_mask;
+    unsigned int trace_sample;
+    uint64_t trace_ticks;
+    long long trace_ns;
 } efsm__t;
 
+/** A message as it sits in a ring mailbox */
+typedef struct efsm__slot {
+    int type;
+    int inlined;                // data points into the mailbox's payload
+    void *data;
+} efsm__slot_t;
+
+/** A fsa's mailbox
+ *
+ * Either a list of pooled efsm__msg_t's or, if ring is set, an inline ring
+ * buffer of slots that is drained by walking contiguous memory
+ */
+typedef struct efsm__mbox {
+    /** A list of lane 0's queued messages, if we don't have a ring */
+    struct efsm__msg *queued;
+
+    /** The ring, its capacity - 1 (capacity is a power of 2) and the index
+     *  of the oldest message */
+    efsm__slot_t *ring;
+    unsigned int mask;
+    unsigned int head;
+
+    /** inline_size bytes for each slot of the ring, once it's needed.  When
+     *  the ring grows under a callback the old payloads, one of which may be
+     *  the callback's msg_data, are retired until the next callback */
+    unsigned char *payload;
+    unsigned char *retired;
+
+    /** Lanes above 0, lanes[l - 1] for lane l, and a bit for each that
+     *  isn't empty */
+    struct efsm__msg *lanes[EFSM_PRIO_LANES - 1];
+    unsigned int urgent;
+
+    /** Number of queued messages, and how many of them are in lanes above 0 */
+    unsigned int count;
+    unsigned int n_urgent;
+
+    /** efsm__mbox_peek's return plus 1 while its message is being
+     *  delivered, so overflow leaves it alone, otherwise 0 */
+    int busy;
+} efsm__mbox_t;
+
+/** Each wheel level has 1 << EFSM__WHEEL_BITS slots */
+#define EFSM__WHEEL_BITS 6
+#define EFSM__WHEEL_SLOTS (1 << EFSM__WHEEL_BITS)
+#define EFSM__WHEEL_LEVELS 4
+
+/** A pending efsm_fsa_send_after */
+typedef struct efsm__timer {
+    /** The pointers for the wheel slot we're in.  next doubles as the pool's
+     *  freelist link, so id stays readable (as 0) after we're freed */
+    struct efsm__timer *next, *prev;
+
+    /** Matches the id in live handles, 0 once fired or cancelled */
+    unsigned long long id;
+
+    /** The tick we're due on */
+    long long expires;
+
+    struct efsm__fsa *fsa;
+    int type;
+    void *data;
+
+    /** The pointers for our fsa's list of timers */
+    struct efsm__timer *fsa_next, *fsa_prev;
+
+    unsigned char level;
+    unsigned char slot;
+} efsm__timer_t;
+
+/** A hierarchical timer wheel with millisecond ticks
+ *
+ * Level l slot s holds timers due in the 64^l tick block with index s (mod
+ * 64).  Each time a level wraps, the next level's current slot is cascaded
+ * down, so a timer moves at most a level at a time.  Occupancy bitmaps let
+ * advancing skip runs of empty slots.  Timers further out than the top level
+ * reaches sit in its furthest slot and are placed again when it cascades.
+ */
+typedef struct efsm__wheel {
+    /** The last tick processed */
+    long long now;
+
+    unsigned long long next_id;
+    size_t n_timers;
+
+    unsigned long long occupied[EFSM__WHEEL_LEVELS];
+    efsm__timer_t *slots[EFSM__WHEEL_LEVELS][EFSM__WHEEL_SLOTS];
+
+    /** Backing store for every efsm__timer_t */
+    efsm__pool_t pool;
+} efsm__wheel_t;
+
+/** An fd watched by efsm_fsa_watch_fd, which is the fd's epoll data */
+typedef struct efsm__watch {
+    struct efsm__fsa *fsa;
+    int fd;
+    int events;
+    int msg_in;
+    int msg_out;
+
+    /** The pointers for our fsa's list of watches */
+    struct efsm__watch *next, *prev;
+} efsm__watch_t;
+
+/** The epoll set behind efsm_loop
+ *
+ * wake_fd is an eventfd, registered with NULL data, that efsm_fsa_send_async
+ * pokes whenever it pushes onto an empty inbox so a waiting loop picks up the
+ * message.
+ */
+typedef struct efsm__loop {
+    int epfd;
+    int wake_fd;
+    size_t n_watches;
+    int stop;
+} efsm__loop_t;
+
 /** The internal efsm_fsa struct */
 typedef struct efsm__fsa {
     struct efsm_ *efsm;
     int state;
+    enum efsm__fsa_status status;
     void *data;
 
-    /** The externally visible object */
-    efsm_fsa_t *wrapper;
+    /** Unique within the efsm, picks the fsa's shard in efsm_run_parallel */
+    unsigned long id;
 
-    enum efsm__fsa_status status;
+    /** efsm__fsa_drain's result in the current efsm_run_parallel pass */
+    int par_result;
+
+    /** Marked for destruction at the end of a efsm_run_parallel pass */
+    int doomed;
+
+    /** The batch transition our next message is due in this pass, or -1 */
+    int batch;
+
+    /** Our efsm_id_t plus 1, 0 if we're from efsm_fsa_new */
+    unsigned int slot;
+
+    /** The externally visible object, which points back at us */
+    efsm_fsa_t wrapper;
 
     efsm_fsa_dcb_t dcb;
+    efsm_fsa_drop_cb_t drop_cb;
+    efsm_fsa_error_cb_t error_cb;
 
-    /** A list of all queued messages */
-    struct efsm__msg *queued;
+    /** All queued messages */
+    efsm__mbox_t mbox;
+
+    /** A bit for each coalescing message type we've got queued */
+    unsigned long long coalesced;
+
+    /** The mailbox_limit (0 for none), overflow and overflow_msg we were
+     *  created with, and whether overflow_msg is queued since we filled */
+    unsigned int limit;
+    unsigned char overflow;
+    unsigned char overflowed;
+
+    /** Set by a worker that couldn't buffer its efsm_fsa_destroy of us, for
+     *  the end of the parallel pass to find */
+    _Atomic unsigned char destroy_asked;
+
+    int overflow_msg;
+
+    /** Our pending timers */
+    efsm__timer_t *timers;
+
+    /** fds we're watching */
+    efsm__watch_t *watches;
 
-    /** Based on status, the pointers for the list we're in */
+    /** The pass we were put on the run queue in */
+    unsigned long pass;
+
+    /** The pointers for the run queue, when we're runnable */
     struct efsm__fsa *next, *prev;
+
+    /** The pointers for the efsm's list of every fsa */
+    struct efsm__fsa *all_next, *all_prev;
 } efsm__fsa_t;
 
 /** Internal packaging for a message */
 typedef struct efsm__msg {
     int type;
+    int flush;                  // EFSM_PRIO_FLUSH, for lanes above 0
     void *data;
 
     struct efsm__fsa *fsa;
 
     /** The pointers for the linked list we're in in our parent fsa */
     struct efsm__msg *next, *prev;
+
+    /** The efsm's inline_size bytes, for inline sends */
+    unsigned char payload[];
 } efsm__msg_t;
+
+/** "EFSM" at the start of a snapshot, when read in native byte order */
+#define EFSM__SNAP_MAGIC 0x4d534645u
+#define EFSM__SNAP_VERSION 1
+
+/** The header of a snapshot, followed by n_fsas fsa records */
+typedef struct efsm__snap_hdr {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t n_states;          // of the def, to catch a different machine
+    uint32_t n_transitions;
+    uint64_t n_fsas;
+    uint64_t n_msgs;
+    uint32_t inline_size;
+    uint32_t ctx_size;
+} efsm__snap_hdr_t;
+
+/** A fsa record, followed by its context (if has_ctx), its blob and n_msgs
+ *  message records.  Variable parts are padded to 8 bytes */
+typedef struct efsm__snap_fsa {
+    int32_t state;
+    uint32_t n_msgs;
+    uint32_t capacity;          // of a ring mailbox, 0 for a list
+    uint32_t has_ctx;           // the fsa's data was its context
+    uint64_t blob_len;          // from save_fsa
+} efsm__snap_fsa_t;
+
+/** How a saved message's data was written */
+enum efsm__snap_kind {
+    EFSM__SNAP_PTR,             // the pointer itself
+    EFSM__SNAP_INLINE,          // the inline payload
+    EFSM__SNAP_BLOB,            // from save_msg
+};
+
+/** A message record, followed by len bytes of data */
+typedef struct efsm__snap_msg {
+    int32_t type;
+    uint16_t prio;              // lane, with EFSM_PRIO_FLUSH
+    uint16_t kind;
+    uint64_t len;
+} efsm__snap_msg_t;
@@ -0,0 +1,83 @@
+/**
+ * \file efsm_static.h
+ * \brief Compile time efsm dispatch
+ * \author Jason Carey
+ *
+ * For machines that are fixed at build time, EFSM_STATIC_DEFINE turns one
+ * list of rules into both the rules table for efsm_new and an efsm_engine_t
+ * that switches on (state, msg) and calls each callback directly, so the
+ * compiler can inline them.  The list is an X macro:
+ *
+ *   #define MY_RULES(X) \
+ *       X(STATE_A, MSG_A, &on_a, NULL, STATE_B) \
+ *       X(STATE_B, MSG_B, &on_b, NULL, STATE_A)
+ *
+ *   EFSM_STATIC_DEFINE(my, MY_RULES)
+ *
+ *   efsm_opts_t opts = { 0 };
+ *   opts.engine = &my_engine;
+ *   efsm_t *efsm = efsm_new(my_rules, &opts);
+ *
+ * Leaving opts.engine unset runs the same rules through the dispatch table,
+ * so machines can be switched one at a time.
+ *
+ * The current state and msg of each rule are pasted into identifiers, so
+ * they have to be single tokens (enum constants or non-negative integer
+ * literals), and the callbacks have to be declared before the define.  A
+ * duplicated (state, msg) pair is a compile error rather than first match.
+ *
+ * Only exact rules are compiled into the switch.  EFSM_ANY rules can still
+ * be listed, when the engine has nothing for (state, msg) the efsm resolves
+ * it through its table as usual.
+ */
+#ifndef EFSM_STATIC_H
+#define EFSM_STATIC_H
+
+#include <efsm.h>
+
+/** one case label per (state, msg), whatever the width of either */
+#define EFSM__STATIC_KEY(state, msg) \
+    ((unsigned long long)(unsigned int)(state) << 32 | (unsigned int)(msg))
+
+#define EFSM__STATIC_RULE(state, msg, code, data, next) \
+    { state, msg, code, data, next },
+
+#define EFSM__STATIC_ORD(state, msg, code, data, next) \
+    efsm__static_##state##_##msg,
+
+#define EFSM__STATIC_CASE(state, msg, code, data, next) \
+    case EFSM__STATIC_KEY(state, msg): \
+        *rule = efsm__static_##state##_##msg; \
+        if (transition_cb) \
+            transition_cb(state, msg, \
+                          (next) == EFSM_SAME ? (state) : (next)); \
+        return (code)(fsa, fsa_data, data, type, msg_data);
+
+/** defines name_rules and name_engine from the X macro RULES
+ *
+ * Both are static, so this belongs in the .c file that creates the efsm
+ */
+#define EFSM_STATIC_DEFINE(name, RULES) \
+    static efsm_transition_rules_t name##_rules[] = { \
+        RULES(EFSM__STATIC_RULE) \
+        { -1, 0, NULL, NULL, -1 }, \
+    }; \
+    \
+    static int name##_engine(efsm_fsa_t * fsa, void *fsa_data, int state, \
+                             int type, void *msg_data, \
+                             efsm_transition_cb_t transition_cb, int *rule) \
+    { \
+        /* each rule's index in name_rules */ \
+        enum { RULES(EFSM__STATIC_ORD) }; \
+        \
+        switch (EFSM__STATIC_KEY(state, type)) { \
+        RULES(EFSM__STATIC_CASE) \
+        default: \
+            break; \
+        } \
+        \
+        *rule = -1; \
+        return -1; \
+    }
+
+#endif
@@ -10,7 +10,8 @@
  * * efsm_ namespace is used for externally visible types and functions
  *
  * Issues to note:
- * * efsm is not threadsafe
+ * * efsm is not threadsafe, apart from efsm_fsa_send_async
+ * * efsm_loop is epoll based, so it's linux only
  * * efsm_run returns after each iteration of all available fsa's.  If run in a
  *   loop, that could run forever
  *
@@ -18,344 +19,5420 @@
 
 #include <utlist.h>
 #include <assert.h>
+#include <limits.h>
 #include <string.h>
 #include <stdlib.h>
+#include <time.h>
+#include <errno.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <utstring.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
 
 #include "efsm.h"
 #include "efsm_internal.h"
 
 void efsm__fsa_destroy(efsm__fsa_t * fsa);
 void efsm__msg_destroy(efsm__msg_t * msg);
+void efsm__msg_release(efsm__msg_t * msg);
+static void efsm__rtc_spill(efsm__t * efsm);
+static void efsm__id_park(efsm__fsa_t * fsa);
+static void efsm__ids_unhand(efsm__t * efsm);
 
-/** Toggles the status of a fsa
- *
- * Status can be active, inactive or new.  These states correspond to fsa's
- * with messages in queue, those with no messages and new fsa's OR fsa's that
- * have received a message in this iteration of efsm_run.
+/** Default number of messages in the first slab of a message pool */
+#define EFSM__MSG_POOL_INITIAL 64
+
+/** Default number of fsa's in the first slab of a fsa pool */
+#define EFSM__FSA_POOL_INITIAL 16
+
+/** Alignment for slab elements, matching what malloc hands out */
+#define EFSM__POOL_ALIGN 16
+
+#define EFSM__ROUND_UP(x, a) (((x) + (a) - 1) / (a) * (a))
+
+/** The efsm_run_parallel worker running on this thread, if any */
+static _Thread_local efsm__worker_t *efsm__self;
+
+/** par_result for a fsa no worker got to before a failure */
+#define EFSM__PAR_SKIPPED 2
+
+/** Reads the monotonic clock in nanoseconds */
+static long long efsm__now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/** Reads the clock trace records are stamped with: the TSC where there is
+ *  one, which costs a fraction of clock_gettime, otherwise efsm__now */
+static inline uint64_t efsm__ticks(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return efsm__now();
+#endif
+}
+
+/** \return the trace ring for this thread, or NULL if we're not tracing */
+static inline efsm__trace_t *efsm__trace_ring(efsm__t * efsm)
+{
+    if (!efsm->traces)
+        return NULL;
+
+    efsm__worker_t *self = efsm__self;
+
+    return efsm->traces + (self && self->efsm == efsm ? 1 + self->index : 0);
+}
+
+/** \return the trace ring for this thread if this transition is one of the
+ *  trace_sample'th that get recorded, otherwise NULL */
+static inline efsm__trace_t *efsm__trace_sample(efsm__t * efsm)
+{
+    efsm__trace_t *trace = efsm__trace_ring(efsm);
+
+    if (!trace || --trace->countdown)
+        return NULL;
+
+    trace->countdown = efsm->trace_sample;
+
+    return trace;
+}
+
+/** Records a transition in a trace ring, over the oldest once it's full */
+static inline void efsm__trace_record(efsm__t * efsm, efsm__trace_t * trace,
+                                      unsigned long long fsa, int pre_state,
+                                      int msg, int post_state, uint64_t start,
+                                      uint64_t end)
+{
+    efsm_trace_rec_t *rec = trace->recs + (trace->n++ & efsm->trace_mask);
+
+    rec->start = start;
+    rec->fsa = fsa;
+    rec->pre_state = pre_state;
+    rec->msg = msg;
+    rec->post_state = post_state;
+    rec->ticks = end - start > UINT32_MAX ? UINT32_MAX : end - start;
+}
+
+/** \return what a fsa goes by in trace records */
+#define EFSM__TRACE_FSA(fsa) \
+    ((fsa)->slot ? ((fsa)->slot - 1) | EFSM_TRACE_ID : (fsa)->id)
+
+/** Makes sure there are rings for n threads
  *
- * Toggle moves active or inactive fsa's into the queue and moves queued fsas
- * into the active or inactive lists
+ * \return 0 for success, -1 if out of memory
  */
-static void efsm__fsa_toggle_status(efsm__fsa_t * fsa)
+static int efsm__trace_reserve(efsm__t * efsm, int n)
 {
-    if (fsa->status == EFSM_FSA_ACTIVE) {
-        fsa->status = EFSM_FSA_NEW;
+    if (n <= efsm->n_traces)
+        return 0;
 
-        DL_DELETE(fsa->efsm->actives, fsa);
-        DL_APPEND(fsa->efsm->queued, fsa);
-    } else if (fsa->status == EFSM_FSA_INACTIVE) {
-        fsa->status = EFSM_FSA_NEW;
+    efsm__trace_t *traces = realloc(efsm->traces, sizeof(*traces) * n);
+    if (!traces)
+        return -1;
+    efsm->traces = traces;
 
-        DL_DELETE(fsa->efsm->inactives, fsa);
-        DL_APPEND(fsa->efsm->queued, fsa);
-    } else if (fsa->status == EFSM_FSA_NEW) {
-        if (fsa->queued) {
-            fsa->status = EFSM_FSA_ACTIVE;
-            DL_DELETE(fsa->efsm->queued, fsa);
-            DL_APPEND(fsa->efsm->actives, fsa);
-        } else {
-            fsa->status = EFSM_FSA_INACTIVE;
-            DL_DELETE(fsa->efsm->queued, fsa);
-            DL_APPEND(fsa->efsm->inactives, fsa);
-        }
-    } else {
-        assert(0);
+    for (; efsm->n_traces < n; efsm->n_traces++) {
+        efsm__trace_t *t = traces + efsm->n_traces;
+
+        t->n = 0;
+        t->countdown = 1;
+        t->recs = malloc(sizeof(*t->recs) * (efsm->trace_mask + 1));
+        if (!t->recs)
+            return -1;
     }
+
+    return 0;
 }
 
-int efsm_fsa_send(efsm_fsa_t * _fsa, int type, void *data)
+/** Picks the log2 histogram bucket for a value, clamping at the top */
+static inline int efsm__log2_bucket(long long v)
 {
-    efsm__fsa_t *fsa = _fsa->data;
+    int b = v > 1 ? 63 - __builtin_clzll((unsigned long long)v) : 0;
 
-    efsm__msg_t *msg = calloc(sizeof(*msg), 1);
+    return b < EFSM_STATS_BUCKETS ? b : EFSM_STATS_BUCKETS - 1;
+}
 
-    msg->fsa = fsa;
-    msg->data = data;
-    msg->type = type;
+/** Sets up a zeroed block of counters for n_transitions transitions
+ *
+ * \return 0 for success, -1 if out of memory
+ */
+static int efsm__stats_init(efsm__stats_t * stats, int n_transitions,
+                            int latency)
+{
+    memset(stats, 0, sizeof(*stats));
 
-    DL_APPEND(fsa->queued, msg);
+#ifdef EFSM_NO_STATS
+    (void)n_transitions;
+    (void)latency;
+#else
+    stats->transitions =
+        calloc(sizeof(*stats->transitions), n_transitions + 1);
+    if (!stats->transitions)
+        return -1;
 
-    if (fsa->status == EFSM_FSA_INACTIVE)
-        efsm__fsa_toggle_status(fsa);
+    if (latency) {
+        stats->latency = calloc(sizeof(*stats->latency) * EFSM_STATS_BUCKETS,
+                                n_transitions + 1);
+        if (!stats->latency)
+            return -1;
+    }
+#endif
 
     return 0;
 }
 
-/** processes all waiting messages for a given fsa
- *
- * o loops over all of the messages for a given fsa
- * o transitions based on message type
- * o calls transition callbacks with messages
- * o deletes the fsa if it's transitioning to floor
- * o returns -1 if an error occurs
- *   o no transition is available for a given message
- *   o a transition callback returns -1
- * o toggles the fsa back to wherever it needs to be
- */
-int efsm__fsa_run(efsm__fsa_t * fsa)
+/** Frees a block of counters */
+static void efsm__stats_destroy(efsm__stats_t * stats)
 {
-    int i;
-    int r;
-    efsm__transition_t *transition;
-    efsm__msg_t *ele, *tmp;
-
-    DL_FOREACH_SAFE(fsa->queued, ele, tmp) {
-        transition = NULL;
-        efsm__state_t *state = fsa->efsm->states + fsa->state;
-        for (i = 0; i < state->n_transitions; i++) {
-            if (state->transitions[i].msg_type == ele->type) {
-                transition = state->transitions + i;
-                break;
-            }
-        }
+    free(stats->transitions);
+    free(stats->latency);
 
-        if (transition) {
-            if (fsa->efsm->transition_cb)
-                fsa->efsm->transition_cb(fsa->state, ele->type,
-                                         transition->next_state);
-            r = transition->code(fsa->wrapper, fsa->data, transition->data,
-                                 ele->type, ele->data);
+    memset(stats, 0, sizeof(*stats));
+}
 
-            if (r < 0) {
-                return -1;
-            } else if (r > 0) {
-                if (transition->next_state != -1)
-                    return -1;
+/** Counts a call to one of the efsm_run's that processed n messages */
+static inline void efsm__stats_run(efsm__t * efsm, unsigned long long n)
+{
+#ifdef EFSM_NO_STATS
+    (void)efsm;
+    (void)n;
+#else
+    efsm->stats.runs++;
+    efsm->stats.run_msgs[efsm__log2_bucket(n)]++;
+#endif
+}
 
-                efsm__fsa_destroy(fsa);
-                return 1;
-            }
-        } else {
+/** Sets up an empty pool for elements of a given size */
+void efsm__pool_init(efsm__pool_t * pool, size_t size, size_t initial,
+                     size_t max)
+{
+    memset(pool, 0, sizeof(*pool));
+
+    if (size < sizeof(efsm__pool_free_t))
+        size = sizeof(efsm__pool_free_t);
+
+    pool->size = EFSM__ROUND_UP(size, EFSM__POOL_ALIGN);
+    pool->initial = initial ? initial : 1;
+    pool->max = max;
+}
+
+/** Adds a slab to the pool, pushing its elements onto the freelist
+ *
+ * Slabs double the pool's capacity each time (starting from initial), which
+ * keeps the number of slabs logarithmic in the peak number of elements.
+ *
+ * \return 0 for success, -1 if the pool is at its max or out of memory
+ */
+static int efsm__pool_grow(efsm__pool_t * pool, size_t want)
+{
+    size_t n = want;
+    size_t i;
+    size_t hdr = EFSM__ROUND_UP(sizeof(efsm__pool_slab_t), EFSM__POOL_ALIGN);
+
+    if (pool->max) {
+        if (pool->stats.capacity >= pool->max)
             return -1;
-        }
+        if (n > pool->max - pool->stats.capacity)
+            n = pool->max - pool->stats.capacity;
+    }
 
-        fsa->state = transition->next_state;
+    efsm__pool_slab_t *slab = malloc(hdr + n * pool->size);
+    if (!slab)
+        return -1;
+
+    slab->next = pool->slabs;
+    pool->slabs = slab;
 
-        efsm__msg_destroy(ele);
+    // Push in reverse so the freelist hands out the slab front to back
+    char *elements = (char *)slab + hdr;
+    for (i = n; i > 0; i--) {
+        efsm__pool_free_t *f =
+            (efsm__pool_free_t *) (elements + (i - 1) * pool->size);
+        f->next = pool->free;
+        pool->free = f;
     }
 
-    efsm__fsa_toggle_status(fsa);
+    pool->stats.capacity += n;
 
     return 0;
 }
 
-/* Toggles all of the queued fsas, then processes all of the actives
+/** Pops a zeroed element off the pool, growing it if needed
+ *
+ * \return the element or NULL if the pool can't grow
  */
-int efsm_run(efsm_t * _efsm)
+void *efsm__pool_alloc(efsm__pool_t * pool)
 {
-    int r;
-    efsm__t *efsm = _efsm->data;
+    efsm__pool_free_t *f = pool->free;
 
-    efsm__fsa_t *ele, *tmp;
+    if (f) {
+        pool->stats.hits++;
+    } else {
+        pool->stats.misses++;
 
-    DL_FOREACH_SAFE(efsm->queued, ele, tmp) {
-        efsm__fsa_toggle_status(ele);
+        size_t want = pool->stats.capacity ? pool->stats.capacity :
+            pool->initial;
+        if (efsm__pool_grow(pool, want) < 0)
+            return NULL;
+
+        f = pool->free;
     }
 
-    DL_FOREACH_SAFE(efsm->actives, ele, tmp) {
-        r = efsm__fsa_run(ele);
+    pool->free = f->next;
 
-        if (r < 0) {
-            return -1;
-        }
+    if (++pool->stats.in_use > pool->stats.high_water)
+        pool->stats.high_water = pool->stats.in_use;
+
+    memset(f, 0, pool->size);
+
+    return f;
+}
+
+/** Pushes an element back onto the pool's freelist */
+void efsm__pool_free(efsm__pool_t * pool, void *ptr)
+{
+    efsm__pool_free_t *f = ptr;
+
+    f->next = pool->free;
+    pool->free = f;
+
+    pool->stats.in_use--;
+}
+
+/** Releases every slab.  Elements still handed out become invalid */
+void efsm__pool_destroy(efsm__pool_t * pool)
+{
+    efsm__pool_slab_t *slab, *tmp;
+
+    LL_FOREACH_SAFE(pool->slabs, slab, tmp) {
+        free(slab);
     }
 
-    return efsm->queued ? 1 : 0;
+    memset(pool, 0, sizeof(*pool));
 }
 
-/* This actually creates a wrapper shim (with an opaque handle to the internal
- * data structure) in addition to the internal object and returns that
+/** Puts an idle fsa that's just been given messages on the run queue
+ *
+ * It's stamped with the current pass, so a pass that's underway leaves it for
+ * the next one.
  */
-efsm_fsa_t *efsm_fsa_new(efsm_t * _efsm, int state, efsm_fsa_opts_t * opts)
+static inline void efsm__fsa_wake(efsm__fsa_t * fsa)
 {
-    efsm__t *efsm = _efsm->data;
+    efsm__t *efsm = fsa->efsm;
 
-    efsm__fsa_t *fsa = calloc(sizeof(*fsa), 1);
-    efsm_fsa_t *_fsa = calloc(sizeof(*_fsa), 1);
-    _fsa->data = fsa;
-    fsa->wrapper = _fsa;
+    fsa->status = EFSM_FSA_RUNNABLE;
+    fsa->pass = efsm->pass;
+    DL_APPEND(efsm->runq, fsa);
+}
 
-    if (opts) {
-        if (opts->hint)
-            fsa->data = opts->hint;
-        if (opts->destroy_cb)
-            fsa->dcb = opts->destroy_cb;
+/** Takes a drained fsa off the run queue, putting it back at the tail if
+ *  it's still got messages.  An id that's out of them is parked, so
+ *  nothing can be holding on to it */
+static inline void efsm__fsa_requeue(efsm__fsa_t * fsa)
+{
+    efsm__t *efsm = fsa->efsm;
+
+    DL_DELETE(efsm->runq, fsa);
+
+    if (fsa->mbox.count) {
+        fsa->pass = efsm->pass;
+        DL_APPEND(efsm->runq, fsa);
+    } else {
+        fsa->status = EFSM_FSA_IDLE;
+        if (fsa->slot)
+            efsm__id_park(fsa);
     }
+}
 
-    fsa->state = state;
-    fsa->efsm = efsm;
-    fsa->status = EFSM_FSA_NEW;
+/** Hashes a (state, msg) pair into a table of 1 << bits slots */
+static inline unsigned int efsm__hash(unsigned int seed, int bits, int state,
+                                      int msg_type)
+{
+    unsigned int h = seed;
 
-    DL_APPEND(efsm->queued, fsa);
+    h ^= (unsigned int)state * 0x9E3779B1u;
+    h = (h ^ (h >> 15)) * 0x85EBCA77u;
+    h ^= (unsigned int)msg_type * 0xC2B2AE3Du;
+    h = (h ^ (h >> 13)) * 0x27D4EB2Fu;
 
-    return _fsa;
+    return bits ? h >> (32 - bits) : 0;
 }
 
-/** compiles the internal state/transition data structure from the external table API
+/** Finds the transition for a message in a given state
  *
- * Assumes that rules ends with a transition with a starting state of -1.
+ * \return the index of the transition or -1 if the state doesn't handle the
+ *         message
+ */
+static inline int efsm__lookup(efsm__def_t * def, int state, int msg_type)
+{
+    int i;
+
+    switch (def->dispatch) {
+    case EFSM_DISPATCH_DENSE:
+        if ((unsigned int)msg_type >= (unsigned int)def->n_msgs)
+            return -1;
+        return def->dense[(size_t)state * def->n_msgs + msg_type];
+    case EFSM_DISPATCH_HASH:{
+            efsm__hash_slot_t *slot = def->hash +
+                efsm__hash(def->hash_seed, def->hash_bits, state,
+                           msg_type);
+            if (slot->state != state || slot->msg_type != msg_type)
+                return -1;
+            return slot->transition;
+        }
+    default:
+        for (i = def->offsets[state]; i < def->offsets[state + 1]; i++) {
+            if (def->transitions[i].msg_type == msg_type)
+                return i;
+        }
+        return -1;
+    }
+}
+
+/** Finds the transition for a message, falling back on wildcard rules and
+ *  ancestors
  *
- * \param rules All of the states and their transitions in the efsm
- * \param[out] n_states The number of states represented in the transition rules
+ * \return the index of the transition or -1 if nothing handles the message
  */
-efsm__state_t *efsm__states_from_rules(efsm_transition_rules_t * rules,
-                                       int *n_states)
+static inline int efsm__resolve(efsm__def_t * def, int state, int msg_type)
 {
-    int max_state = 0;
+    int i = efsm__lookup(def, state, msg_type);
 
-    efsm_transition_rules_t *r;
+    if (i >= 0 || !def->up)
+        return i;
 
-    // Find the max state
-    for (r = rules; r->current_state != -1; r++) {
-        if (r->current_state > max_state)
-            max_state = r->current_state;
-        if (r->next_state > max_state)
-            max_state = r->next_state;
-    }
-    *n_states = max_state + 1;
-
-    efsm__state_t *states = calloc(sizeof(*states), *n_states);
-
-    // Loop over all of the states, finding all of the rules that match and
-    // creating a second dimension of transition message id's
-    int state;
-    for (state = 0; state < *n_states; state++) {
-        int transition_count = 0;
-        for (r = rules; r->current_state != -1; r++)
-            if (r->current_state == state)
-                transition_count++;
-        states[state].n_transitions = transition_count;
-        states[state].transitions =
-            calloc(sizeof(*(states[state].transitions)), transition_count);
-        int i = 0;
-        for (r = rules; r->current_state != -1; r++)
-            if (r->current_state == state) {
-                states[state].transitions[i].code = r->code;
-                states[state].transitions[i].msg_type = r->msg_type;
-                states[state].transitions[i].next_state = r->next_state;
-                states[state].transitions[i].data = r->data;
-                i++;
-            }
+    for (;;) {
+        if (def->any_msg[state] >= 0)
+            return def->any_msg[state];
+
+        if ((state = def->up[state]) < 0)
+            return -1;
+
+        if ((i = efsm__lookup(def, state, msg_type)) >= 0)
+            return i;
     }
-    return states;
 }
 
-efsm_t *efsm_new(efsm_transition_rules_t * rules, efsm_opts_t * opts)
+/** Doubles the capacity of a ring mailbox, unwrapping it as we go
+ *
+ * Inline payloads move along with their slots.  The old payloads are only
+ * retired rather than freed, since the oldest may be msg_data for the
+ * callback that's running.  If payloads were already retired they're the
+ * ones it could be using, so the ones we just copied go instead.
+ *
+ * \return 0 for success, -1 if out of memory
+ */
+static int efsm__mbox_grow(efsm__mbox_t * mbox, size_t inline_size)
 {
-    efsm_t *_efsm = calloc(sizeof(*_efsm), 1);
-    efsm__t *efsm = calloc(sizeof(*efsm), 1);
-    _efsm->data = efsm;
+    unsigned int capacity = mbox->mask + 1;
+    unsigned int first = capacity - mbox->head;
+    unsigned int count = mbox->count - mbox->n_urgent;
+    unsigned char *payload = NULL;
+    unsigned int i;
 
-    if (opts) {
-        efsm->transition_cb = opts->transition_cb;
+    efsm__slot_t *ring = malloc(sizeof(*ring) * capacity * 2);
+    if (!ring)
+        return -1;
+
+    if (mbox->payload) {
+        payload = malloc(inline_size * capacity * 2);
+        if (!payload) {
+            free(ring);
+            return -1;
+        }
     }
 
-    efsm->states = efsm__states_from_rules(rules, &efsm->n_states);
+    if (first > count)
+        first = count;
 
-    return _efsm;
+    memcpy(ring, mbox->ring + mbox->head, sizeof(*ring) * first);
+    memcpy(ring + first, mbox->ring, sizeof(*ring) * (count - first));
+
+    if (payload) {
+        for (i = 0; i < count; i++) {
+            if (!ring[i].inlined)
+                continue;
+            ring[i].data = memcpy(payload + inline_size * i, ring[i].data,
+                                  inline_size);
+        }
+
+        if (mbox->retired)
+            free(mbox->payload);
+        else
+            mbox->retired = mbox->payload;
+        mbox->payload = payload;
+    }
+
+    free(mbox->ring);
+
+    mbox->ring = ring;
+    mbox->mask = capacity * 2 - 1;
+    mbox->head = 0;
+
+    return 0;
 }
 
-void efsm_destroy(efsm_t * _efsm)
+/** Picks the priority efsm_fsa_send uses for a message type */
+static inline int efsm__msg_prio(efsm__t * efsm, int type)
 {
-    efsm__t *efsm = _efsm->data;
+    if (type >= 0 && (size_t)type < efsm->n_msg_prio)
+        return efsm->msg_prio[type];
 
-    efsm__fsa_t *ele, *tmp;
+    return 0;
+}
 
-    DL_FOREACH_SAFE(efsm->queued, ele, tmp) {
-        efsm__fsa_destroy(ele);
-    }
-    DL_FOREACH_SAFE(efsm->actives, ele, tmp) {
-        efsm__fsa_destroy(ele);
-    }
-    DL_FOREACH_SAFE(efsm->inactives, ele, tmp) {
-        efsm__fsa_destroy(ele);
-    }
+/** Looks up a message type's bit in the fsa coalesced masks
+ *
+ * \return the bit or -1 if the type doesn't coalesce
+ */
+static inline int efsm__coalesce_bit(efsm__t * efsm, int type)
+{
+    if (type >= 0 && (size_t)type < efsm->n_coalesce)
+        return efsm->coalesce[type];
 
-    int i;
-    for (i = 0; i < efsm->n_states; i++) {
-        free(efsm->states[i].transitions);
-    }
+    return -1;
+}
+
+/** Checks a message against a coalesced mask, marking it pending if it's new
+ *
+ * \return 1 if the same type is already pending and it should be dropped
+ */
+static inline int efsm__coalesce_dup(efsm__t * efsm,
+                                     unsigned long long *coalesced, int type)
+{
+    int bit = efsm__coalesce_bit(efsm, type);
 
-    free(efsm->states);
+    if (bit < 0)
+        return 0;
+    if (*coalesced & 1ULL << bit)
+        return 1;
 
-    free(efsm);
-    free(_efsm);
+    *coalesced |= 1ULL << bit;
+
+    return 0;
 }
 
-void efsm_fsa_destroy(efsm_fsa_t * fsa)
+/** Marks a message type as no longer pending in a fsa's mailbox */
+static inline void efsm__coalesce_clear(efsm__fsa_t * fsa, int type)
 {
-    efsm__fsa_destroy((efsm__fsa_t *) fsa->data);
+    int bit = efsm__coalesce_bit(fsa->efsm, type);
+
+    if (bit >= 0)
+        fsa->coalesced &= ~(1ULL << bit);
 }
 
-/** destroys the internal representation of a fsa
+/** Appends a message to one of a fsa's mailbox lanes
  *
- * calls the destroy callback if one was provided
+ * A coalescing message whose type is already pending is handed to drop_cb
+ * instead, which counts as success.
+ *
+ * \param prio the lane, with EFSM_PRIO_FLUSH if it's to flush the lanes below
+ * \param len -1 to queue data itself, otherwise the size of an inline
+ *        payload at data to copy into the mailbox
+ *
+ * \return 0 for success, -1 if the message pool or ring can't grow
  */
-void efsm__fsa_destroy(efsm__fsa_t * fsa)
+static int efsm__mbox_push(efsm__fsa_t * fsa, int prio, int type, void *data,
+                           long len)
 {
-    efsm__msg_t *ele, *tmp;
+    efsm__t *efsm = fsa->efsm;
+    efsm__mbox_t *mbox = &fsa->mbox;
+    int lane = prio & ~EFSM_PRIO_FLUSH;
+    int bit = efsm__coalesce_bit(fsa->efsm, type);
 
-    if (fsa->status == EFSM_FSA_ACTIVE) {
-        DL_DELETE(fsa->efsm->actives, fsa);
-    } else if (fsa->status == EFSM_FSA_INACTIVE) {
-        DL_DELETE(fsa->efsm->inactives, fsa);
-    } else if (fsa->status == EFSM_FSA_NEW) {
-        DL_DELETE(fsa->efsm->queued, fsa);
-    } else {
-        // we shouldn't get here
-        assert(0);
+    if (efsm->rtc && efsm->rtc->fsa == fsa)
+        efsm__rtc_spill(efsm);
+
+    if (bit >= 0 && fsa->coalesced & 1ULL << bit) {
+        if (fsa->drop_cb)
+            fsa->drop_cb(fsa->data, type, data);
+        return 0;
     }
 
-    DL_FOREACH_SAFE(fsa->queued, ele, tmp) {
-        efsm__msg_destroy(ele);
+    if (lane) {
+        assert(lane > 0 && lane < EFSM_PRIO_LANES);
+
+        efsm__msg_t *msg = efsm__pool_alloc(&fsa->efsm->msg_pool);
+        if (!msg)
+            return -1;
+
+        msg->fsa = fsa;
+        msg->data = len < 0 ? data : memcpy(msg->payload, data, len);
+        msg->type = type;
+        msg->flush = prio & EFSM_PRIO_FLUSH;
+
+        DL_APPEND(mbox->lanes[lane - 1], msg);
+        mbox->urgent |= 1u << (lane - 1);
+        mbox->n_urgent++;
+    } else if (mbox->ring) {
+        unsigned int count = mbox->count - mbox->n_urgent;
+        if (count > mbox->mask && efsm__mbox_grow(mbox, efsm->inline_size) < 0)
+            return -1;
+
+        if (len >= 0 && !mbox->payload &&
+            !(mbox->payload = malloc(efsm->inline_size * (mbox->mask + 1))))
+            return -1;
+
+        unsigned int i = (mbox->head + count) & mbox->mask;
+        efsm__slot_t *slot = mbox->ring + i;
+        slot->type = type;
+        slot->inlined = len >= 0;
+        slot->data = len < 0 ? data :
+            memcpy(mbox->payload + efsm->inline_size * i, data, len);
+    } else {
+        efsm__msg_t *msg = efsm__pool_alloc(&fsa->efsm->msg_pool);
+        if (!msg)
+            return -1;
+
+        msg->fsa = fsa;
+        msg->data = len < 0 ? data : memcpy(msg->payload, data, len);
+        msg->type = type;
+
+        DL_APPEND(mbox->queued, msg);
     }
 
-    if (fsa->dcb)
-        fsa->dcb(fsa->data);
+    if (bit >= 0)
+        fsa->coalesced |= 1ULL << bit;
+
+    mbox->count++;
+    if (fsa->status != EFSM_FSA_QUARANTINED)
+        fsa->efsm->n_pending++;
 
-    free(fsa->wrapper);
+    EFSM__STATS(if (mbox->count > fsa->efsm->stats.mailbox_high_water)
+                fsa->efsm->stats.mailbox_high_water = mbox->count);
 
-    free(fsa);
+    return 0;
 }
 
-/** Destroy an efsm message */
-void efsm__msg_destroy(efsm__msg_t * msg)
+/** What the pushes return for a message a full mailbox rejects */
+#define EFSM__FULL (-2)
+
+/** Drops the oldest lane 0 message, short of one that's being delivered, to
+ *  make room in a full mailbox
+ *
+ * \return 0 for success, -1 if there's nothing to drop
+ */
+static int efsm__mbox_drop_oldest(efsm__fsa_t * fsa)
 {
-    DL_DELETE(msg->fsa->queued, msg);
+    efsm__t *efsm = fsa->efsm;
+    efsm__mbox_t *mbox = &fsa->mbox;
+    unsigned int count = mbox->count - mbox->n_urgent;
+    unsigned int skip = mbox->busy == 1;
+    unsigned int i;
+
+    if (count <= skip)
+        return -1;
+
+    if (mbox->ring) {
+        unsigned int mask = mbox->mask;
+        efsm__slot_t *slot = mbox->ring + ((mbox->head + skip) & mask);
+
+        efsm__coalesce_clear(fsa, slot->type);
+        if (fsa->drop_cb)
+            fsa->drop_cb(fsa->data, slot->type, slot->data);
 
-    free(msg);
+        // The callback has the head's payload, so close the gap behind it
+        for (i = 1; skip && i + 1 < count; i++) {
+            unsigned int to = (mbox->head + i) & mask;
+            efsm__slot_t *from = mbox->ring + ((to + 1) & mask);
+
+            mbox->ring[to] = *from;
+            if (from->inlined)
+                mbox->ring[to].data =
+                    memcpy(mbox->payload + efsm->inline_size * to,
+                           from->data, efsm->inline_size);
+        }
+        if (!skip)
+            mbox->head = (mbox->head + 1) & mask;
+    } else {
+        efsm__msg_t *msg = skip ? mbox->queued->next : mbox->queued;
+
+        efsm__coalesce_clear(fsa, msg->type);
+        if (fsa->drop_cb)
+            fsa->drop_cb(fsa->data, msg->type, msg->data);
+        efsm__msg_destroy(msg);
+    }
+
+    mbox->count--;
+    if (fsa->status != EFSM_FSA_QUARANTINED)
+        efsm->n_pending--;
+
+    return 0;
 }
 
-char *efsm_pp(efsm_t * _efsm, char **state_names, char **transition_names)
+/** Puts a message in place of the newest one of its type in its lane,
+ *  short of one that's being delivered, which goes to drop_cb
+ *
+ * \param prio and the rest as for efsm__mbox_push
+ *
+ * \return 0 for success, 1 if there isn't one, -1 if out of memory
+ */
+static int efsm__mbox_replace(efsm__fsa_t * fsa, int prio, int type,
+                              void *data, long len)
 {
-    UT_string s;
-    utstring_init(&s);
+    efsm__t *efsm = fsa->efsm;
+    efsm__mbox_t *mbox = &fsa->mbox;
+    int lane = prio & ~EFSM_PRIO_FLUSH;
+    int busy = mbox->busy && ((mbox->busy - 1) & ~EFSM_PRIO_FLUSH) == lane;
+    efsm__msg_t *head = lane ? mbox->lanes[lane - 1] : mbox->queued;
+    efsm__msg_t *msg;
+    unsigned int i;
 
-    utstring_printf(&s, "digraph G {\n");
-
-    efsm__t *efsm = _efsm->data;
+    if (!lane && mbox->ring) {
+        for (i = mbox->count - mbox->n_urgent; i > (unsigned int)busy; i--) {
+            unsigned int j = (mbox->head + i - 1) & mbox->mask;
+            efsm__slot_t *slot = mbox->ring + j;
 
-    int i, j;
-    for (i = 0; i < efsm->n_states; i++) {
-        efsm__state_t *state = efsm->states + i;
-        for (j = 0; j < state->n_transitions; j++) {
-            efsm__transition_t *transition = state->transitions + j;
+            if (slot->type != type)
+                continue;
 
-            char *cur_state = state_names[i];
-            char *next_state =
-                transition->next_state !=
-                -1 ? state_names[transition->next_state] : "_";
-            char *tname = transition_names[transition->msg_type];
+            if (len >= 0 && !mbox->payload &&
+                !(mbox->payload =
+                  malloc(efsm->inline_size * (mbox->mask + 1))))
+                return -1;
 
-            utstring_printf(&s, "  %s -> %s [label=\"%s\"];\n", cur_state,
-                            next_state, tname);
+            if (fsa->drop_cb)
+                fsa->drop_cb(fsa->data, type, slot->data);
+            slot->inlined = len >= 0;
+            slot->data = len < 0 ? data :
+                memcpy(mbox->payload + efsm->inline_size * j, data, len);
+            return 0;
         }
+
+        return 1;
+    }
+
+    // From the tail, which is the head's prev
+    for (msg = head ? head->prev : NULL; msg && !(busy && msg == head);
+         msg = msg == head ? NULL : msg->prev) {
+        if (msg->type != type)
+            continue;
+
+        if (fsa->drop_cb)
+            fsa->drop_cb(fsa->data, type, msg->data);
+        msg->data = len < 0 ? data : memcpy(msg->payload, data, len);
+        if (lane)
+            msg->flush = prio & EFSM_PRIO_FLUSH;
+        return 0;
     }
 
-    utstring_printf(&s, "}\n");
+    return 1;
+}
+
+/** Applies a full mailbox's overflow policy to a message
+ *
+ * \return 0 if there's now room for it, 1 if it's been taken care of, -1
+ *         if out of memory or EFSM__FULL if it's rejected
+ */
+static int efsm__mbox_overflow(efsm__fsa_t * fsa, int prio, int type,
+                               void *data, long len)
+{
+    int r;
 
-    char *out = utstring_body(&s);
+    switch (fsa->overflow) {
+    case EFSM_OVERFLOW_DROP_OLDEST:
+        return efsm__mbox_drop_oldest(fsa) < 0 ? EFSM__FULL : 0;
+    case EFSM_OVERFLOW_COALESCE:
+        r = efsm__mbox_replace(fsa, prio, type, data, len);
+        return r > 0 ? EFSM__FULL : r < 0 ? -1 : 1;
+    case EFSM_OVERFLOW_NOTIFY:
+        if (fsa->drop_cb)
+            fsa->drop_cb(fsa->data, type, data);
+        if (!fsa->overflowed &&
+            efsm__mbox_push(fsa, efsm__msg_prio(fsa->efsm, fsa->overflow_msg),
+                            fsa->overflow_msg, NULL, -1) == 0)
+            fsa->overflowed = 1;
+        return 1;
+    default:
+        return EFSM__FULL;
+    }
+}
+
+/** Pushes a message as efsm__mbox_push does, unless the mailbox is full, in
+ *  which case the fsa's overflow policy decides
+ *
+ * \return 0 for success, -1 if out of memory or EFSM__FULL if it's rejected
+ */
+static int efsm__mbox_offer(efsm__fsa_t * fsa, int prio, int type, void *data,
+                            long len)
+{
+    efsm__t *efsm = fsa->efsm;
+    int bit = efsm__coalesce_bit(efsm, type);
+    int r;
+
+    if (fsa->limit) {
+        // Continuations were sent first, so they take up room first
+        if (efsm->rtc && efsm->rtc->fsa == fsa)
+            efsm__rtc_spill(efsm);
+
+        // Duplicates of coalescing types are dropped regardless
+        if (fsa->mbox.count < fsa->limit)
+            fsa->overflowed = 0;
+        else if (!(bit >= 0 && fsa->coalesced & 1ULL << bit) &&
+                 (r = efsm__mbox_overflow(fsa, prio, type, data, len)))
+            return r > 0 ? 0 : r;
+    }
+
+    return efsm__mbox_push(fsa, prio, type, data, len);
+}
+
+/** Appends a batch of messages to a fsa's mailbox, all or nothing
+ *
+ * A batch that would go over a mailbox_limit is rejected as a whole under
+ * EFSM_OVERFLOW_REJECT, and otherwise offered a message at a time.
+ *
+ * \return 0 for success, -1 if the message pool or ring can't grow or
+ *         EFSM__FULL if it's rejected
+ */
+static int efsm__mbox_push_many(efsm__fsa_t * fsa, const efsm_msg_t * msgs,
+                                size_t n)
+{
+    efsm__t *efsm = fsa->efsm;
+    efsm__mbox_t *mbox = &fsa->mbox;
+    unsigned long long coalesced;
+    size_t i, kept = n;
+
+    if (efsm->rtc && efsm->rtc->fsa == fsa)
+        efsm__rtc_spill(efsm);
+    coalesced = fsa->coalesced;
+
+    // Sizes the batch without the duplicates, which are dropped
+    if (efsm->coalesce) {
+        for (i = 0, kept = 0; i < n; i++)
+            if (!efsm__coalesce_dup(efsm, &coalesced, msgs[i].type))
+                kept++;
+        coalesced = fsa->coalesced;
+    }
+
+    if (kept > UINT_MAX - mbox->count)
+        return -1;
+
+    if (fsa->limit && mbox->count + kept > fsa->limit) {
+        if (fsa->overflow == EFSM_OVERFLOW_REJECT)
+            return EFSM__FULL;
+
+        for (i = 0; i < n; i++) {
+            int r = efsm__mbox_offer(fsa, 0, msgs[i].type, msgs[i].data, -1);
+            if (r < 0)
+                return r;
+        }
+        return 0;
+    } else if (fsa->limit) {
+        fsa->overflowed = 0;
+    }
+
+    efsm__slot_t *slot = NULL;
+    efsm__msg_t *batch = NULL, *msg = NULL, *tmp;
+    unsigned int count = mbox->count - mbox->n_urgent;
+
+    if (mbox->ring) {
+        while (count + kept > (size_t)mbox->mask + 1)
+            if (efsm__mbox_grow(mbox, efsm->inline_size) < 0)
+                return -1;
+    } else {
+        for (i = 0; i < kept; i++) {
+            msg = efsm__pool_alloc(&efsm->msg_pool);
+            if (!msg) {
+                DL_FOREACH_SAFE(batch, msg, tmp) {
+                    efsm__pool_free(&efsm->msg_pool, msg);
+                }
+                return -1;
+            }
+
+            msg->fsa = fsa;
+            DL_APPEND(batch, msg);
+        }
+        msg = batch;
+    }
+
+    // Nothing can fail from here on
+    for (i = 0; i < n; i++) {
+        if (efsm__coalesce_dup(efsm, &coalesced, msgs[i].type)) {
+            if (fsa->drop_cb)
+                fsa->drop_cb(fsa->data, msgs[i].type, msgs[i].data);
+            continue;
+        }
+
+        if (mbox->ring) {
+            slot = mbox->ring + ((mbox->head + count++) & mbox->mask);
+            slot->type = msgs[i].type;
+            slot->inlined = 0;
+            slot->data = msgs[i].data;
+        } else {
+            msg->type = msgs[i].type;
+            msg->data = msgs[i].data;
+            msg = msg->next;
+        }
+    }
+
+    DL_CONCAT(mbox->queued, batch);
+
+    fsa->coalesced = coalesced;
+    mbox->count += kept;
+    if (fsa->status != EFSM_FSA_QUARANTINED)
+        efsm->n_pending += kept;
+
+    EFSM__STATS(if (mbox->count > efsm->stats.mailbox_high_water)
+                efsm->stats.mailbox_high_water = mbox->count);
+
+    return 0;
+}
+
+/** Reads the next message in a non-empty mailbox, leaving it queued
+ *
+ * \return the message's lane, with EFSM_PRIO_FLUSH if it flushes
+ */
+static inline int efsm__mbox_peek(efsm__mbox_t * mbox, int *type,
+                                  void **data)
+{
+    if (mbox->urgent) {
+        int lane = 31 - __builtin_clz(mbox->urgent);
+        efsm__msg_t *msg = mbox->lanes[lane];
+        *type = msg->type;
+        *data = msg->data;
+        return (lane + 1) | msg->flush;
+    }
+
+    if (mbox->ring) {
+        efsm__slot_t *slot = mbox->ring + mbox->head;
+        *type = slot->type;
+        *data = slot->data;
+    } else {
+        *type = mbox->queued->type;
+        *data = mbox->queued->data;
+    }
+
+    return 0;
+}
+
+/** Drops the message efsm__mbox_peek returned
+ *
+ * The callback it was delivered to could have queued one in a higher lane
+ * since, so this goes by the lane it was peeked from.
+ *
+ * \param prio what efsm__mbox_peek returned
+ */
+static inline void efsm__mbox_pop(efsm__mbox_t * mbox, int prio)
+{
+    int lane = (prio & ~EFSM_PRIO_FLUSH) - 1;
+
+    if (lane >= 0) {
+        efsm__msg_t *msg = mbox->lanes[lane];
+
+        DL_DELETE(mbox->lanes[lane], msg);
+        if (!mbox->lanes[lane])
+            mbox->urgent &= ~(1u << lane);
+        mbox->n_urgent--;
+
+        efsm__msg_release(msg);
+    } else if (mbox->ring) {
+        mbox->head = (mbox->head + 1) & mbox->mask;
+    } else {
+        efsm__msg_destroy(mbox->queued);
+    }
+
+    mbox->count--;
+}
+
+/** Throws away everything in the lanes below a flushing message, handing
+ *  each to the fsa's drop_cb
+ *
+ * \return the number of messages dropped
+ */
+static unsigned int efsm__mbox_flush(efsm__fsa_t * fsa, int lane)
+{
+    efsm__mbox_t *mbox = &fsa->mbox;
+    efsm__msg_t *msg, *tmp;
+    unsigned int n = 0;
+    int l;
+
+    for (l = lane - 1; l >= 1; l--) {
+        DL_FOREACH_SAFE(mbox->lanes[l - 1], msg, tmp) {
+            DL_DELETE(mbox->lanes[l - 1], msg);
+            efsm__coalesce_clear(fsa, msg->type);
+            if (fsa->drop_cb)
+                fsa->drop_cb(fsa->data, msg->type, msg->data);
+            efsm__msg_release(msg);
+            mbox->n_urgent--;
+            n++;
+        }
+        mbox->urgent &= ~(1u << (l - 1));
+    }
+
+    unsigned int count = mbox->count - n - mbox->n_urgent;
+    if (mbox->ring) {
+        for (; count; count--) {
+            efsm__slot_t *slot = mbox->ring + mbox->head;
+            efsm__coalesce_clear(fsa, slot->type);
+            if (fsa->drop_cb)
+                fsa->drop_cb(fsa->data, slot->type, slot->data);
+            mbox->head = (mbox->head + 1) & mbox->mask;
+            n++;
+        }
+    } else {
+        DL_FOREACH_SAFE(mbox->queued, msg, tmp) {
+            efsm__coalesce_clear(fsa, msg->type);
+            if (fsa->drop_cb)
+                fsa->drop_cb(fsa->data, msg->type, msg->data);
+            efsm__msg_destroy(msg);
+            n++;
+        }
+    }
+
+    mbox->count -= n;
+
+    return n;
+}
+
+/** Takes a self send on the drain's continuation queue if it qualifies
+ *
+ * \return 1 if it was taken, 0 if it has to be queued as usual
+ */
+static inline int efsm__rtc_push(efsm__fsa_t * fsa, int prio, int type,
+                                 void *data, long len)
+{
+    efsm__rtc_t *rtc = fsa->efsm->rtc;
+
+    if (!rtc || rtc->fsa != fsa || prio || len >= 0 || !rtc->left ||
+        rtc->n == EFSM__RTC_SLOTS || fsa->mbox.count != rtc->queued ||
+        efsm__coalesce_bit(fsa->efsm, type) >= 0)
+        return 0;
+
+    unsigned int i = (rtc->head + rtc->n) % EFSM__RTC_SLOTS;
+    rtc->slots[i].type = type;
+    rtc->slots[i].data = data;
+    rtc->n++;
+    rtc->left--;
+
+    return 1;
+}
+
+/** Moves whatever is left on the continuation queue, bar the one being
+ *  delivered, into the fsa's mailbox, ahead of a send that doesn't qualify
+ *  for it
+ *
+ * A continuation that can't be queued goes to the fsa's drop_cb.
+ */
+static void efsm__rtc_spill(efsm__t * efsm)
+{
+    efsm__rtc_t *rtc = efsm->rtc;
+    efsm__fsa_t *fsa = rtc->fsa;
+    unsigned int n = rtc->n;
+    unsigned int i;
+
+    if (n == rtc->busy)
+        return;
+
+    // Pushing comes back through here, so empty the queue first
+    rtc->n = rtc->busy;
+    rtc->left = 0;
+
+    for (i = rtc->busy; i < n; i++) {
+        unsigned int slot = (rtc->head + i) % EFSM__RTC_SLOTS;
+        int type = rtc->slots[slot].type;
+        void *data = rtc->slots[slot].data;
+
+        if (efsm__mbox_push(fsa, 0, type, data, -1) < 0 && fsa->drop_cb)
+            fsa->drop_cb(fsa->data, type, data);
+    }
+}
+
+/** Buffers a send or destroy from a callback in a worker
+ *
+ * An inline payload is copied, since the sender's buffer won't outlive the
+ * callback.
+ *
+ * \param len as for efsm__mbox_push
+ *
+ * \return 0 for success, -1 if out of memory
+ */
+static int efsm__defer(efsm__worker_t * self, efsm__fsa_t * fsa, int prio,
+                       int type, void *data, long len, int destroy)
+{
+    if (len > 0 && self->payload_len + len > self->payload_size) {
+        size_t size = self->payload_size ? self->payload_size : 1024;
+        while (size < self->payload_len + len)
+            size *= 2;
+
+        unsigned char *payload = realloc(self->payload, size);
+        if (!payload)
+            return -1;
+
+        self->payload = payload;
+        self->payload_size = size;
+    }
+
+    if (self->n_deferred == self->deferred_size) {
+        size_t size = self->deferred_size ? self->deferred_size * 2 : 64;
+        efsm__deferred_t *deferred =
+            realloc(self->deferred, sizeof(*deferred) * size);
+        if (!deferred)
+            return -1;
+
+        self->deferred = deferred;
+        self->deferred_size = size;
+    }
+
+    efsm__deferred_t *d = self->deferred + self->n_deferred++;
+    d->fsa = fsa;
+    d->prio = prio;
+    d->type = type;
+    d->data = data;
+    d->len = len;
+    d->offset = self->payload_len;
+    d->destroy = destroy;
+
+    if (len > 0) {
+        memcpy(self->payload + self->payload_len, data, len);
+        self->payload_len += len;
+    }
+
+    return 0;
+}
+
+/** Queues a message in a lane, or defers it if we're in a worker
+ *
+ * \param len as for efsm__mbox_push
+ *
+ * \return as for efsm__mbox_offer
+ */
+static int efsm__fsa_send(efsm__fsa_t * fsa, int prio, int type, void *data,
+                          long len)
+{
+    efsm__worker_t *self = efsm__self;
+
+    if (self && self->efsm == fsa->efsm)
+        return efsm__defer(self, fsa, prio, type, data, len, 0);
+
+    if (efsm__rtc_push(fsa, prio, type, data, len))
+        return 0;
+
+    int r = efsm__mbox_offer(fsa, prio, type, data, len);
+    if (r < 0)
+        return r;
+
+    if (fsa->status == EFSM_FSA_IDLE)
+        efsm__fsa_wake(fsa);
+
+    return 0;
+}
+
+/** Turns EFSM__FULL into the -1 and EAGAIN the public API fails with */
+static inline int efsm__send_result(int r)
+{
+    if (r == EFSM__FULL) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    return r;
+}
+
+int efsm_fsa_send(efsm_fsa_t * _fsa, int type, void *data)
+{
+    efsm__fsa_t *fsa = _fsa->data;
+
+    return efsm__send_result(efsm__fsa_send(fsa,
+                                            efsm__msg_prio(fsa->efsm, type),
+                                            type, data, -1));
+}
+
+size_t efsm_fsa_pending(efsm_fsa_t * _fsa)
+{
+    efsm__fsa_t *fsa = _fsa->data;
+
+    return fsa->mbox.count;
+}
+
+int efsm_fsa_send_prio(efsm_fsa_t * _fsa, int prio, int type, void *data)
+{
+    efsm__fsa_t *fsa = _fsa->data;
+    int lane = prio & ~EFSM_PRIO_FLUSH;
+
+    if (lane < 0 || lane >= EFSM_PRIO_LANES)
+        return -1;
+
+    return efsm__send_result(efsm__fsa_send(fsa, prio, type, data, -1));
+}
+
+int efsm_fsa_send_inline(efsm_fsa_t * _fsa, int type, const void *buf,
+                         size_t len)
+{
+    efsm__fsa_t *fsa = _fsa->data;
+
+    if (!fsa->efsm->inline_size || len > fsa->efsm->inline_size)
+        return -1;
+
+    return efsm__send_result(efsm__fsa_send(fsa,
+                                            efsm__msg_prio(fsa->efsm, type),
+                                            type, (void *)buf, len));
+}
+
+int efsm_fsa_send_many(efsm_fsa_t * _fsa, const efsm_msg_t * msgs, size_t n)
+{
+    efsm__fsa_t *fsa = _fsa->data;
+    efsm__worker_t *self = efsm__self;
+    size_t i;
+
+    if (self && self->efsm == fsa->efsm) {
+        for (i = 0; i < n; i++)
+            if (efsm__defer(self, fsa, 0, msgs[i].type, msgs[i].data, -1,
+                            0) < 0)
+                return -1;
+        return 0;
+    }
+
+    int r = efsm__mbox_push_many(fsa, msgs, n);
+    if (r < 0)
+        return efsm__send_result(r);
+
+    if (n && fsa->status == EFSM_FSA_IDLE)
+        efsm__fsa_wake(fsa);
+
+    return 0;
+}
+
+int efsm_fsa_send_multi(efsm_fsa_t ** fsas, size_t n, int type, void *data)
+{
+    size_t i;
+    int r = 0;
+
+    for (i = 0; i < n; i++)
+        if (efsm_fsa_send(fsas[i], type, data) < 0)
+            r = -1;
+
+    return r;
+}
+
+int efsm_broadcast(efsm_t * _efsm, int type, void *data)
+{
+    efsm__t *efsm = _efsm->data;
+    efsm__worker_t *self = efsm__self;
+    efsm__fsa_t *ele;
+    int prio = efsm__msg_prio(efsm, type);
+    int r = 0;
+
+    if (self && self->efsm == efsm) {
+        DL_FOREACH2(efsm->fsas, ele, all_next) {
+            if (efsm__defer(self, ele, prio, type, data, -1, 0) < 0)
+                r = -1;
+        }
+
+        return r;
+    }
+
+    DL_FOREACH2(efsm->fsas, ele, all_next) {
+        if (efsm__mbox_offer(ele, prio, type, data, -1) < 0)
+            r = -1;
+        else if (ele->status == EFSM_FSA_IDLE)
+            efsm__fsa_wake(ele);
+    }
+
+    return r;
+}
+
+int efsm_fsa_send_async(efsm_fsa_t * _fsa, int type, void *data)
+{
+    efsm__fsa_t *fsa = _fsa->data;
+    efsm__t *efsm = fsa->efsm;
+
+    efsm__async_t *msg = malloc(sizeof(*msg));
+    if (!msg)
+        return -1;
+
+    msg->fsa = fsa;
+    msg->prio = efsm__msg_prio(efsm, type);
+    msg->type = type;
+    msg->data = data;
+    msg->len = -1;
+
+    // msg belongs to the consumer once it's pushed, so the old head is kept
+    efsm__async_t *head = atomic_load_explicit(&efsm->inbox,
+                                               memory_order_relaxed);
+    do {
+        msg->next = head;
+    } while (!atomic_compare_exchange_weak_explicit(&efsm->inbox, &head, msg,
+                                                    memory_order_release,
+                                                    memory_order_relaxed));
+
+    // The first message since the last splice wakes up a waiting efsm_loop
+    if (!head) {
+        efsm__loop_t *loop = atomic_load_explicit(&efsm->loop,
+                                                  memory_order_acquire);
+        if (loop) {
+            uint64_t one = 1;
+            ssize_t r = write(loop->wake_fd, &one, sizeof(one));
+            (void)r;
+        }
+    }
+
+    return 0;
+}
+
+/** Moves everything in the async inbox into fsa mailboxes
+ *
+ * The inbox is a stack, so we reverse it to get send order back and put it
+ * behind anything left over from last time.  Messages that can't be queued
+ * (I.e. the message pool is at its max) stay in the backlog for next time,
+ * ones a full mailbox rejects are dropped, as are ones for fsa's that have
+ * since been destroyed.
+ */
+static void efsm__inbox_splice(efsm__t * efsm)
+{
+    efsm__async_t *msg, *next, *fifo = NULL, **prev;
+    efsm__fsa_t *fsa;
+
+    msg = atomic_exchange_explicit(&efsm->inbox, NULL, memory_order_acquire);
+    for (; msg; msg = next) {
+        next = msg->next;
+        msg->next = fifo;
+        fifo = msg;
+    }
+    LL_CONCAT(efsm->backlog, fifo);
+
+    while ((msg = efsm->backlog)) {
+        int r = msg->fsa->status == EFSM_FSA_DEAD ? 0 :
+            efsm__fsa_send(msg->fsa, msg->prio, msg->type, msg->data,
+                           msg->len);
+
+        // There's no one to fail back to when a mailbox is full
+        if (r == EFSM__FULL) {
+            if (msg->fsa->drop_cb)
+                msg->fsa->drop_cb(msg->fsa->data, msg->type, msg->data);
+        } else if (r < 0) {
+            break;
+        }
+
+        efsm->backlog = msg->next;
+        free(msg);
+    }
+
+    if (!efsm->dead)
+        return;
+
+    // Nothing left names the dead once what's still waiting for them goes
+    for (prev = &efsm->backlog; (msg = *prev);) {
+        if (msg->fsa->status == EFSM_FSA_DEAD) {
+            *prev = msg->next;
+            free(msg);
+        } else {
+            prev = &msg->next;
+        }
+    }
+
+    while ((fsa = efsm->dead)) {
+        efsm->dead = fsa->next;
+        efsm__pool_free(&efsm->fsa_pool, fsa);
+    }
+}
+
+/** The wheel's clock, in milliseconds */
+static inline long long efsm__tick(void)
+{
+    return efsm__now() / 1000000;
+}
+
+/** Files a timer in the slot covering its expiry
+ *
+ * Timers due on the current tick only come through here while cascading,
+ * just before that tick's slot is fired.
+ */
+static void efsm__wheel_insert(efsm__wheel_t * w, efsm__timer_t * t)
+{
+    long long expires = t->expires;
+    long long delta = expires - w->now;
+    int level;
+
+    if (delta < 0)
+        expires = w->now;
+
+    for (level = 0; level < EFSM__WHEEL_LEVELS - 1; level++) {
+        if (delta < 1LL << (EFSM__WHEEL_BITS * (level + 1)))
+            break;
+    }
+
+    // Beyond the top level's reach.  We'll be placed again when it cascades
+    long long reach = 1LL << (EFSM__WHEEL_BITS * EFSM__WHEEL_LEVELS);
+    if (delta >= reach)
+        expires = w->now + reach - 1;
+
+    t->level = level;
+    t->slot = (expires >> (EFSM__WHEEL_BITS * level)) & (EFSM__WHEEL_SLOTS - 1);
+
+    DL_APPEND(w->slots[level][t->slot], t);
+    w->occupied[level] |= 1ULL << t->slot;
+}
+
+/** Takes a timer out of the wheel and its fsa's list, and frees it */
+static void efsm__timer_remove(efsm__t * efsm, efsm__timer_t * t)
+{
+    efsm__wheel_t *w = efsm->wheel;
+    efsm__timer_t **slot = &w->slots[t->level][t->slot];
+
+    DL_DELETE(*slot, t);
+    if (!*slot)
+        w->occupied[t->level] &= ~(1ULL << t->slot);
+
+    DL_DELETE2(t->fsa->timers, t, fsa_prev, fsa_next);
+
+    w->n_timers--;
+    t->id = 0;
+    efsm__pool_free(&w->pool, t);
+}
+
+/** Files everything in a slot again, relative to the current tick */
+static void efsm__wheel_cascade(efsm__wheel_t * w, int level, int slot)
+{
+    efsm__timer_t *t, *tmp, *list = w->slots[level][slot];
+
+    w->slots[level][slot] = NULL;
+    w->occupied[level] &= ~(1ULL << slot);
+
+    DL_FOREACH_SAFE(list, t, tmp) {
+        DL_DELETE(list, t);
+        efsm__wheel_insert(w, t);
+    }
+}
+
+/** Advances the wheel to the current tick, sending every due timer's message
+ *
+ * Runs of empty slots are skipped with the occupancy bitmaps, so an advance
+ * costs a step per occupied slot or cascade rather than one per tick.  A
+ * timer whose message can't be queued is retried on the next tick.
+ */
+static void efsm__timers_expire(efsm__t * efsm)
+{
+    efsm__wheel_t *w = efsm->wheel;
+    long long target;
+    int level;
+    const long long mask = EFSM__WHEEL_SLOTS - 1;
+
+    if (!w)
+        return;
+
+    target = efsm__tick();
+
+    while (w->now < target) {
+        if (!w->n_timers) {
+            w->now = target;
+            break;
+        }
+
+        if (!w->occupied[0]) {
+            // Nothing happens until the lowest occupied level cascades
+            for (level = 1; !w->occupied[level]; level++) ;
+
+            int shift = EFSM__WHEEL_BITS * level;
+            int cur = (w->now >> shift) & mask;
+            unsigned long long bits = w->occupied[level];
+            int from = (cur + 1) & mask;
+            if (from)
+                bits = (bits >> from) | (bits << (EFSM__WHEEL_SLOTS - from));
+            long long k = __builtin_ctzll(bits) + 1;
+
+            long long next = ((w->now >> shift) + k) << shift;
+            long long wrap = ((w->now >> (shift + EFSM__WHEEL_BITS)) + 1) <<
+                (shift + EFSM__WHEEL_BITS);
+            if (next > wrap)
+                next = wrap;
+
+            if (next > target) {
+                w->now = target;
+                break;
+            }
+
+            w->now = next - 1;
+        } else if ((w->now + 1) & mask) {
+            long long end = w->now | mask;
+            if (end > target)
+                end = target;
+
+            int from = (w->now + 1) & mask;
+            int to = end & mask;
+            unsigned long long want = (~0ULL << from) &
+                (~0ULL >> (EFSM__WHEEL_SLOTS - 1 - to));
+            unsigned long long due = w->occupied[0] & want;
+
+            if (!due) {
+                w->now = end;
+                continue;
+            }
+
+            w->now = (w->now & ~mask) + __builtin_ctzll(due) - 1;
+        }
+
+        w->now++;
+
+        for (level = 1; level < EFSM__WHEEL_LEVELS; level++) {
+            int shift = EFSM__WHEEL_BITS * level;
+            if (w->now & ((1LL << shift) - 1))
+                break;
+
+            efsm__wheel_cascade(w, level, (w->now >> shift) & mask);
+        }
+
+        int slot = w->now & mask;
+        efsm__timer_t *t, *tmp, *list = w->slots[0][slot];
+
+        w->slots[0][slot] = NULL;
+        w->occupied[0] &= ~(1ULL << slot);
+
+        DL_FOREACH_SAFE(list, t, tmp) {
+            DL_DELETE(list, t);
+
+            if (t->expires > w->now ||
+                efsm_fsa_send(&t->fsa->wrapper, t->type, t->data) < 0) {
+                if (t->expires <= w->now)
+                    t->expires = w->now + 1;
+                efsm__wheel_insert(w, t);
+                continue;
+            }
+
+            DL_DELETE2(t->fsa->timers, t, fsa_prev, fsa_next);
+            w->n_timers--;
+            t->id = 0;
+            efsm__pool_free(&w->pool, t);
+        }
+    }
+}
+
+efsm_timer_t efsm_fsa_send_after(efsm_fsa_t * _fsa, long long delay_ms,
+                                 int type, void *data)
+{
+    efsm__fsa_t *fsa = _fsa->data;
+    efsm__t *efsm = fsa->efsm;
+    efsm_timer_t handle = { NULL, 0 };
+
+    // Callbacks in a parallel pass share the wheel
+    efsm__worker_t *self = efsm__self;
+    if (self && self->efsm == efsm)
+        pthread_mutex_lock(&efsm->par->lock);
+
+    efsm__wheel_t *w = efsm->wheel;
+    if (!w) {
+        w = efsm->wheel = calloc(sizeof(*w), 1);
+        if (!w)
+            goto out;
+
+        w->now = efsm__tick();
+        efsm__pool_init(&w->pool, sizeof(efsm__timer_t), 0, 0);
+    }
+
+    efsm__timer_t *t = efsm__pool_alloc(&w->pool);
+    if (!t)
+        goto out;
+
+    // Never file into the tick already processed
+    long long expires = efsm__tick() + (delay_ms > 0 ? delay_ms : 0);
+    t->expires = expires > w->now ? expires : w->now + 1;
+    t->id = ++w->next_id;
+    t->fsa = fsa;
+    t->type = type;
+    t->data = data;
+
+    efsm__wheel_insert(w, t);
+    DL_APPEND2(fsa->timers, t, fsa_prev, fsa_next);
+    w->n_timers++;
+
+    handle.timer = t;
+    handle.id = t->id;
+
+  out:
+    if (self && self->efsm == efsm)
+        pthread_mutex_unlock(&efsm->par->lock);
+
+    return handle;
+}
+
+/* Handles point into the timer pool, whose slabs live as long as the efsm,
+ * so a stale handle reads a zeroed or reused timer whose id won't match
+ */
+int efsm_timer_cancel(efsm_fsa_t * _fsa, efsm_timer_t handle)
+{
+    efsm__fsa_t *fsa = _fsa->data;
+    efsm__t *efsm = fsa->efsm;
+    efsm__timer_t *t = handle.timer;
+    int r = -1;
+
+    if (!t)
+        return -1;
+
+    efsm__worker_t *self = efsm__self;
+    if (self && self->efsm == efsm)
+        pthread_mutex_lock(&efsm->par->lock);
+
+    if (t->id == handle.id && t->fsa == fsa) {
+        efsm__timer_remove(efsm, t);
+        r = 0;
+    }
+
+    if (self && self->efsm == efsm)
+        pthread_mutex_unlock(&efsm->par->lock);
+
+    return r;
+}
+
+/** Finds the earliest timer in a level
+ *
+ * Slots are visited in the order they'll cascade, starting after the current
+ * one, so below the top level the first occupied slot holds the earliest
+ * timers.  The top level also holds timers beyond its reach, so every slot
+ * there gets looked at.
+ */
+static long long efsm__wheel_level_min(efsm__wheel_t * w, int level)
+{
+    long long min = LLONG_MAX;
+    unsigned long long bits = w->occupied[level];
+    efsm__timer_t *t;
+
+    int from = ((w->now >> (EFSM__WHEEL_BITS * level)) + 1) &
+        (EFSM__WHEEL_SLOTS - 1);
+    if (from)
+        bits = (bits >> from) | (bits << (EFSM__WHEEL_SLOTS - from));
+
+    while (bits) {
+        int i = __builtin_ctzll(bits);
+        int slot = (from + i) & (EFSM__WHEEL_SLOTS - 1);
+
+        DL_FOREACH(w->slots[level][slot], t) {
+            if (t->expires < min)
+                min = t->expires;
+        }
+
+        if (level < EFSM__WHEEL_LEVELS - 1)
+            break;
+
+        bits &= bits - 1;
+    }
+
+    return min;
+}
+
+int efsm_next_timeout(efsm_t * _efsm)
+{
+    efsm__t *efsm = _efsm->data;
+    efsm__wheel_t *w = efsm->wheel;
+    long long min = LLONG_MAX;
+    int level;
+
+    if (!w || !w->n_timers)
+        return -1;
+
+    for (level = 0; level < EFSM__WHEEL_LEVELS; level++) {
+        long long m = efsm__wheel_level_min(w, level);
+        if (m < min)
+            min = m;
+    }
+
+    long long left = min - efsm__tick();
+    if (left < 0)
+        return 0;
+
+    return left < INT_MAX ? (int)left : INT_MAX;
+}
+
+/** Sets up the efsm's epoll set the first time it's needed
+ *
+ * \return the loop or NULL on failure
+ */
+static efsm__loop_t *efsm__loop_get(efsm__t * efsm)
+{
+    efsm__loop_t *loop = atomic_load_explicit(&efsm->loop,
+                                              memory_order_relaxed);
+    if (loop)
+        return loop;
+
+    loop = calloc(sizeof(*loop), 1);
+    if (!loop)
+        return NULL;
+
+    loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+    loop->wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+
+    struct epoll_event ev = { 0 };
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+
+    if (loop->epfd < 0 || loop->wake_fd < 0 ||
+        epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->wake_fd, &ev) < 0) {
+        if (loop->epfd >= 0)
+            close(loop->epfd);
+        if (loop->wake_fd >= 0)
+            close(loop->wake_fd);
+        free(loop);
+        return NULL;
+    }
+
+    atomic_store_explicit(&efsm->loop, loop, memory_order_release);
+
+    return loop;
+}
+
+/** Takes a watch out of the epoll set and its fsa's list, and frees it */
+static void efsm__watch_remove(efsm__t * efsm, efsm__watch_t * w)
+{
+    efsm__loop_t *loop = atomic_load_explicit(&efsm->loop,
+                                              memory_order_relaxed);
+
+    epoll_ctl(loop->epfd, EPOLL_CTL_DEL, w->fd, NULL);
+
+    DL_DELETE(w->fsa->watches, w);
+    loop->n_watches--;
+
+    free(w);
+}
+
+int efsm_fsa_watch_fd(efsm_fsa_t * _fsa, int fd, int events, int msg_in,
+                      int msg_out)
+{
+    efsm__fsa_t *fsa = _fsa->data;
+    efsm__t *efsm = fsa->efsm;
+    efsm__watch_t *w;
+    int r = -1;
+
+    if (!(events & (EFSM_FD_IN | EFSM_FD_OUT)))
+        return -1;
+
+    efsm__worker_t *self = efsm__self;
+    if (self && self->efsm == efsm)
+        pthread_mutex_lock(&efsm->par->lock);
+
+    efsm__loop_t *loop = efsm__loop_get(efsm);
+    if (!loop)
+        goto out;
+
+    struct epoll_event ev = { 0 };
+    if (events & EFSM_FD_IN)
+        ev.events |= EPOLLIN | EPOLLRDHUP;
+    if (events & EFSM_FD_OUT)
+        ev.events |= EPOLLOUT;
+    if (events & EFSM_FD_EDGE)
+        ev.events |= EPOLLET;
+
+    DL_FOREACH(fsa->watches, w) {
+        if (w->fd == fd)
+            break;
+    }
+
+    if (w) {
+        ev.data.ptr = w;
+        if (epoll_ctl(loop->epfd, EPOLL_CTL_MOD, fd, &ev) < 0)
+            goto out;
+    } else {
+        w = malloc(sizeof(*w));
+        if (!w)
+            goto out;
+
+        w->fsa = fsa;
+        w->fd = fd;
+        ev.data.ptr = w;
+
+        if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            free(w);
+            goto out;
+        }
+
+        DL_APPEND(fsa->watches, w);
+        loop->n_watches++;
+    }
+
+    w->events = events;
+    w->msg_in = msg_in;
+    w->msg_out = msg_out;
+    r = 0;
+
+  out:
+    if (self && self->efsm == efsm)
+        pthread_mutex_unlock(&efsm->par->lock);
+
+    return r;
+}
+
+int efsm_fsa_unwatch_fd(efsm_fsa_t * _fsa, int fd)
+{
+    efsm__fsa_t *fsa = _fsa->data;
+    efsm__t *efsm = fsa->efsm;
+    efsm__watch_t *w;
+    int r = -1;
+
+    efsm__worker_t *self = efsm__self;
+    if (self && self->efsm == efsm)
+        pthread_mutex_lock(&efsm->par->lock);
+
+    DL_FOREACH(fsa->watches, w) {
+        if (w->fd == fd) {
+            efsm__watch_remove(efsm, w);
+            r = 0;
+            break;
+        }
+    }
+
+    if (self && self->efsm == efsm)
+        pthread_mutex_unlock(&efsm->par->lock);
+
+    return r;
+}
+
+/** Events taken per epoll_wait in efsm_loop_once */
+#define EFSM__LOOP_EVENTS 64
+
+/* Events are all turned into sends before any callback runs, so nothing can
+ * unwatch (and free) a watch later in the same batch
+ */
+int efsm_loop_once(efsm_t * _efsm, int timeout_ms)
+{
+    efsm__t *efsm = _efsm->data;
+    struct epoll_event events[EFSM__LOOP_EVENTS];
+    int i, n, delivered = 0;
+
+    efsm__loop_t *loop = efsm__loop_get(efsm);
+    if (!loop)
+        return -1;
+
+    if (efsm->n_pending || efsm->runq || efsm->backlog ||
+        atomic_load_explicit(&efsm->inbox, memory_order_relaxed)) {
+        timeout_ms = 0;
+    } else {
+        int next = efsm_next_timeout(_efsm);
+        if (next >= 0 && (timeout_ms < 0 || next < timeout_ms))
+            timeout_ms = next;
+    }
+
+    n = epoll_wait(loop->epfd, events, EFSM__LOOP_EVENTS, timeout_ms);
+    if (n < 0 && errno != EINTR)
+        return -1;
+
+    for (i = 0; i < n; i++) {
+        efsm__watch_t *w = events[i].data.ptr;
+        uint32_t ready = events[i].events;
+
+        if (!w) {
+            uint64_t count;
+            ssize_t r = read(loop->wake_fd, &count, sizeof(count));
+            (void)r;
+            continue;
+        }
+
+        int in = ready & (EPOLLIN | EPOLLRDHUP);
+        int out = ready & EPOLLOUT;
+        if (ready & (EPOLLERR | EPOLLHUP)) {
+            if (w->events & EFSM_FD_IN)
+                in = 1;
+            else
+                out = 1;
+        }
+
+        if (in && (w->events & EFSM_FD_IN) &&
+            efsm_fsa_send(&w->fsa->wrapper, w->msg_in,
+                          (void *)(intptr_t) w->fd) == 0)
+            delivered++;
+        if (out && (w->events & EFSM_FD_OUT) &&
+            efsm_fsa_send(&w->fsa->wrapper, w->msg_out,
+                          (void *)(intptr_t) w->fd) == 0)
+            delivered++;
+    }
+
+    if (efsm_run(_efsm) < 0)
+        return -1;
+
+    return delivered;
+}
+
+int efsm_loop(efsm_t * _efsm)
+{
+    efsm__t *efsm = _efsm->data;
+
+    efsm__loop_t *loop = efsm__loop_get(efsm);
+    if (!loop)
+        return -1;
+
+    loop->stop = 0;
+
+    while (!loop->stop) {
+        if (!loop->n_watches && efsm_next_timeout(_efsm) < 0 &&
+            !efsm->n_pending && !efsm->runq && !efsm->backlog &&
+            !atomic_load_explicit(&efsm->inbox, memory_order_relaxed))
+            break;
+
+        if (efsm_loop_once(_efsm, -1) < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+void efsm_loop_stop(efsm_t * _efsm)
+{
+    efsm__t *efsm = _efsm->data;
+    efsm__loop_t *loop = efsm__loop_get(efsm);
+
+    if (loop)
+        loop->stop = 1;
+}
+
+/** Delivers a message to a fsa, through the efsm's engine or the
+ *  transition its state resolves to, moving it to the next state
+ *
+ * \return 0 for success, 1 if the fsa is transitioning to floor, -1 if
+ *         there's no transition for the message or its callback failed
+ */
+static inline int efsm__fsa_deliver(efsm__fsa_t * fsa, int type, void *data)
+{
+    int i = -1;
+    int r = 0;
+    efsm__t *efsm = fsa->efsm;
+    efsm__def_t *def = efsm->def;
+    efsm__transition_t *transition;
+    efsm__transition_code_t *code;
+
+    EFSM__STATS(efsm__stats_t * stats =
+                efsm__self ? &efsm__self->stats : &efsm->stats);
+    EFSM__STATS(long long start = 0);
+    efsm__trace_t *trace = efsm__trace_sample(efsm);
+    uint64_t ticks = 0;
+    int pre_state = fsa->state;
+
+    if (def->engine) {
+        EFSM__STATS(if (stats->latency) start = efsm__now());
+        if (trace)
+            ticks = efsm__ticks();
+
+        r = def->engine(&fsa->wrapper, fsa->data, fsa->state, type,
+                        data, efsm->transition_cb, &i);
+        if (i >= 0)
+            i = def->rule_map[i];
+    }
+
+    // Engines only match exact rules, wildcards and parents are ours
+    if (i < 0 && (!def->engine || def->up)) {
+        i = efsm__resolve(def, fsa->state, type);
+
+        if (i >= 0) {
+            int next_state = def->transitions[i].next_state;
+            code = def->codes + i;
+
+            if (efsm->transition_cb)
+                efsm->transition_cb(fsa->state, type,
+                                    next_state == EFSM_SAME ?
+                                    fsa->state : next_state);
+
+            EFSM__STATS(if (stats->latency) start = efsm__now());
+            if (trace)
+                ticks = efsm__ticks();
+
+            if (code->batch) {
+                efsm_fsa_t *wrapper = &fsa->wrapper;
+                code->batch(&wrapper, &fsa->data, code->data, type, &data,
+                            &r, 1);
+            } else {
+                r = code->code(&fsa->wrapper, fsa->data, code->data, type,
+                               data);
+            }
+        }
+    }
+
+    if (i < 0)
+        return -1;
+
+    transition = def->transitions + i;
+
+    if (trace) {
+        int post_state = transition->next_state == EFSM_SAME ? pre_state :
+            transition->next_state;
+        if (r < 0 || (r > 0 && post_state != -1))
+            post_state = pre_state;
+        efsm__trace_record(efsm, trace, EFSM__TRACE_FSA(fsa), pre_state, type,
+                           post_state, ticks, efsm__ticks());
+    }
+
+    EFSM__STATS(stats->transitions[i]++);
+    EFSM__STATS(stats->msgs++);
+    EFSM__STATS(if (stats->latency)
+                stats->latency[i * EFSM_STATS_BUCKETS +
+                               efsm__log2_bucket(efsm__now() - start)]++);
+
+    if (r < 0 || (r > 0 && transition->next_state != -1))
+        return -1;
+    else if (r > 0)
+        return 1;
+
+    if (transition->next_state != EFSM_SAME)
+        fsa->state = transition->next_state;
+
+    return 0;
+}
+
+/** Delivers the continuations queued by the last message, and the ones
+ *  they queue in turn
+ *
+ * \return 0 once the queue is empty, 1 if the fsa is transitioning to
+ *         floor or -1 on error, with the failed continuation left at the
+ *         head of the queue
+ */
+static int efsm__rtc_run(efsm__fsa_t * fsa, efsm__rtc_t * rtc)
+{
+    int r;
+
+    while (rtc->n) {
+        rtc->busy = 1;
+        r = efsm__fsa_deliver(fsa, rtc->slots[rtc->head].type,
+                              rtc->slots[rtc->head].data);
+        rtc->busy = 0;
+        if (r < 0)
+            return -1;
+
+        rtc->head = (rtc->head + 1) % EFSM__RTC_SLOTS;
+        rtc->n--;
+
+        if (r > 0)
+            return 1;
+    }
+
+    return 0;
+}
+
+/** processes waiting messages for a given fsa
+ *
+ * o loops over as many messages as were queued when we started, up to max,
+ *   so messages sent to the fsa from its own callbacks wait for the next
+ *   pass unless they're in a higher lane than what's left, or run to
+ *   completion takes them
+ * o drops the lanes below a EFSM_PRIO_FLUSH message before delivering it,
+ *   which counts against max
+ * o transitions based on message type
+ * o calls transition callbacks with messages, or has the efsm's engine do
+ *   both
+ * o returns 1 if the fsa is transitioning to floor, without destroying it
+ * o returns -1 if an error occurs, leaving the message that failed queued
+ *   o no transition is available for a given message
+ *   o a transition callback returns -1
+ *
+ * This only touches the fsa itself, which is what lets efsm_run_parallel
+ * drain fsa's on several threads at once.  That includes the efsm's count of
+ * pending messages, so callers take the messages drained (which includes
+ * the one that destroyed the fsa and any dropped, but not one that failed)
+ * off that.
+ *
+ * \param rtc the continuation queue, or NULL without run to completion
+ * \param max the most messages to process
+ * \param[out] n_drained the number of messages taken out of the mailbox
+ */
+static int efsm__fsa_drain_mbox(efsm__fsa_t * fsa, efsm__rtc_t * rtc,
+                                unsigned int max, unsigned int *n_drained)
+{
+    int r;
+    int type;
+    void *data;
+    efsm__t *efsm = fsa->efsm;
+    unsigned int n = fsa->mbox.count < max ? fsa->mbox.count : max;
+
+    for (*n_drained = 0; *n_drained < n; (*n_drained)++) {
+        int prio = efsm__mbox_peek(&fsa->mbox, &type, &data);
+
+        if (prio & EFSM_PRIO_FLUSH) {
+            int lane = prio & ~EFSM_PRIO_FLUSH;
+
+            fsa->mbox.lanes[lane - 1]->flush = 0;
+            *n_drained += efsm__mbox_flush(fsa, lane);
+            if (*n_drained >= n)
+                break;
+        }
+
+        // Sends of this type from the callback queue a fresh message
+        int bit = efsm__coalesce_bit(efsm, type);
+        if (bit >= 0)
+            fsa->coalesced &= ~(1ULL << bit);
+
+        // Nothing can point at ring payloads the last callback retired
+        if (fsa->mbox.retired) {
+            free(fsa->mbox.retired);
+            fsa->mbox.retired = NULL;
+        }
+
+        if (rtc) {
+            rtc->queued = 1;
+            rtc->left = efsm->rtc_hops;
+        }
+
+        fsa->mbox.busy = prio + 1;
+        r = efsm__fsa_deliver(fsa, type, data);
+        fsa->mbox.busy = 0;
+
+        if (r < 0) {
+            // Still queued, so still pending
+            if (bit >= 0)
+                fsa->coalesced |= 1ULL << bit;
+            return -1;
+        }
+
+        efsm__mbox_pop(&fsa->mbox, prio);
+
+        if (rtc) {
+            rtc->queued = 0;
+            if (!r && rtc->n)
+                r = efsm__rtc_run(fsa, rtc);
+        }
+
+        if (r) {
+            (*n_drained)++;
+            return r;
+        }
+    }
+
+    return 0;
+}
+
+/** efsm__fsa_drain_mbox, with run to completion if it's on and we're not
+ *  in a worker
+ *
+ * Continuations left over when it returns, after an error or from the
+ * message that destroyed the fsa, are spilled into its mailbox as if they'd
+ * been queued all along.
+ */
+int efsm__fsa_drain(efsm__fsa_t * fsa, unsigned int max,
+                    unsigned int *n_drained)
+{
+    efsm__t *efsm = fsa->efsm;
+    efsm__worker_t *self = efsm__self;
+    efsm__rtc_t rtc;
+    int r;
+
+    if (!efsm->rtc_hops || (self && self->efsm == efsm))
+        return efsm__fsa_drain_mbox(fsa, NULL, max, n_drained);
+
+    rtc.fsa = fsa;
+    rtc.queued = 0;
+    rtc.left = 0;
+    rtc.head = 0;
+    rtc.n = 0;
+    rtc.busy = 0;
+    efsm->rtc = &rtc;
+
+    r = efsm__fsa_drain_mbox(fsa, &rtc, max, n_drained);
+
+    efsm__rtc_spill(efsm);
+    efsm->rtc = NULL;
+
+    return r;
+}
+
+/** drains a fsa, then destroys it or toggles it back to wherever it needs
+ *  to be
+ *
+ * \return 0 for success, 1 if the fsa was destroyed, -1 on error
+ */
+int efsm__fsa_run(efsm__fsa_t * fsa)
+{
+    unsigned int n;
+    int r = efsm__fsa_drain(fsa, UINT_MAX, &n);
+
+    fsa->efsm->n_pending -= n;
+
+    if (r < 0)
+        return -1;
+
+    if (r > 0) {
+        efsm__fsa_destroy(fsa);
+        return 1;
+    }
+
+    efsm__fsa_requeue(fsa);
+
+    return 0;
+}
+
+/** Sets aside the message at the head of a fsa's mailbox, which just
+ *  failed, by efsm_opts_t.on_error
+ *
+ * The fsa is on the run queue, and leaves its spot there either way: with
+ * error_msg queued it's requeued for the next pass, otherwise it's
+ * quarantined.
+ */
+static void efsm__fsa_fail(efsm__fsa_t * fsa)
+{
+    efsm__t *efsm = fsa->efsm;
+    int type;
+    void *data;
+    int prio = efsm__mbox_peek(&fsa->mbox, &type, &data);
+
+    EFSM__STATS(efsm->stats.errors++);
+
+    if (fsa->error_cb)
+        fsa->error_cb(fsa->data, fsa->state, type, data);
+    if (fsa->drop_cb)
+        fsa->drop_cb(fsa->data, type, data);
+
+    efsm__coalesce_clear(fsa, type);
+    efsm__mbox_pop(&fsa->mbox, prio);
+    efsm->n_pending--;
+
+    if (efsm->on_error == EFSM_ERROR_MSG && type != efsm->error_msg &&
+        efsm__mbox_push(fsa, efsm__msg_prio(efsm, efsm->error_msg),
+                        efsm->error_msg, NULL, -1) == 0) {
+        efsm__fsa_requeue(fsa);
+        return;
+    }
+
+    DL_DELETE(efsm->runq, fsa);
+    fsa->status = EFSM_FSA_QUARANTINED;
+    efsm->n_pending -= fsa->mbox.count;
+}
+
+/** Frees efsm_run's batch scratch */
+static void efsm__batch_free(efsm__batch_t * b)
+{
+    free(b->counts);
+    free(b->offsets);
+    free(b->groups);
+    free(b->members);
+    free(b->prios);
+    free(b->fsas);
+    free(b->fsa_data);
+    free(b->msg_data);
+    free(b->results);
+}
+
+/** Makes room for n fsa's in efsm_run's batch scratch
+ *
+ * \return 0 for success, -1 if out of memory
+ */
+static int efsm__batch_reserve(efsm__t * efsm, size_t n)
+{
+    efsm__batch_t *b = &efsm->batch;
+    int n_transitions = efsm->def->n_transitions;
+
+    if (!b->counts) {
+        b->counts = calloc(n_transitions, sizeof(*b->counts));
+        b->offsets = malloc(sizeof(*b->offsets) * n_transitions);
+        b->groups = malloc(sizeof(*b->groups) * n_transitions);
+        if (!b->counts || !b->offsets || !b->groups)
+            return -1;
+    }
+
+    if (n <= b->size)
+        return 0;
+
+#define EFSM__BATCH_GROW(field) \
+    do { \
+        void *grown = realloc(b->field, sizeof(*b->field) * n); \
+        if (!grown) \
+            return -1; \
+        b->field = grown; \
+    } while (0)
+
+    EFSM__BATCH_GROW(members);
+    EFSM__BATCH_GROW(prios);
+    EFSM__BATCH_GROW(fsas);
+    EFSM__BATCH_GROW(fsa_data);
+    EFSM__BATCH_GROW(msg_data);
+    EFSM__BATCH_GROW(results);
+
+#undef EFSM__BATCH_GROW
+
+    b->size = n;
+
+    return 0;
+}
+
+/** Delivers one batch, then pops, moves on and requeues (or destroys) each
+ *  fsa whose message it took
+ *
+ * \return 0 for success, -1 if any of its messages failed, which are left
+ *         queued
+ */
+static int efsm__batch_deliver(efsm__t * efsm, int i, size_t start, size_t n)
+{
+    efsm__batch_t *b = &efsm->batch;
+    efsm__transition_t *transition = efsm->def->transitions + i;
+    efsm__transition_code_t *code = efsm->def->codes + i;
+    int next_state = transition->next_state;
+    int type = transition->msg_type;
+    int bit = efsm__coalesce_bit(efsm, type);
+    int failed = 0;
+    efsm__fsa_t *fsa;
+    size_t j, w;
+
+    EFSM__STATS(long long start_ns = 0);
+
+    for (j = w = start; j < start + n; j++) {
+        fsa = b->members[j];
+
+        // Peeked now, since earlier batches may have moved ring payloads or
+        // jumped the queue, so what's no longer due this is left till later
+        int t;
+        void *data;
+        int prio = efsm__mbox_peek(&fsa->mbox, &t, &data);
+        if (t != type || (prio & EFSM_PRIO_FLUSH))
+            continue;
+
+        b->members[w] = fsa;
+        b->fsas[w] = b->fsas[j];
+        b->fsa_data[w] = b->fsa_data[j];
+        b->msg_data[w] = data;
+        b->prios[w] = prio;
+        w++;
+
+        fsa->mbox.busy = prio + 1;
+
+        if (bit >= 0)
+            fsa->coalesced &= ~(1ULL << bit);
+        if (fsa->mbox.retired) {
+            free(fsa->mbox.retired);
+            fsa->mbox.retired = NULL;
+        }
+        if (efsm->transition_cb)
+            efsm->transition_cb(fsa->state, type, next_state == EFSM_SAME ?
+                                fsa->state : next_state);
+    }
+
+    n = w - start;
+    if (!n)
+        return 0;
+
+    EFSM__STATS(if (efsm->stats.latency) start_ns = efsm__now());
+    efsm__trace_t *trace = efsm__trace_ring(efsm);
+    uint64_t ticks = trace ? efsm__ticks() : 0, each = 0;
+
+    code->batch(b->fsas + start, b->fsa_data + start, code->data, type,
+                b->msg_data + start, b->results + start, n);
+
+    // The members share the call's time equally
+    if (trace)
+        each = (efsm__ticks() - ticks) / n;
+
+    EFSM__STATS(efsm->stats.transitions[i] += n);
+    EFSM__STATS(efsm->stats.msgs += n);
+    EFSM__STATS(if (efsm->stats.latency)
+                efsm->stats.latency[i * EFSM_STATS_BUCKETS +
+                                    efsm__log2_bucket((efsm__now() -
+                                                       start_ns) / n)] += n);
+
+    for (j = start; j < start + n; j++) {
+        int r = b->results[j];
+        int error = r < 0 || (r > 0 && next_state != -1);
+        fsa = b->members[j];
+        fsa->mbox.busy = 0;
+
+        if (trace)
+            efsm__trace_record(efsm, trace, EFSM__TRACE_FSA(fsa), fsa->state,
+                               type, error || next_state == EFSM_SAME ?
+                               fsa->state : next_state, ticks, ticks + each);
+
+        if (error) {
+            // Still queued, so still pending
+            if (bit >= 0)
+                fsa->coalesced |= 1ULL << bit;
+            if (efsm->on_error)
+                efsm__fsa_fail(fsa);
+            else
+                failed = 1;
+            continue;
+        }
+
+        efsm__mbox_pop(&fsa->mbox, b->prios[j]);
+        efsm->n_pending--;
+
+        if (r > 0) {
+            efsm__fsa_destroy(fsa);
+            continue;
+        }
+
+        if (next_state != EFSM_SAME)
+            fsa->state = next_state;
+        efsm__fsa_requeue(fsa);
+    }
+
+    return failed ? -1 : 0;
+}
+
+/** Starts a pass of efsm_run by delivering the next message of every fsa on
+ *  the run queue that's due a transition with a batch callback
+ *
+ * The fsa's are counting sorted into a group per transition, keeping run
+ * queue order within each, and the groups go in the order their first fsa
+ * was seen.  Those fsa's are requeued for the next pass, the rest of the
+ * pass goes as usual.  If the scratch can't grow every message is left to
+ * be delivered alone.
+ *
+ * \return 0 for success, -1 if a message failed
+ */
+static int efsm__batch_pass(efsm__t * efsm)
+{
+    efsm__def_t *def = efsm->def;
+    efsm__batch_t *b = &efsm->batch;
+    efsm__fsa_t *fsa;
+    size_t total = 0, at = 0;
+    int n_groups = 0;
+    int state = -1, type = -1, i = -1;
+    int g, t, r = 0;
+    void *data;
+
+    if (efsm__batch_reserve(efsm, 0) < 0)
+        return 0;
+
+    for (fsa = efsm->runq; fsa && fsa->pass != efsm->pass; fsa = fsa->next) {
+        fsa->batch = -1;
+
+        // A flush has to drop the lanes below first, so it goes alone
+        if (efsm__mbox_peek(&fsa->mbox, &t, &data) & EFSM_PRIO_FLUSH)
+            continue;
+
+        if (fsa->state != state || t != type) {
+            state = fsa->state;
+            type = t;
+            i = efsm__resolve(def, state, type);
+        }
+
+        if (i < 0 || !def->codes[i].batch)
+            continue;
+
+        fsa->batch = i;
+        if (!b->counts[i]++)
+            b->groups[n_groups++] = i;
+        total++;
+    }
+
+    if (total && efsm__batch_reserve(efsm, total) < 0) {
+        for (g = 0; g < n_groups; g++)
+            b->counts[b->groups[g]] = 0;
+        return 0;
+    }
+
+    for (g = 0; g < n_groups; g++) {
+        b->offsets[b->groups[g]] = at;
+        at += b->counts[b->groups[g]];
+    }
+
+    for (fsa = efsm->runq; total && fsa && fsa->pass != efsm->pass;
+         fsa = fsa->next) {
+        if (fsa->batch < 0)
+            continue;
+
+        size_t j = b->offsets[fsa->batch]++;
+        b->members[j] = fsa;
+        b->fsas[j] = &fsa->wrapper;
+        b->fsa_data[j] = fsa->data;
+    }
+
+    for (g = 0, at = 0; g < n_groups; g++) {
+        size_t n = b->counts[b->groups[g]];
+
+        b->counts[b->groups[g]] = 0;
+        if (efsm__batch_deliver(efsm, b->groups[g], at, n) < 0)
+            r = -1;
+        at += n;
+    }
+
+    return r;
+}
+
+/** The efsm's own counters for k of 0, parallel worker k - 1's otherwise */
+static efsm__stats_t *efsm__stats_block(efsm__t * efsm, int k)
+{
+    return k ? &efsm->par->workers[k - 1].stats : &efsm->stats;
+}
+
+/** Whether transition i of a and j of b came from the same rule */
+static int efsm__transition_same(efsm__def_t * a, int i, efsm__def_t * b,
+                                 int j)
+{
+    return a->transitions[i].msg_type == b->transitions[j].msg_type &&
+        a->transitions[i].next_state == b->transitions[j].next_state &&
+        a->codes[i].code == b->codes[j].code &&
+        a->codes[i].data == b->codes[j].data &&
+        a->codes[i].batch == b->codes[j].batch;
+}
+
+/** Puts def in place of the efsm's, taking over its reference
+ *
+ * Each block of counters is moved over to def's transitions, following the
+ * rules the two have in common, and the batch scratch is dropped to be
+ * regrown for def's.  Nothing's running, so no worker can be holding the old
+ * def, which is released.
+ *
+ * \return 0 for success, -1 if out of memory, with nothing changed
+ */
+static int efsm__def_swap(efsm__t * efsm, efsm__def_t * def)
+{
+    efsm__def_t *old = efsm->def;
+    int n_blocks = 1 + (efsm->par ? efsm->par->n_threads : 0);
+    int *map = malloc(sizeof(*map) * (old->n_transitions + 1));
+    efsm__stats_t *moved = calloc(sizeof(*moved), n_blocks);
+    int failed = !map || !moved;
+    int i, j, k, s, b;
+
+    for (k = 0; k < n_blocks && !failed; k++) {
+        efsm__stats_t *stats = efsm__stats_block(efsm, k);
+
+        if (stats->transitions)
+            moved[k].transitions = calloc(sizeof(*stats->transitions),
+                                          def->n_transitions + 1);
+        if (stats->latency)
+            moved[k].latency = calloc(sizeof(*stats->latency) *
+                                      EFSM_STATS_BUCKETS,
+                                      def->n_transitions + 1);
+        failed = (stats->transitions && !moved[k].transitions) ||
+            (stats->latency && !moved[k].latency);
+    }
+
+    if (failed) {
+        for (k = 0; moved && k < n_blocks; k++) {
+            free(moved[k].transitions);
+            free(moved[k].latency);
+        }
+        free(moved);
+        free(map);
+        return -1;
+    }
+
+    for (s = 0; s < old->n_states; s++) {
+        int to = s == old->root ? def->root : s;
+
+        for (i = old->offsets[s]; i < old->offsets[s + 1]; i++) {
+            map[i] = -1;
+            if (to < 0 || to >= def->n_states)
+                continue;
+            for (j = def->offsets[to]; j < def->offsets[to + 1]; j++)
+                if (efsm__transition_same(old, i, def, j)) {
+                    map[i] = j;
+                    break;
+                }
+        }
+    }
+
+    for (k = 0; k < n_blocks; k++) {
+        efsm__stats_t *stats = efsm__stats_block(efsm, k);
+
+        for (i = 0; stats->transitions && i < old->n_transitions; i++) {
+            if (map[i] < 0)
+                continue;
+            moved[k].transitions[map[i]] += stats->transitions[i];
+            for (b = 0; stats->latency && b < EFSM_STATS_BUCKETS; b++)
+                moved[k].latency[map[i] * EFSM_STATS_BUCKETS + b] +=
+                    stats->latency[i * EFSM_STATS_BUCKETS + b];
+        }
+
+        free(stats->transitions);
+        free(stats->latency);
+        stats->transitions = moved[k].transitions;
+        stats->latency = moved[k].latency;
+    }
+
+    free(moved);
+    free(map);
+
+    efsm__batch_free(&efsm->batch);
+    memset(&efsm->batch, 0, sizeof(efsm->batch));
+
+    efsm->def = def;
+    efsm_def_release(&old->wrapper);
+
+    return 0;
+}
+
+/** Ends one of the efsm_run's, swapping in a def made during it once the
+ *  outermost is over.  Without the memory to, it waits for the next */
+static void efsm__run_done(efsm__t * efsm)
+{
+    if (--efsm->in_run || !efsm->def_next)
+        return;
+
+    if (efsm__def_swap(efsm, efsm->def_next) == 0)
+        efsm->def_next = NULL;
+}
+
+/* Starts a new pass and works off the head of the run queue until it's empty
+ * or the head was queued during the pass.  Idle fsa's are never touched
+ */
+static int efsm__run(efsm__t * efsm)
+{
+    int r;
+    unsigned long long before = efsm->stats.msgs;
+
+    efsm__fsa_t *fsa;
+
+    efsm__ids_unhand(efsm);
+    efsm__inbox_splice(efsm);
+    efsm__timers_expire(efsm);
+
+    efsm->pass++;
+
+    if (efsm->def->n_batch && efsm__batch_pass(efsm) < 0) {
+        efsm__stats_run(efsm, efsm->stats.msgs - before);
+        return -1;
+    }
+
+    while ((fsa = efsm->runq) && fsa->pass != efsm->pass) {
+        r = efsm__fsa_run(fsa);
+
+        if (r < 0 && efsm->on_error) {
+            efsm__fsa_fail(fsa);
+        } else if (r < 0) {
+            efsm__stats_run(efsm, efsm->stats.msgs - before);
+            return -1;
+        }
+    }
+
+    efsm__stats_run(efsm, efsm->stats.msgs - before);
+
+    return efsm->runq || efsm->backlog ||
+        atomic_load_explicit(&efsm->inbox, memory_order_relaxed) ? 1 : 0;
+}
+
+int efsm_run(efsm_t * _efsm)
+{
+    efsm__t *efsm = _efsm->data;
+
+    efsm->in_run++;
+    int r = efsm__run(efsm);
+    efsm__run_done(efsm);
+
+    return r;
+}
+
+/** Messages drained between clock checks in efsm_run_budget */
+#define EFSM__BUDGET_SLICE 64
+
+/* Works off the head of the run queue, which is always the next fsa due a
+ * turn since drained fsa's leave it.  A fsa that's still got messages when
+ * the budget runs out, or that got more while it was drained, goes to the
+ * back.
+ */
+static long efsm__run_budget(efsm__t * efsm, size_t max_msgs,
+                             long long max_ns)
+{
+    efsm__fsa_t *fsa;
+    long long deadline = max_ns > 0 ? efsm__now() + max_ns : 0;
+    size_t left = max_msgs ? max_msgs : (size_t)-1;
+    unsigned long long before = efsm->stats.msgs;
+    unsigned int n;
+    int r;
+
+    efsm__ids_unhand(efsm);
+    efsm__inbox_splice(efsm);
+    efsm__timers_expire(efsm);
+
+    while (left && (fsa = efsm->runq)) {
+        unsigned int max = left < UINT_MAX ? (unsigned int)left : UINT_MAX;
+        if (deadline && max > EFSM__BUDGET_SLICE)
+            max = EFSM__BUDGET_SLICE;
+
+        r = efsm__fsa_drain(fsa, max, &n);
+        efsm->n_pending -= n;
+        left -= n < left ? n : left;
+
+        if (r < 0 && efsm->on_error) {
+            efsm__fsa_fail(fsa);
+            continue;
+        } else if (r < 0) {
+            efsm__stats_run(efsm, efsm->stats.msgs - before);
+            return -1;
+        }
+
+        int out_of_time = deadline && efsm__now() >= deadline;
+
+        if (r > 0) {
+            efsm__fsa_destroy(fsa);
+        } else if (n < max || !fsa->mbox.count || !left || out_of_time) {
+            efsm__fsa_requeue(fsa);
+        }
+
+        if (out_of_time)
+            break;
+    }
+
+    efsm__stats_run(efsm, efsm->stats.msgs - before);
+
+    return (long)efsm->n_pending + (efsm->backlog ||
+                                    atomic_load_explicit(&efsm->inbox,
+                                                         memory_order_relaxed)
+                                    ? 1 : 0);
+}
+
+long efsm_run_budget(efsm_t * _efsm, size_t max_msgs, long long max_ns)
+{
+    efsm__t *efsm = _efsm->data;
+
+    efsm->in_run++;
+    long r = efsm__run_budget(efsm, max_msgs, max_ns);
+    efsm__run_done(efsm);
+
+    return r;
+}
+
+/** Claims the next undrained fsa in a worker's shard
+ *
+ * \return the fsa or NULL if the shard is exhausted
+ */
+static inline efsm__fsa_t *efsm__worker_claim(efsm__worker_t * w)
+{
+    unsigned int i = atomic_fetch_add_explicit(&w->next, 1,
+                                               memory_order_relaxed);
+
+    return i < w->n_fsas ? w->fsas[i] : NULL;
+}
+
+/** Drains the worker's own shard, then steals from everyone else's */
+static void efsm__worker_run(efsm__worker_t * self)
+{
+    efsm__par_t *par = self->efsm->par;
+    efsm__fsa_t *fsa;
+    int i;
+
+    efsm__self = self;
+
+    for (i = 0; i < par->n_threads; i++) {
+        efsm__worker_t *victim =
+            par->workers + (self->index + i) % par->n_threads;
+
+        while (!atomic_load_explicit(&par->failed, memory_order_relaxed) &&
+               (fsa = efsm__worker_claim(victim))) {
+            unsigned int n;
+            fsa->par_result = efsm__fsa_drain(fsa, UINT_MAX, &n);
+            self->n_drained += n;
+
+            if (fsa->par_result < 0 && !self->efsm->on_error)
+                atomic_store_explicit(&par->failed, 1, memory_order_relaxed);
+        }
+    }
+
+    efsm__self = NULL;
+}
+
+/** Body of the worker pool threads, which run a worker once per pass */
+static void *efsm__worker_main(void *arg)
+{
+    efsm__worker_t *self = arg;
+    efsm__par_t *par = self->efsm->par;
+
+    // The pool starts at generation 0, which a slow starting thread may
+    // already have missed
+    unsigned int generation = 0;
+
+    pthread_mutex_lock(&par->mutex);
+
+    for (;;) {
+        while (!par->stop && par->generation == generation)
+            pthread_cond_wait(&par->start, &par->mutex);
+
+        if (par->stop)
+            break;
+
+        generation = par->generation;
+
+        pthread_mutex_unlock(&par->mutex);
+        efsm__worker_run(self);
+        pthread_mutex_lock(&par->mutex);
+
+        if (--par->n_running == 0)
+            pthread_cond_signal(&par->done);
+    }
+
+    pthread_mutex_unlock(&par->mutex);
+
+    return NULL;
+}
+
+/** Joins the worker pool threads and frees the pool */
+static void efsm__par_stop(efsm__t * efsm)
+{
+    efsm__par_t *par = efsm->par;
+    int i;
+
+    pthread_mutex_lock(&par->mutex);
+    par->stop = 1;
+    pthread_cond_broadcast(&par->start);
+    pthread_mutex_unlock(&par->mutex);
+
+    for (i = 1; i < par->n_threads; i++) {
+        if (par->workers[i].thread)
+            pthread_join(par->workers[i].thread, NULL);
+    }
+
+    for (i = 0; i < par->n_threads; i++) {
+        free(par->workers[i].deferred);
+        free(par->workers[i].payload);
+        efsm__stats_destroy(&par->workers[i].stats);
+    }
+
+    pthread_mutex_destroy(&par->lock);
+    pthread_mutex_destroy(&par->mutex);
+    pthread_cond_destroy(&par->start);
+    pthread_cond_destroy(&par->done);
+
+    free(par->workers);
+    free(par->fsas);
+    free(par->doomed);
+    free(par);
+
+    efsm->par = NULL;
+}
+
+/** Starts a pool of n_threads - 1 threads to go with the calling thread
+ *
+ * \return 0 for success, -1 on failure
+ */
+static int efsm__par_start(efsm__t * efsm, int n_threads)
+{
+    int i;
+
+    efsm__par_t *par = calloc(sizeof(*par), 1);
+    if (!par)
+        return -1;
+
+    par->workers = calloc(sizeof(*par->workers), n_threads);
+    if (!par->workers) {
+        free(par);
+        return -1;
+    }
+
+    if (efsm->traces && efsm__trace_reserve(efsm, 1 + n_threads) < 0) {
+        free(par->workers);
+        free(par);
+        return -1;
+    }
+
+    pthread_mutex_init(&par->lock, NULL);
+    pthread_mutex_init(&par->mutex, NULL);
+    pthread_cond_init(&par->start, NULL);
+    pthread_cond_init(&par->done, NULL);
+    par->n_threads = n_threads;
+
+    efsm->par = par;
+
+    for (i = 0; i < n_threads; i++) {
+        par->workers[i].efsm = efsm;
+        par->workers[i].index = i;
+
+        if (efsm__stats_init(&par->workers[i].stats, efsm->def->n_transitions,
+                             efsm->stats_latency) < 0) {
+            efsm__par_stop(efsm);
+            return -1;
+        }
+
+        if (i && pthread_create(&par->workers[i].thread, NULL,
+                                efsm__worker_main, par->workers + i)) {
+            par->workers[i].thread = 0;
+            efsm__par_stop(efsm);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/** Queues a fsa for destruction at the end of a parallel pass, once.  If
+ *  the list can't grow it's only marked, and found among every fsa then */
+static void efsm__par_doom(efsm__par_t * par, efsm__fsa_t * fsa)
+{
+    if (fsa->doomed)
+        return;
+
+    fsa->doomed = 1;
+
+    if (par->n_doomed == par->doomed_size) {
+        size_t size = par->doomed_size ? par->doomed_size * 2 : 64;
+        efsm__fsa_t **doomed = realloc(par->doomed, sizeof(*doomed) * size);
+        if (!doomed) {
+            par->doom_scan = 1;
+            return;
+        }
+
+        par->doomed = doomed;
+        par->doomed_size = size;
+    }
+
+    par->doomed[par->n_doomed++] = fsa;
+}
+
+/** Applies everything the workers deferred once a parallel pass is over
+ *
+ * \return -1 if any fsa failed, 0 otherwise
+ */
+static int efsm__par_finish(efsm__t * efsm, size_t n_fsas)
+{
+    efsm__par_t *par = efsm->par;
+    efsm__pool_free_t *f, *next;
+    efsm__fsa_t *fsa, *tmp;
+    size_t i, j;
+    int failed = 0, lost = 0;
+
+    for (i = 0; i < (size_t)par->n_threads; i++) {
+        for (f = par->workers[i].consumed; f; f = next) {
+            next = f->next;
+            efsm__pool_free(&efsm->msg_pool, f);
+        }
+        par->workers[i].consumed = NULL;
+
+        efsm->n_pending -= par->workers[i].n_drained;
+        par->workers[i].n_drained = 0;
+
+        lost |= par->workers[i].lost_destroys;
+        par->workers[i].lost_destroys = 0;
+    }
+
+    if (lost)
+        DL_FOREACH2(efsm->fsas, fsa, all_next) {
+            if (atomic_load_explicit(&fsa->destroy_asked,
+                                     memory_order_relaxed))
+                efsm__par_doom(par, fsa);
+        }
+
+    for (i = 0; i < n_fsas; i++) {
+        fsa = par->fsas[i];
+
+        if (fsa->par_result == 1)
+            efsm__par_doom(par, fsa);
+        else if (fsa->par_result < 0 && !efsm->on_error)
+            failed = 1;
+    }
+
+    for (i = 0; i < (size_t)par->n_threads; i++) {
+        efsm__worker_t *w = par->workers + i;
+
+        for (j = 0; j < w->n_deferred; j++) {
+            efsm__deferred_t *d = w->deferred + j;
+
+            if (d->destroy) {
+                efsm__par_doom(par, d->fsa);
+                continue;
+            }
+
+            void *data = d->len <= 0 ? d->data : w->payload + d->offset;
+
+            int r = d->fsa->doomed ? 0 :
+                efsm__fsa_send(d->fsa, d->prio, d->type, data, d->len);
+
+            if (r == EFSM__FULL) {
+                if (d->fsa->drop_cb)
+                    d->fsa->drop_cb(d->fsa->data, d->type, data);
+            } else if (r < 0) {
+                // Out of pooled messages, so retry with the async backlog
+                efsm__async_t *msg =
+                    malloc(sizeof(*msg) + (d->len > 0 ? d->len : 0));
+                if (!msg) {
+                    if (d->fsa->drop_cb)
+                        d->fsa->drop_cb(d->fsa->data, d->type, data);
+                    continue;
+                }
+                msg->fsa = d->fsa;
+                msg->prio = d->prio;
+                msg->type = d->type;
+                msg->data = d->len < 0 ? data :
+                    memcpy(msg->payload, data, d->len);
+                msg->len = d->len;
+                msg->next = NULL;
+                LL_APPEND(efsm->backlog, msg);
+            }
+        }
+
+        w->n_deferred = 0;
+        w->payload_len = 0;
+    }
+
+    // After the deferred sends, so ids they're for aren't parked under them
+    for (i = 0; i < n_fsas; i++) {
+        fsa = par->fsas[i];
+
+        if (fsa->doomed)
+            continue;
+        if (fsa->par_result == 0)
+            efsm__fsa_requeue(fsa);
+        else if (fsa->par_result < 0 && efsm->on_error)
+            efsm__fsa_fail(fsa);
+    }
+
+    for (i = 0; i < par->n_doomed; i++)
+        efsm__fsa_destroy(par->doomed[i]);
+    par->n_doomed = 0;
+
+    if (par->doom_scan) {
+        par->doom_scan = 0;
+        DL_FOREACH_SAFE2(efsm->fsas, fsa, tmp, all_next) {
+            if (fsa->doomed)
+                efsm__fsa_destroy(fsa);
+        }
+    }
+
+    return failed ? -1 : 0;
+}
+
+static int efsm__run_parallel(efsm__t * efsm, int n_threads)
+{
+    efsm__fsa_t *ele;
+    efsm__par_t *par;
+    size_t n_fsas = 0;
+    int i;
+
+    if (n_threads <= 1)
+        return efsm__run(efsm);
+
+    if (efsm->par && efsm->par->n_threads != n_threads)
+        efsm__par_stop(efsm);
+    if (!efsm->par && efsm__par_start(efsm, n_threads) < 0)
+        return -1;
+    par = efsm->par;
+
+    efsm__ids_unhand(efsm);
+    efsm__inbox_splice(efsm);
+    efsm__timers_expire(efsm);
+
+    efsm->pass++;
+
+    // Shard the run queue by id with a counting sort
+    DL_FOREACH(efsm->runq, ele) {
+        n_fsas++;
+    }
+
+    if (n_fsas > par->fsas_size) {
+        free(par->fsas);
+        par->fsas = malloc(sizeof(*par->fsas) * n_fsas);
+        if (!par->fsas) {
+            par->fsas_size = 0;
+            return -1;
+        }
+        par->fsas_size = n_fsas;
+    }
+
+    for (i = 0; i < n_threads; i++) {
+        par->workers[i].n_fsas = 0;
+        atomic_store_explicit(&par->workers[i].next, 0,
+                              memory_order_relaxed);
+    }
+    DL_FOREACH(efsm->runq, ele) {
+        par->workers[ele->id % n_threads].n_fsas++;
+    }
+    efsm__fsa_t **shard = par->fsas;
+    for (i = 0; i < n_threads; i++) {
+        par->workers[i].fsas = shard;
+        shard += par->workers[i].n_fsas;
+        par->workers[i].n_fsas = 0;
+    }
+    DL_FOREACH(efsm->runq, ele) {
+        efsm__worker_t *w = par->workers + ele->id % n_threads;
+        w->fsas[w->n_fsas++] = ele;
+        ele->par_result = EFSM__PAR_SKIPPED;
+    }
+
+    atomic_store_explicit(&par->failed, 0, memory_order_relaxed);
+
+    unsigned long long before = 0, after = 0;
+    for (i = 0; i < n_threads; i++)
+        before += par->workers[i].stats.msgs;
+
+    pthread_mutex_lock(&par->mutex);
+    par->n_running = n_threads - 1;
+    par->generation++;
+    pthread_cond_broadcast(&par->start);
+    pthread_mutex_unlock(&par->mutex);
+
+    efsm__worker_run(par->workers);
+
+    pthread_mutex_lock(&par->mutex);
+    while (par->n_running)
+        pthread_cond_wait(&par->done, &par->mutex);
+    pthread_mutex_unlock(&par->mutex);
+
+    for (i = 0; i < n_threads; i++)
+        after += par->workers[i].stats.msgs;
+    efsm__stats_run(efsm, after - before);
+
+    if (efsm__par_finish(efsm, n_fsas) < 0)
+        return -1;
+
+    return efsm->runq || efsm->backlog ||
+        atomic_load_explicit(&efsm->inbox, memory_order_relaxed) ? 1 : 0;
+}
+
+int efsm_run_parallel(efsm_t * _efsm, int n_threads)
+{
+    efsm__t *efsm = _efsm->data;
+
+    efsm->in_run++;
+    int r = efsm__run_parallel(efsm, n_threads);
+    efsm__run_done(efsm);
+
+    return r;
+}
+
+/** Sets a fsa's mailbox limit from its opts, or the efsm's if they don't
+ *  have one */
+static void efsm__fsa_limit(efsm__fsa_t * fsa, const efsm_fsa_opts_t * opts)
+{
+    if (!opts || !opts->mailbox_limit)
+        opts = &fsa->efsm->limits;
+
+    fsa->limit = opts->mailbox_limit > UINT_MAX ? UINT_MAX :
+        opts->mailbox_limit;
+    fsa->overflow = opts->overflow;
+    fsa->overflow_msg = opts->overflow_msg;
+}
+
+/* The wrapper shim (with an opaque handle to the internal data structure) is
+ * embedded in the internal object, which comes out of the fsa pool along with
+ * the fsa's context, so this is a freelist pop
+ */
+efsm_fsa_t *efsm_fsa_new(efsm_t * _efsm, int state, efsm_fsa_opts_t * opts)
+{
+    efsm__t *efsm = _efsm->data;
+
+    efsm__worker_t *self = efsm__self;
+    if (self && self->efsm == efsm)
+        pthread_mutex_lock(&efsm->par->lock);
+
+    efsm__fsa_t *fsa = efsm__pool_alloc(&efsm->fsa_pool);
+
+    if (self && self->efsm == efsm)
+        pthread_mutex_unlock(&efsm->par->lock);
+
+    if (!fsa)
+        return NULL;
+
+    efsm_fsa_t *_fsa = &fsa->wrapper;
+    _fsa->data = fsa;
+
+    if (efsm->fsa_ctx_size)
+        fsa->data = (char *)fsa + efsm->ctx_offset;
+
+    if (opts) {
+        if (opts->hint)
+            fsa->data = opts->hint;
+        if (opts->destroy_cb)
+            fsa->dcb = opts->destroy_cb;
+        fsa->drop_cb = opts->drop_cb;
+        fsa->error_cb = opts->error_cb;
+        if (opts->mailbox_capacity) {
+            unsigned int capacity = 1;
+            while (capacity < opts->mailbox_capacity)
+                capacity <<= 1;
+
+            fsa->mbox.ring = malloc(sizeof(*fsa->mbox.ring) * capacity);
+            if (!fsa->mbox.ring) {
+                if (self && self->efsm == efsm)
+                    pthread_mutex_lock(&efsm->par->lock);
+                efsm__pool_free(&efsm->fsa_pool, fsa);
+                if (self && self->efsm == efsm)
+                    pthread_mutex_unlock(&efsm->par->lock);
+                return NULL;
+            }
+            fsa->mbox.mask = capacity - 1;
+        }
+    }
+
+    fsa->state = state;
+    fsa->efsm = efsm;
+    fsa->status = EFSM_FSA_IDLE;
+    efsm__fsa_limit(fsa, opts);
+
+    if (self && self->efsm == efsm)
+        pthread_mutex_lock(&efsm->par->lock);
+
+    fsa->id = efsm->next_id++;
+    DL_APPEND2(efsm->fsas, fsa, all_prev, all_next);
+
+    if (self && self->efsm == efsm)
+        pthread_mutex_unlock(&efsm->par->lock);
+
+    return _fsa;
+}
+
+/** A free id's state */
+#define EFSM__ID_FREE 0xffffffffu
+
+/** The first number of ids, and of live table slots */
+#define EFSM__IDS_INITIAL 64
+
+static inline unsigned int efsm__id_state(efsm__ids_t * ids, efsm_id_t id)
+{
+    if (ids->state_size == 2) {
+        uint16_t state = ((uint16_t *) ids->states)[id];
+        return state == 0xffff ? EFSM__ID_FREE : state;
+    }
+
+    return ((uint32_t *) ids->states)[id];
+}
+
+static inline void efsm__id_set_state(efsm__ids_t * ids, efsm_id_t id,
+                                      unsigned int state)
+{
+    if (ids->state_size == 2)
+        ((uint16_t *) ids->states)[id] = (uint16_t) state;
+    else
+        ((uint32_t *) ids->states)[id] = state;
+}
+
+/** \return whether id has been handed out and not destroyed */
+static inline int efsm__id_valid(efsm__ids_t * ids, efsm_id_t id)
+{
+    return id < ids->n && efsm__id_state(ids, id) != EFSM__ID_FREE;
+}
+
+/** Finds id's slot in the live table, or the empty one it would go in.
+ *  Multiplying by an odd constant spreads runs of ids without collisions */
+static inline size_t efsm__id_probe(efsm__ids_t * ids, efsm_id_t id)
+{
+    size_t i = (id * 2654435761u) & ids->live_mask;
+
+    while (ids->live[i].fsa && ids->live[i].id != id)
+        i = (i + 1) & ids->live_mask;
+
+    return i;
+}
+
+/** \return the fsa id is materialized into, or NULL if it's parked */
+static inline efsm__fsa_t *efsm__id_find(efsm__ids_t * ids, efsm_id_t id)
+{
+    return ids->live ? ids->live[efsm__id_probe(ids, id)].fsa : NULL;
+}
+
+/** Makes sure there's room in the live table for one more, keeping it at
+ *  most half full
+ *
+ * \return 0 for success, -1 if out of memory
+ */
+static int efsm__id_live_reserve(efsm__ids_t * ids)
+{
+    size_t size = ids->live ? ids->live_mask + 1 : 0;
+    size_t i;
+
+    if ((ids->n_live + 1) * 2 <= size)
+        return 0;
+
+    efsm__id_live_t *old = ids->live;
+    size_t n = size ? size * 2 : EFSM__IDS_INITIAL;
+
+    ids->live = calloc(n, sizeof(*ids->live));
+    if (!ids->live) {
+        ids->live = old;
+        return -1;
+    }
+    ids->live_mask = n - 1;
+
+    for (i = 0; i < size; i++)
+        if (old[i].fsa)
+            ids->live[efsm__id_probe(ids, old[i].id)] = old[i];
+    free(old);
+
+    return 0;
+}
+
+/** Takes id out of the live table, shifting back whatever probed past it */
+static void efsm__id_unlive(efsm__ids_t * ids, efsm_id_t id)
+{
+    size_t mask = ids->live_mask;
+    size_t i = efsm__id_probe(ids, id);
+    size_t j;
+
+    ids->live[i].fsa = NULL;
+    ids->n_live--;
+
+    for (j = (i + 1) & mask; ids->live[j].fsa; j = (j + 1) & mask) {
+        size_t home = (ids->live[j].id * 2654435761u) & mask;
+
+        // It can fill the hole unless its home is between the hole and it
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            ids->live[i] = ids->live[j];
+            ids->live[j].fsa = NULL;
+            i = j;
+        }
+    }
+}
+
+/** Frees an id for reuse.  It's simply never reused if the free list
+ *  can't grow */
+static void efsm__id_release(efsm__ids_t * ids, efsm_id_t id)
+{
+    efsm__id_set_state(ids, id, EFSM__ID_FREE);
+
+    if (ids->n_free == ids->free_size) {
+        size_t n = ids->free_size ? ids->free_size * 2 : EFSM__IDS_INITIAL;
+        efsm_id_t *grown = realloc(ids->free, sizeof(*grown) * n);
+        if (!grown)
+            return;
+        ids->free = grown;
+        ids->free_size = n;
+    }
+
+    ids->free[ids->n_free++] = id;
+}
+
+/** Materializes an id into a pooled fsa, if it isn't already
+ *
+ * Workers have to hold the parallel lock.
+ *
+ * \return the fsa, or NULL if id isn't valid or out of memory
+ */
+static efsm__fsa_t *efsm__id_materialize(efsm__t * efsm, efsm_id_t id)
+{
+    efsm__ids_t *ids = &efsm->ids;
+    efsm__fsa_t *fsa;
+
+    if (!efsm__id_valid(ids, id))
+        return NULL;
+    if ((fsa = efsm__id_find(ids, id)))
+        return fsa;
+
+    if (efsm__id_live_reserve(ids) < 0 ||
+        !(fsa = efsm__pool_alloc(&efsm->fsa_pool)))
+        return NULL;
+
+    fsa->wrapper.data = fsa;
+    fsa->efsm = efsm;
+    fsa->state = efsm__id_state(ids, id);
+    fsa->status = EFSM_FSA_IDLE;
+    fsa->data = ids->data ? ids->data[id] : NULL;
+    fsa->dcb = ids->opts.destroy_cb;
+    fsa->drop_cb = ids->opts.drop_cb;
+    fsa->error_cb = ids->opts.error_cb;
+    efsm__fsa_limit(fsa, &ids->opts);
+    fsa->id = efsm->next_id++;
+    fsa->slot = id + 1;
+
+    size_t i = efsm__id_probe(ids, id);
+    ids->live[i].id = id;
+    ids->live[i].fsa = fsa;
+    ids->n_live++;
+
+    return fsa;
+}
+
+/** Parks an idle id back into the tables, unless it's got timers or
+ *  watches pointing at it or a parallel pass is about to destroy it */
+static void efsm__id_park(efsm__fsa_t * fsa)
+{
+    efsm__t *efsm = fsa->efsm;
+    efsm__ids_t *ids = &efsm->ids;
+    efsm_id_t id = fsa->slot - 1;
+
+    if (fsa->timers || fsa->watches || fsa->doomed)
+        return;
+
+    efsm__id_set_state(ids, id, fsa->state);
+    efsm__id_unlive(ids, id);
+
+    free(fsa->mbox.ring);
+    free(fsa->mbox.payload);
+    free(fsa->mbox.retired);
+    efsm__pool_free(&efsm->fsa_pool, fsa);
+}
+
+/** Doubles the id tables
+ *
+ * \return 0 for success, -1 if out of memory or ids
+ */
+static int efsm__ids_grow(efsm__ids_t * ids, int with_data)
+{
+    size_t n = ids->capacity ? ids->capacity * 2 : EFSM__IDS_INITIAL;
+
+    if (n > EFSM_ID_NONE)
+        n = EFSM_ID_NONE;
+    if (n <= ids->n)
+        return -1;
+
+    void *states = realloc(ids->states, ids->state_size * n);
+    if (!states)
+        return -1;
+    ids->states = states;
+
+    if (with_data) {
+        void **data = realloc(ids->data, sizeof(*data) * n);
+        if (!data)
+            return -1;
+        ids->data = data;
+    }
+
+    ids->capacity = n;
+
+    return 0;
+}
+
+efsm_id_t efsm_id_new(efsm_t * _efsm, int state, void *data)
+{
+    efsm__t *efsm = _efsm->data;
+    efsm__ids_t *ids = &efsm->ids;
+    efsm__worker_t *self = efsm__self;
+    efsm_id_t id = EFSM_ID_NONE;
+    unsigned int max = ids->state_size == 2 ? 0xffff : EFSM__ID_FREE;
+
+    if (state < 0 || (unsigned int)state >= max)
+        return EFSM_ID_NONE;
+
+    if (self && self->efsm == efsm)
+        pthread_mutex_lock(&efsm->par->lock);
+
+    if (ids->n_free)
+        id = ids->free[--ids->n_free];
+    else if (ids->n < ids->capacity ||
+             efsm__ids_grow(ids, efsm->id_data) == 0)
+        id = ids->n++;
+
+    if (id != EFSM_ID_NONE) {
+        efsm__id_set_state(ids, id, state);
+        if (ids->data)
+            ids->data[id] = data;
+    }
+
+    if (self && self->efsm == efsm)
+        pthread_mutex_unlock(&efsm->par->lock);
+
+    return id;
+}
+
+/** Remembers a handle efsm_id_fsa materialized, for efsm__ids_unhand
+ *
+ * \return 0 for success, -1 if out of memory
+ */
+static int efsm__id_hand(efsm__ids_t * ids, efsm_id_t id)
+{
+    if (ids->n_handed == ids->handed_size) {
+        size_t n = ids->handed_size ? ids->handed_size * 2 :
+            EFSM__IDS_INITIAL;
+        efsm_id_t *grown = realloc(ids->handed, sizeof(*grown) * n);
+        if (!grown)
+            return -1;
+        ids->handed = grown;
+        ids->handed_size = n;
+    }
+
+    ids->handed[ids->n_handed++] = id;
+
+    return 0;
+}
+
+/** Parks the handles from efsm_id_fsa that nothing was sent to, once the
+ *  outermost efsm_run starts */
+static void efsm__ids_unhand(efsm__t * efsm)
+{
+    efsm__ids_t *ids = &efsm->ids;
+    efsm__fsa_t *fsa;
+
+    if (efsm->in_run > 1)
+        return;
+
+    // Ones that were since parked or destroyed simply aren't found
+    while (ids->n_handed) {
+        fsa = efsm__id_find(ids, ids->handed[--ids->n_handed]);
+        if (fsa && fsa->status == EFSM_FSA_IDLE && !fsa->mbox.count)
+            efsm__id_park(fsa);
+    }
+}
+
+/** Materializes an id, taking the parallel lock on a worker
+ *
+ * \param hand whether it's a handle for efsm_id_fsa
+ *
+ * \return the fsa, or NULL if id isn't valid or out of memory
+ */
+static efsm__fsa_t *efsm__id_get(efsm__t * efsm, efsm_id_t id, int hand)
+{
+    efsm__ids_t *ids = &efsm->ids;
+    efsm__worker_t *self = efsm__self;
+
+    if (self && self->efsm == efsm)
+        pthread_mutex_lock(&efsm->par->lock);
+
+    int parked = hand && efsm__id_valid(ids, id) && !efsm__id_find(ids, id);
+    efsm__fsa_t *fsa = efsm__id_materialize(efsm, id);
+
+    if (fsa && parked && efsm__id_hand(ids, id) < 0) {
+        efsm__id_park(fsa);
+        fsa = NULL;
+    }
+
+    if (self && self->efsm == efsm)
+        pthread_mutex_unlock(&efsm->par->lock);
+
+    return fsa;
+}
+
+efsm_fsa_t *efsm_id_fsa(efsm_t * _efsm, efsm_id_t id)
+{
+    efsm__fsa_t *fsa = efsm__id_get(_efsm->data, id, 1);
+
+    return fsa ? &fsa->wrapper : NULL;
+}
+
+int efsm_id_send(efsm_t * _efsm, efsm_id_t id, int type, void *data)
+{
+    efsm__fsa_t *fsa = efsm__id_get(_efsm->data, id, 0);
+
+    if (!fsa)
+        return -1;
+
+    if (efsm_fsa_send(&fsa->wrapper, type, data) == 0)
+        return 0;
+
+    // Don't leave it materialized for a message that never arrived
+    efsm__worker_t *self = efsm__self;
+    if (!(self && self->efsm == fsa->efsm) && fsa->status == EFSM_FSA_IDLE &&
+        !fsa->mbox.count)
+        efsm__id_park(fsa);
+
+    return -1;
+}
+
+int efsm_id_state(efsm_t * _efsm, efsm_id_t id)
+{
+    efsm__t *efsm = _efsm->data;
+    efsm__ids_t *ids = &efsm->ids;
+    efsm__worker_t *self = efsm__self;
+    int state = -1;
+
+    if (self && self->efsm == efsm)
+        pthread_mutex_lock(&efsm->par->lock);
+
+    if (efsm__id_valid(ids, id)) {
+        efsm__fsa_t *fsa = efsm__id_find(ids, id);
+        state = fsa ? fsa->state : (int)efsm__id_state(ids, id);
+    }
+
+    if (self && self->efsm == efsm)
+        pthread_mutex_unlock(&efsm->par->lock);
+
+    return state;
+}
+
+void efsm_id_destroy(efsm_t * _efsm, efsm_id_t id)
+{
+    efsm__t *efsm = _efsm->data;
+    efsm__ids_t *ids = &efsm->ids;
+    efsm__worker_t *self = efsm__self;
+    efsm__fsa_t *fsa = NULL;
+
+    if (self && self->efsm == efsm)
+        pthread_mutex_lock(&efsm->par->lock);
+
+    if (efsm__id_valid(ids, id) && !(fsa = efsm__id_find(ids, id))) {
+        if (ids->opts.destroy_cb)
+            ids->opts.destroy_cb(ids->data ? ids->data[id] : NULL);
+        efsm__id_release(ids, id);
+    }
+
+    if (self && self->efsm == efsm)
+        pthread_mutex_unlock(&efsm->par->lock);
+
+    if (fsa)
+        efsm_fsa_destroy(&fsa->wrapper);
+}
+
+efsm_id_t efsm_fsa_id(efsm_fsa_t * _fsa)
+{
+    efsm__fsa_t *fsa = _fsa->data;
+
+    return fsa->slot ? fsa->slot - 1 : EFSM_ID_NONE;
+}
+
+/** Destroys every id, materialized or not, and frees the tables */
+static void efsm__ids_destroy(efsm__t * efsm)
+{
+    efsm__ids_t *ids = &efsm->ids;
+    size_t i;
+
+    // Destroying shifts later entries back into the slot, so recheck it
+    for (i = 0; ids->live && i <= ids->live_mask;) {
+        if (ids->live[i].fsa)
+            efsm__fsa_destroy(ids->live[i].fsa);
+        else
+            i++;
+    }
+
+    for (i = 0; ids->opts.destroy_cb && i < ids->n; i++)
+        if (efsm__id_state(ids, i) != EFSM__ID_FREE)
+            ids->opts.destroy_cb(ids->data ? ids->data[i] : NULL);
+
+    free(ids->states);
+    free(ids->data);
+    free(ids->free);
+    free(ids->live);
+    free(ids->handed);
+}
+
+/** The state a rule's transitions are packed under */
+#define EFSM__RULE_STATE(def, r) \
+    ((r)->current_state == EFSM_ANY ? (def)->root : (r)->current_state)
+
+/** compiles the internal state/transition data structure from the external table API
+ *
+ * Assumes that rules ends with a transition with a starting state of -1.
+ *
+ * The transitions are packed by state in CSR form with a counting sort, so
+ * this is linear in the number of rules.  Within a state, transitions keep
+ * the order they had in rules.  EFSM_ANY state rules go under an extra
+ * root state after the rest.
+ *
+ * \param rules All of the states and their transitions in the efsm
+ * \param min_states states to make room for even if no rule mentions them
+ *
+ * \return 0 for success, -1 if out of memory, leaving def to efsm__def_free
+ */
+int efsm__states_from_rules(efsm__def_t * def, efsm_transition_rules_t * rules,
+                            int min_states)
+{
+    int max_state = min_states > 0 ? min_states - 1 : 0;
+    int n_rules = 0;
+    int any_state = 0;
+    int i;
+
+    efsm_transition_rules_t *r;
+
+    // Find the max state
+    for (r = rules; r->current_state != -1; r++) {
+        if (r->current_state == EFSM_ANY)
+            any_state = 1;
+        else if (r->current_state > max_state)
+            max_state = r->current_state;
+        if (r->next_state > max_state)
+            max_state = r->next_state;
+        n_rules++;
+    }
+    def->root = any_state ? max_state + 1 : -1;
+    def->n_states = max_state + 1 + any_state;
+    def->n_transitions = n_rules;
+
+    def->offsets = calloc(sizeof(*def->offsets), def->n_states + 1);
+    def->transitions = malloc(sizeof(*def->transitions) *
+                               (n_rules ? n_rules : 1));
+    def->codes = malloc(sizeof(*def->codes) * (n_rules ? n_rules : 1));
+    if (def->engine)
+        def->rule_map = malloc(sizeof(*def->rule_map) *
+                                (n_rules ? n_rules : 1));
+    if (!def->offsets || !def->transitions || !def->codes ||
+        (def->engine && !def->rule_map))
+        return -1;
+
+    // Count each state's transitions, then turn the counts into offsets
+    for (r = rules; r->current_state != -1; r++)
+        def->offsets[EFSM__RULE_STATE(def, r) + 1]++;
+    for (i = 0; i < def->n_states; i++)
+        def->offsets[i + 1] += def->offsets[i];
+
+    // Scatter using a cursor per state, which starts at its offset
+    int *cursor = malloc(sizeof(*cursor) * def->n_states);
+    if (!cursor)
+        return -1;
+    memcpy(cursor, def->offsets, sizeof(*cursor) * def->n_states);
+
+    for (r = rules; r->current_state != -1; r++) {
+        i = cursor[EFSM__RULE_STATE(def, r)]++;
+        def->transitions[i].msg_type = r->msg_type;
+        def->transitions[i].next_state = r->next_state;
+        def->codes[i].code = r->code;
+        def->codes[i].data = r->data;
+        def->codes[i].batch = NULL;
+        if (def->rule_map)
+            def->rule_map[r - rules] = i;
+    }
+
+    free(cursor);
+
+    return 0;
+}
+
+/** Resolves EFSM_ANY message rules and state parents into the fallbacks
+ *  efsm__resolve walks, skipping ancestors without rules of their own
+ *
+ * \return 0 for success, -1 if out of memory or the parents have a cycle
+ */
+static int efsm__inherit_compile(efsm__def_t * def, const int *parents,
+                                 size_t n_parents)
+{
+    int i, j, p, steps;
+    int wild = def->root >= 0 || n_parents;
+
+    for (i = 0; i < def->n_transitions && !wild; i++)
+        if (def->transitions[i].msg_type == EFSM_ANY)
+            wild = 1;
+    if (!wild)
+        return 0;
+
+#define EFSM__PARENT(p) ((size_t)(p) < n_parents ? parents[p] : -1)
+
+    for (i = 0; i < (int)n_parents; i++) {
+        for (p = parents[i], steps = 0; p >= 0; p = EFSM__PARENT(p))
+            if (++steps > def->n_states)
+                return -1;
+    }
+
+    def->any_msg = malloc(sizeof(*def->any_msg) * def->n_states);
+    def->up = malloc(sizeof(*def->up) * def->n_states);
+    if (!def->any_msg || !def->up)
+        return -1;
+
+    for (i = 0; i < def->n_states; i++) {
+        // Walk backwards so duplicate rules resolve to the first
+        def->any_msg[i] = -1;
+        for (j = def->offsets[i + 1] - 1; j >= def->offsets[i]; j--)
+            if (def->transitions[j].msg_type == EFSM_ANY)
+                def->any_msg[i] = j;
+
+        if (i == def->root) {
+            def->up[i] = -1;
+            continue;
+        }
+
+        p = EFSM__PARENT(i);
+        while (p >= 0 && def->offsets[p] == def->offsets[p + 1])
+            p = EFSM__PARENT(p);
+        def->up[i] = p >= 0 ? p : def->root;
+    }
+
+#undef EFSM__PARENT
+
+    return 0;
+}
+
+/** Tries to place every transition in a collision free hash table
+ *
+ * \return 0 if the seed and size give a perfect hash, -1 otherwise
+ */
+static int efsm__hash_try(efsm__def_t * def, efsm__hash_slot_t * slots,
+                          int bits, unsigned int seed)
+{
+    int i, j;
+    size_t n = (size_t)1 << bits;
+
+    for (i = 0; i < (int)n; i++)
+        slots[i].state = -1;
+
+    for (i = 0; i < def->n_states; i++) {
+        for (j = def->offsets[i]; j < def->offsets[i + 1]; j++) {
+            int msg_type = def->transitions[j].msg_type;
+            if (msg_type == EFSM_ANY)
+                continue;
+
+            efsm__hash_slot_t *slot =
+                slots + efsm__hash(seed, bits, i, msg_type);
+
+            if (slot->state != -1) {
+                // Duplicate rules resolve to the first, like a linear scan
+                if (slot->state == i && slot->msg_type == msg_type)
+                    continue;
+                return -1;
+            }
+
+            slot->state = i;
+            slot->msg_type = msg_type;
+            slot->transition = j;
+        }
+    }
+
+    return 0;
+}
+
+/** Number of seeds tried at each hash table size before doubling it */
+#define EFSM__HASH_SEEDS 64
+
+/** Largest hash table we'll search for a perfect hash in */
+#define EFSM__HASH_MAX_BITS 24
+
+/** Dense tables with more than this many empty cells per transition lose to
+ *  the hash in auto mode */
+#define EFSM__DENSE_SPARSITY 8
+
+/** compiles the (state, msg) -> transition lookup for the efsm's states
+ *
+ * In auto mode a dense table is used when it's at most EFSM__DENSE_SPARSITY
+ * times bigger than the number of transitions, otherwise we search for a
+ * perfect hash.  Negative message types can only be hashed and if no perfect
+ * hash turns up, or there's no memory to search for one, we fall back to
+ * scanning.
+ *
+ * \return 0 for success, -1 if out of memory for a dense table
+ */
+int efsm__dispatch_compile(efsm__def_t * def, efsm_dispatch_t dispatch)
+{
+    int i, j;
+    size_t c;
+    int n_transitions = def->n_transitions;
+    int max_msg = -1;
+    int negative = 0;
+
+    for (i = 0; i < n_transitions; i++) {
+        int msg_type = def->transitions[i].msg_type;
+        if (msg_type == EFSM_ANY)
+            continue;
+        else if (msg_type < 0)
+            negative = 1;
+        else if (msg_type > max_msg)
+            max_msg = msg_type;
+    }
+
+    size_t cells = (size_t)def->n_states * (size_t)(max_msg + 1);
+
+    if (dispatch == EFSM_DISPATCH_AUTO)
+        dispatch = cells <= (size_t)n_transitions * EFSM__DENSE_SPARSITY ?
+            EFSM_DISPATCH_DENSE : EFSM_DISPATCH_HASH;
+
+    if (dispatch == EFSM_DISPATCH_DENSE && negative)
+        dispatch = EFSM_DISPATCH_HASH;
+
+    if (dispatch == EFSM_DISPATCH_DENSE) {
+        def->n_msgs = max_msg + 1;
+        if (cells > SIZE_MAX / sizeof(*def->dense) ||
+            !(def->dense = malloc(sizeof(*def->dense) * (cells ? cells : 1))))
+            return -1;
+        for (c = 0; c < cells; c++)
+            def->dense[c] = -1;
+
+        // Walk backwards so duplicate rules resolve to the first
+        for (i = 0; i < def->n_states; i++) {
+            for (j = def->offsets[i + 1] - 1; j >= def->offsets[i]; j--)
+                if (def->transitions[j].msg_type != EFSM_ANY)
+                    def->dense[(size_t)i * def->n_msgs +
+                                def->transitions[j].msg_type] = j;
+        }
+    } else if (dispatch == EFSM_DISPATCH_HASH) {
+        int bits = 1;
+        while (((size_t)1 << bits) < (size_t)n_transitions * 2)
+            bits++;
+
+        for (; bits <= EFSM__HASH_MAX_BITS && !def->hash; bits++) {
+            efsm__hash_slot_t *slots =
+                malloc(sizeof(*slots) * ((size_t)1 << bits));
+            unsigned int seed;
+            if (!slots)
+                break;
+            for (seed = 1; seed <= EFSM__HASH_SEEDS; seed++) {
+                if (efsm__hash_try(def, slots, bits, seed) == 0) {
+                    def->hash = slots;
+                    def->hash_bits = bits;
+                    def->hash_seed = seed;
+                    break;
+                }
+            }
+            if (!def->hash)
+                free(slots);
+        }
+
+        if (!def->hash)
+            dispatch = EFSM_DISPATCH_LINEAR;
+    }
+
+    def->dispatch = dispatch;
+
+    return 0;
+}
+
+/** Hands each coalescing message type a bit in the fsa coalesced masks
+ *
+ * \return 0 for success, -1 if out of memory, a type is negative or there are
+ *         more than 64 of them
+ */
+static int efsm__coalesce_compile(efsm__t * efsm, const int *types, size_t n)
+{
+    size_t i;
+    int max = -1, bits = 0;
+
+    for (i = 0; i < n; i++) {
+        if (types[i] < 0)
+            return -1;
+        if (types[i] > max)
+            max = types[i];
+    }
+
+    efsm->coalesce = malloc(max + 1);
+    if (!efsm->coalesce)
+        return -1;
+    memset(efsm->coalesce, -1, max + 1);
+    efsm->n_coalesce = max + 1;
+
+    for (i = 0; i < n; i++) {
+        if (efsm->coalesce[types[i]] >= 0)
+            continue;
+
+        if (bits == 64) {
+            free(efsm->coalesce);
+            efsm->coalesce = NULL;
+            efsm->n_coalesce = 0;
+            return -1;
+        }
+        efsm->coalesce[types[i]] = bits++;
+    }
+
+    return 0;
+}
+
+/** Attaches batch callbacks to the transitions their rules match
+ *
+ * \return 0 for success, -1 if a batch rule matches no rule with a message
+ *         type of its own, or there's an engine to bypass them
+ */
+static int efsm__batch_compile(efsm__def_t * def,
+                               const efsm_batch_rule_t * rules, size_t n)
+{
+    size_t k;
+    int i;
+
+    if (def->engine)
+        return -1;
+
+    for (k = 0; k < n; k++) {
+        int state = rules[k].current_state == EFSM_ANY ? def->root :
+            rules[k].current_state;
+
+        if (state < 0 || state >= def->n_states || rules[k].msg_type < 0 ||
+            !rules[k].code)
+            return -1;
+
+        for (i = def->offsets[state]; i < def->offsets[state + 1]; i++)
+            if (def->transitions[i].msg_type == rules[k].msg_type)
+                break;
+        if (i == def->offsets[state + 1])
+            return -1;
+
+        if (!def->codes[i].batch)
+            def->n_batch++;
+        def->codes[i].batch = rules[k].code;
+    }
+
+    return 0;
+}
+
+/** frees a def once the last reference to it is gone */
+static void efsm__def_free(efsm__def_t * def)
+{
+    free(def->parents);
+    free(def->start_states);
+    free(def->msg_types);
+    free(def->offsets);
+    free(def->transitions);
+    free(def->codes);
+    free(def->rule_map);
+    free(def->any_msg);
+    free(def->up);
+    free(def->dense);
+    free(def->hash);
+    free(def);
+}
+
+static int efsm__int_cmp(const void *a, const void *b)
+{
+    int x = *(const int *)a, y = *(const int *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/** The message types efsm_verify checks, sorted without duplicates: the
+ *  def's msg_types, or every type a rule names
+ *
+ * \return how many, or -1 if out of memory
+ */
+static long efsm__verify_types(efsm__def_t * def, int **types)
+{
+    size_t n = def->n_msg_types ? def->n_msg_types : (size_t)def->n_transitions;
+    size_t i, w = 0;
+    int min = 0, max = -1;
+
+    *types = malloc(sizeof(**types) * (n ? n : 1));
+    if (!*types)
+        return -1;
+
+    for (i = 0; i < n; i++) {
+        int type = def->n_msg_types ? def->msg_types[i] :
+            def->transitions[i].msg_type;
+        if (type == EFSM_ANY)
+            continue;
+        (*types)[w++] = type;
+        if (type < min)
+            min = type;
+        if (type > max)
+            max = type;
+    }
+
+    // Types are usually a small enum, which a bitmap sorts faster
+    char *seen = min == 0 && (size_t)max < w * EFSM__DENSE_SPARSITY ?
+        calloc(1, (size_t)max + 1) : NULL;
+
+    if (seen) {
+        for (i = 0; i < w; i++)
+            seen[(*types)[i]] = 1;
+        for (i = n = 0; i <= (size_t)max; i++)
+            if (seen[i])
+                (*types)[n++] = (int)i;
+        free(seen);
+        return (long)n;
+    }
+
+    qsort(*types, w, sizeof(**types), &efsm__int_cmp);
+    for (i = n = 0; i < w; i++)
+        if (!n || (*types)[n - 1] != (*types)[i])
+            (*types)[n++] = (*types)[i];
+
+    return (long)n;
+}
+
+/** Checks a def's states against its start states and message types
+ *
+ * Every state reached from the start states resolves each type, and a rule
+ * it resolves to reaches its next state.  The root EFSM_ANY state rules are
+ * packed under isn't one fsa's are in, so it's left out.
+ *
+ * \return the number of findings, or -1 if out of memory
+ */
+static long efsm__verify(efsm__def_t * def, efsm_verify_report_t * report)
+{
+    int n_states = def->n_states - (def->root >= 0);
+    int *types = NULL, *stack = NULL;
+    char *reached = NULL, *handled = NULL;
+    long n_types = efsm__verify_types(def, &types);
+    long n = -1;
+    int i, s, top = 0;
+    size_t k;
+
+    memset(report, 0, sizeof(*report));
+    if (n_types < 0)
+        return -1;
+
+    reached = calloc(1, n_states + 1);
+    handled = calloc(1, n_types + 1);
+    stack = malloc(sizeof(*stack) * (n_states + 1));
+    report->unreachable = malloc(sizeof(int) * (n_states + 1));
+    report->no_exit = malloc(sizeof(int) * (n_states + 1));
+    report->dead_msgs = malloc(sizeof(int) * (n_types + 1));
+    if (!reached || !handled || !stack || !report->unreachable ||
+        !report->no_exit || !report->dead_msgs)
+        goto out;
+
+    for (k = 0; k < (def->n_start_states ? def->n_start_states : 1); k++) {
+        s = def->n_start_states ? def->start_states[k] : 0;
+        if (s >= 0 && s < n_states && !reached[s]) {
+            reached[s] = 1;
+            stack[top++] = s;
+        }
+    }
+
+    while (top) {
+        s = stack[--top];
+        for (i = 0; i < n_types; i++) {
+            int t = efsm__resolve(def, s, types[i]);
+            int next = t < 0 ? -1 : def->transitions[t].next_state;
+
+            if (next >= 0 && next < n_states && !reached[next]) {
+                reached[next] = 1;
+                stack[top++] = next;
+            }
+        }
+    }
+
+    for (s = 0; s < n_states; s++) {
+        int exits = 0;
+
+        if (!reached[s]) {
+            report->unreachable[report->n_unreachable++] = s;
+            continue;
+        }
+
+        for (i = 0; i < n_types; i++) {
+            int t = efsm__resolve(def, s, types[i]);
+            int next = t < 0 ? s : def->transitions[t].next_state;
+
+            if (t < 0)
+                report->n_missing++;
+            else
+                handled[i] = 1;
+            if (next != s && next != EFSM_SAME)
+                exits = 1;
+        }
+
+        if (!exits)
+            report->no_exit[report->n_no_exit++] = s;
+    }
+
+    for (i = 0; i < n_types; i++)
+        if (!handled[i])
+            report->dead_msgs[report->n_dead_msgs++] = types[i];
+
+    report->missing = malloc(sizeof(*report->missing) *
+                             (report->n_missing ? report->n_missing : 1));
+    if (!report->missing)
+        goto out;
+
+    for (s = 0, k = 0; s < n_states; s++)
+        for (i = 0; reached[s] && i < n_types; i++)
+            if (efsm__resolve(def, s, types[i]) < 0) {
+                report->missing[k].state = s;
+                report->missing[k++].msg_type = types[i];
+            }
+
+    n = (long)(report->n_unreachable + report->n_missing +
+               report->n_dead_msgs + report->n_no_exit);
+
+  out:
+    if (n < 0)
+        efsm_verify_release(report);
+    free(types);
+    free(stack);
+    free(reached);
+    free(handled);
+
+    return n;
+}
+
+long efsm_verify(efsm_t * _efsm, efsm_verify_report_t * report)
+{
+    efsm__t *efsm = _efsm->data;
+
+    return efsm__verify(efsm->def, report);
+}
+
+void efsm_verify_release(efsm_verify_report_t * report)
+{
+    free(report->unreachable);
+    free(report->missing);
+    free(report->dead_msgs);
+    free(report->no_exit);
+
+    memset(report, 0, sizeof(*report));
+}
+
+/** Whether a def has any of the findings its verify flags fail on
+ *
+ * \return 1 if it does or there isn't the memory to check, 0 if not
+ */
+static int efsm__verify_fails(efsm__def_t * def)
+{
+    efsm_verify_report_t report;
+    unsigned int flags = def->verify;
+
+    if (efsm__verify(def, &report) < 0)
+        return 1;
+
+    int fails = ((flags & EFSM_VERIFY_UNREACHABLE) && report.n_unreachable) ||
+        ((flags & EFSM_VERIFY_MISSING) && report.n_missing) ||
+        ((flags & EFSM_VERIFY_DEAD_MSGS) && report.n_dead_msgs) ||
+        ((flags & EFSM_VERIFY_NO_EXIT) && report.n_no_exit);
+
+    efsm_verify_release(&report);
+
+    return fails;
+}
+
+/** Copies an array of n ints, into NULL for none
+ *
+ * \return 0 for success, -1 if out of memory
+ */
+static int efsm__ints_dup(int **to, const int *from, size_t n)
+{
+    *to = NULL;
+    if (!n)
+        return 0;
+
+    *to = malloc(sizeof(**to) * n);
+    if (!*to)
+        return -1;
+    memcpy(*to, from, sizeof(**to) * n);
+
+    return 0;
+}
+
+/** Compiles rules into a def with one reference
+ *
+ * \param opts the parts that describe the machine are read, as in
+ *        efsm_def_compile
+ * \param min_states states to make room for even if neither the rules nor
+ *        the parents mention them
+ *
+ * \return the def, or NULL on failure
+ */
+static efsm__def_t *efsm__def_build(efsm_transition_rules_t * rules,
+                                    efsm_opts_t * opts, int min_states)
+{
+    efsm__def_t *def = calloc(sizeof(*def), 1);
+    const int *parents = opts->state_parents;
+    size_t n_parents = parents ? opts->n_state_parents : 0;
+    size_t k;
+
+    if (!def)
+        return NULL;
+
+    def->wrapper.data = def;
+    atomic_init(&def->refs, 1);
+    def->engine = opts->engine;
+    def->dispatch_opt = opts->dispatch;
+    def->verify = opts->verify;
+
+    if ((int)n_parents > min_states)
+        min_states = (int)n_parents;
+    for (k = 0; k < n_parents; k++)
+        if (parents[k] >= min_states)
+            min_states = parents[k] + 1;
+
+    def->n_parents = n_parents;
+    def->n_start_states = opts->start_states ? opts->n_start_states : 0;
+    def->n_msg_types = opts->msg_types ? opts->n_msg_types : 0;
+    if (efsm__ints_dup(&def->parents, parents, def->n_parents) < 0 ||
+        efsm__ints_dup(&def->start_states, opts->start_states,
+                       def->n_start_states) < 0 ||
+        efsm__ints_dup(&def->msg_types, opts->msg_types,
+                       def->n_msg_types) < 0) {
+        efsm__def_free(def);
+        return NULL;
+    }
+
+    if (efsm__states_from_rules(def, rules, min_states) < 0 ||
+        efsm__dispatch_compile(def, opts->dispatch) < 0 ||
+        efsm__inherit_compile(def, parents, n_parents) < 0 ||
+        (opts->n_batch &&
+         efsm__batch_compile(def, opts->batch, opts->n_batch) < 0) ||
+        (def->verify && efsm__verify_fails(def))) {
+        efsm__def_free(def);
+        return NULL;
+    }
+
+    return def;
+}
+
+efsm_def_t *efsm_def_compile(efsm_transition_rules_t * rules,
+                             efsm_opts_t * opts)
+{
+    efsm_opts_t defaults = { 0 };
+    efsm__def_t *def = efsm__def_build(rules, opts ? opts : &defaults, 0);
+
+    return def ? &def->wrapper : NULL;
+}
+
+efsm_def_t *efsm_def_ref(efsm_def_t * _def)
+{
+    efsm__def_t *def = _def->data;
+
+    atomic_fetch_add_explicit(&def->refs, 1, memory_order_relaxed);
+
+    return _def;
+}
+
+void efsm_def_release(efsm_def_t * _def)
+{
+    efsm__def_t *def = _def->data;
+
+    if (atomic_fetch_sub_explicit(&def->refs, 1, memory_order_acq_rel) == 1)
+        efsm__def_free(def);
+}
+
+/** Compiles a copy of a def's rules, less those for (state, type) pairs
+ *  that add has rules for and (drop_state, drop_type), with add after them
+ *
+ * The rules kept are in state order, each state's in the order they had, so
+ * duplicates resolve as before, and keep their batch callbacks.  Every state
+ * the def had is kept too, so no fsa is left in one that's gone.
+ *
+ * \param drop_state -1 to drop nothing but what add replaces
+ * \param[out] n_dropped how many rules were left out
+ *
+ * \return the new def, or NULL on failure
+ */
+static efsm__def_t *efsm__def_edit(efsm__def_t * def,
+                                   efsm_transition_rules_t * add,
+                                   int drop_state, int drop_type,
+                                   int *n_dropped)
+{
+    int n_add = 0, n = 0, n_batch = 0;
+    int i, k, s;
+
+    while (add && add[n_add].current_state != -1)
+        n_add++;
+
+    char *dropped = calloc(1, def->n_transitions + 1);
+    efsm_transition_rules_t *rules =
+        malloc(sizeof(*rules) * (def->n_transitions + n_add + 1));
+    efsm_batch_rule_t *batch =
+        malloc(sizeof(*batch) * (def->n_batch ? def->n_batch : 1));
+    efsm__def_t *edited = NULL;
+
+    *n_dropped = 0;
+    if (!dropped || !rules || !batch)
+        goto out;
+
+    for (k = 0; k <= n_add; k++) {
+        int state = k < n_add ? add[k].current_state : drop_state;
+        int type = k < n_add ? add[k].msg_type : drop_type;
+
+        s = state == EFSM_ANY ? def->root : state;
+        if (s < 0 || s >= def->n_states ||
+            (s == def->root && state != EFSM_ANY))
+            continue;
+
+        for (i = def->offsets[s]; i < def->offsets[s + 1]; i++)
+            if (def->transitions[i].msg_type == type && !dropped[i]) {
+                dropped[i] = 1;
+                if (k == n_add)
+                    (*n_dropped)++;
+            }
+    }
+
+    for (s = 0; s < def->n_states; s++) {
+        for (i = def->offsets[s]; i < def->offsets[s + 1]; i++) {
+            if (dropped[i])
+                continue;
+
+            rules[n].current_state = s == def->root ? EFSM_ANY : s;
+            rules[n].msg_type = def->transitions[i].msg_type;
+            rules[n].code = def->codes[i].code;
+            rules[n].data = def->codes[i].data;
+            rules[n].next_state = def->transitions[i].next_state;
+
+            if (def->codes[i].batch) {
+                batch[n_batch].current_state = rules[n].current_state;
+                batch[n_batch].msg_type = rules[n].msg_type;
+                batch[n_batch].code = def->codes[i].batch;
+                n_batch++;
+            }
+            n++;
+        }
+    }
+
+    if (n_add)
+        memcpy(rules + n, add, sizeof(*rules) * n_add);
+    rules[n + n_add].current_state = -1;
+
+    efsm_opts_t opts = { 0 };
+    opts.dispatch = def->dispatch_opt;
+    opts.state_parents = def->parents;
+    opts.n_state_parents = def->n_parents;
+    opts.batch = batch;
+    opts.n_batch = n_batch;
+    opts.start_states = def->start_states;
+    opts.n_start_states = def->n_start_states;
+    opts.msg_types = def->msg_types;
+    opts.n_msg_types = def->n_msg_types;
+    opts.verify = def->verify;
+
+    edited = efsm__def_build(rules, &opts,
+                             def->n_states - (def->root >= 0));
+
+  out:
+    free(dropped);
+    free(rules);
+    free(batch);
+
+    return edited;
+}
+
+/** Swaps in an edited def now, or at the end of the efsm_run under way
+ *
+ * \return 0 for success, -1 if out of memory
+ */
+static int efsm__def_publish(efsm__t * efsm, efsm__def_t * def)
+{
+    if (!efsm->in_run && efsm__def_swap(efsm, def) < 0) {
+        efsm_def_release(&def->wrapper);
+        return -1;
+    }
+
+    // Either way it was made from any def waiting, so replaces it
+    if (efsm->def_next)
+        efsm_def_release(&efsm->def_next->wrapper);
+    efsm->def_next = efsm->in_run ? def : NULL;
+
+    return 0;
+}
+
+int efsm_add_rules(efsm_t * _efsm, efsm_transition_rules_t * rules)
+{
+    efsm__t *efsm = _efsm->data;
+    efsm__def_t *def = efsm->def_next ? efsm->def_next : efsm->def;
+    int n_dropped;
+
+    if (def->engine)
+        return -1;
+
+    def = efsm__def_edit(def, rules, -1, 0, &n_dropped);
+    if (!def)
+        return -1;
+
+    return efsm__def_publish(efsm, def);
+}
+
+int efsm_remove_rule(efsm_t * _efsm, int state, int type)
+{
+    efsm__t *efsm = _efsm->data;
+    efsm__def_t *def = efsm->def_next ? efsm->def_next : efsm->def;
+    int n_dropped;
+
+    if (def->engine || state == -1)
+        return -1;
+
+    def = efsm__def_edit(def, NULL, state, type, &n_dropped);
+    if (!def)
+        return -1;
+
+    if (!n_dropped) {
+        efsm_def_release(&def->wrapper);
+        return -1;
+    }
+
+    return efsm__def_publish(efsm, def);
+}
+
+efsm_t *efsm_new(efsm_transition_rules_t * rules, efsm_opts_t * opts)
+{
+    efsm_def_t *def = efsm_def_compile(rules, opts);
+    if (!def)
+        return NULL;
+
+    efsm_t *efsm = efsm_new_from_def(def, opts);
+    efsm_def_release(def);
+
+    return efsm;
+}
+
+efsm_t *efsm_new_from_def(efsm_def_t * def, efsm_opts_t * opts)
+{
+    efsm_t *_efsm = calloc(sizeof(*_efsm), 1);
+    efsm__t *efsm = calloc(sizeof(*efsm), 1);
+    if (!_efsm || !efsm) {
+        free(efsm);
+        free(_efsm);
+        return NULL;
+    }
+    _efsm->data = efsm;
+
+    size_t pool_initial = EFSM__MSG_POOL_INITIAL;
+    size_t pool_max = 0;
+    size_t fsa_pool_initial = EFSM__FSA_POOL_INITIAL;
+
+    if (opts) {
+        efsm->transition_cb = opts->transition_cb;
+        if (opts->msg_pool_initial)
+            pool_initial = opts->msg_pool_initial;
+        pool_max = opts->msg_pool_max;
+        if (opts->fsa_pool_initial)
+            fsa_pool_initial = opts->fsa_pool_initial;
+        efsm->fsa_ctx_size = opts->fsa_ctx_size;
+        efsm->stats_latency = opts->stats_latency;
+        efsm->rtc_hops = opts->run_to_completion;
+        efsm->id_data = opts->id_data;
+        if (opts->id_state_size == 2)
+            efsm->ids.state_size = 2;
+        if (opts->id_fsa_opts)
+            efsm->ids.opts = *opts->id_fsa_opts;
+        efsm->limits.mailbox_limit = opts->mailbox_limit;
+        efsm->limits.overflow = opts->overflow;
+        efsm->limits.overflow_msg = opts->overflow_msg;
+        efsm->on_error = opts->on_error;
+        efsm->error_msg = opts->error_msg;
+        efsm->trace_sample = opts->trace_sample ? opts->trace_sample : 1;
+        if (opts->trace_records) {
+            efsm->trace_mask = 1;
+            while (efsm->trace_mask < opts->trace_records)
+                efsm->trace_mask <<= 1;
+            efsm->trace_mask--;
+        }
+        efsm->inline_size = EFSM__ROUND_UP(opts->inline_size, 8);
+
+        if (opts->msg_prio && opts->n_msg_prio) {
+            efsm->msg_prio = malloc(sizeof(int) * opts->n_msg_prio);
+            if (!efsm->msg_prio) {
+                free(efsm);
+                free(_efsm);
+                return NULL;
+            }
+            memcpy(efsm->msg_prio, opts->msg_prio,
+                   sizeof(int) * opts->n_msg_prio);
+            efsm->n_msg_prio = opts->n_msg_prio;
+        }
+
+        if (opts->coalesce && opts->n_coalesce &&
+            efsm__coalesce_compile(efsm, opts->coalesce,
+                                   opts->n_coalesce) < 0) {
+            free(efsm->msg_prio);
+            free(efsm);
+            free(_efsm);
+            return NULL;
+        }
+    }
+
+    efsm->def = efsm_def_ref(def)->data;
+    if (!efsm->ids.state_size)
+        efsm->ids.state_size = 4;
+
+    efsm->ctx_offset = EFSM__ROUND_UP(sizeof(efsm__fsa_t), EFSM__POOL_ALIGN);
+    efsm__pool_init(&efsm->fsa_pool, efsm->ctx_offset + efsm->fsa_ctx_size,
+                    fsa_pool_initial, 0);
+
+    if (pool_max && pool_initial > pool_max)
+        pool_initial = pool_max;
+
+    // Carve out the first slab up front so the first sends don't allocate
+    efsm__pool_init(&efsm->msg_pool, sizeof(efsm__msg_t) + efsm->inline_size,
+                    pool_initial, pool_max);
+    efsm__pool_grow(&efsm->msg_pool, pool_initial);
+
+    if (efsm__stats_init(&efsm->stats, efsm->def->n_transitions,
+                         efsm->stats_latency) < 0) {
+        efsm_destroy(_efsm);
+        return NULL;
+    }
+
+    if (efsm->trace_mask) {
+        efsm->trace_ticks = efsm__ticks();
+        efsm->trace_ns = efsm__now();
+        if (efsm__trace_reserve(efsm, 1) < 0) {
+            efsm_destroy(_efsm);
+            return NULL;
+        }
+    }
+
+    return _efsm;
+}
+
+void efsm_destroy(efsm_t * _efsm)
+{
+    efsm__t *efsm = _efsm->data;
+
+    efsm__fsa_t *ele, *tmp;
+    efsm__async_t *msg, *next;
+
+    if (efsm->par)
+        efsm__par_stop(efsm);
+
+    msg = atomic_exchange(&efsm->inbox, NULL);
+    LL_CONCAT(efsm->backlog, msg);
+    for (msg = efsm->backlog; msg; msg = next) {
+        next = msg->next;
+        free(msg);
+    }
+    efsm->backlog = NULL;
+
+    DL_FOREACH_SAFE2(efsm->fsas, ele, tmp, all_next) {
+        efsm__fsa_destroy(ele);
+    }
+    efsm__ids_destroy(efsm);
+
+    efsm_def_release(&efsm->def->wrapper);
+    if (efsm->def_next)
+        efsm_def_release(&efsm->def_next->wrapper);
+    free(efsm->msg_prio);
+    free(efsm->coalesce);
+    efsm__batch_free(&efsm->batch);
+
+    efsm__pool_destroy(&efsm->msg_pool);
+    efsm__pool_destroy(&efsm->fsa_pool);
+    efsm__stats_destroy(&efsm->stats);
+
+    int i;
+    for (i = 0; i < efsm->n_traces; i++)
+        free(efsm->traces[i].recs);
+    free(efsm->traces);
+
+    if (efsm->wheel) {
+        efsm__pool_destroy(&efsm->wheel->pool);
+        free(efsm->wheel);
+    }
+
+    efsm__loop_t *loop = atomic_load(&efsm->loop);
+    if (loop) {
+        close(loop->epfd);
+        close(loop->wake_fd);
+        free(loop);
+    }
+
+    free(efsm);
+    free(_efsm);
+}
+
+void efsm_fsa_destroy(efsm_fsa_t * _fsa)
+{
+    efsm__fsa_t *fsa = _fsa->data;
+    efsm__worker_t *self = efsm__self;
+
+    if (self && self->efsm == fsa->efsm) {
+        // Without the memory to buffer it, leave it on the fsa for the end
+        // of the pass to find
+        if (efsm__defer(self, fsa, 0, 0, NULL, -1, 1) < 0) {
+            atomic_store_explicit(&fsa->destroy_asked, 1,
+                                  memory_order_relaxed);
+            self->lost_destroys = 1;
+        }
+        return;
+    }
+
+    efsm__fsa_destroy(fsa);
+}
+
+int efsm_fsa_resume(efsm_fsa_t * _fsa)
+{
+    efsm__fsa_t *fsa = _fsa->data;
+
+    if (fsa->status != EFSM_FSA_QUARANTINED)
+        return -1;
+
+    fsa->status = EFSM_FSA_IDLE;
+    fsa->efsm->n_pending += fsa->mbox.count;
+    if (fsa->mbox.count)
+        efsm__fsa_wake(fsa);
+    else if (fsa->slot)
+        efsm__id_park(fsa);
+
+    return 0;
+}
+
+/** destroys the internal representation of a fsa
+ *
+ * calls the destroy callback if one was provided
+ */
+void efsm__fsa_destroy(efsm__fsa_t * fsa)
+{
+    efsm__t *efsm = fsa->efsm;
+
+    while (fsa->timers)
+        efsm__timer_remove(fsa->efsm, fsa->timers);
+    while (fsa->watches)
+        efsm__watch_remove(fsa->efsm, fsa->watches);
+
+    if (fsa->status == EFSM_FSA_RUNNABLE)
+        DL_DELETE(fsa->efsm->runq, fsa);
+    if (fsa->slot) {
+        efsm__id_unlive(&fsa->efsm->ids, fsa->slot - 1);
+        efsm__id_release(&fsa->efsm->ids, fsa->slot - 1);
+    } else {
+        DL_DELETE2(fsa->efsm->fsas, fsa, all_prev, all_next);
+    }
+
+    if (fsa->status != EFSM_FSA_QUARANTINED)
+        fsa->efsm->n_pending -= fsa->mbox.count;
+    efsm__mbox_flush(fsa, EFSM_PRIO_LANES);
+    free(fsa->mbox.ring);
+    free(fsa->mbox.payload);
+    free(fsa->mbox.retired);
+
+    if (fsa->dcb)
+        fsa->dcb(fsa->data);
+
+    // Async messages could still name us, so we wait for the next splice
+    // rather than walk them here
+    if (efsm->backlog ||
+        atomic_load_explicit(&efsm->inbox, memory_order_relaxed)) {
+        fsa->status = EFSM_FSA_DEAD;
+        fsa->next = efsm->dead;
+        efsm->dead = fsa;
+        return;
+    }
+
+    efsm__pool_free(&efsm->fsa_pool, fsa);
+}
+
+/** Destroy an efsm message from lane 0, handing it back to the message pool */
+void efsm__msg_destroy(efsm__msg_t * msg)
+{
+    DL_DELETE(msg->fsa->mbox.queued, msg);
+
+    efsm__msg_release(msg);
+}
+
+/** Hands a message that's off its list back to the message pool */
+void efsm__msg_release(efsm__msg_t * msg)
+{
+    efsm__fsa_t *fsa = msg->fsa;
+    efsm__worker_t *self = efsm__self;
+
+    // Workers can't touch the pool, so the message goes back after the pass
+    if (self && self->efsm == fsa->efsm) {
+        efsm__pool_free_t *f = (efsm__pool_free_t *) msg;
+        f->next = self->consumed;
+        self->consumed = f;
+        return;
+    }
+
+    efsm__pool_free(&fsa->efsm->msg_pool, msg);
+}
+
+efsm_dispatch_t efsm_dispatch(efsm_t * _efsm)
+{
+    efsm__t *efsm = _efsm->data;
+
+    return efsm->def->dispatch;
+}
+
+void efsm_fsa_pool_stats(efsm_t * _efsm, efsm_pool_stats_t * stats)
+{
+    efsm__t *efsm = _efsm->data;
+
+    *stats = efsm->fsa_pool.stats;
+}
+
+void *efsm_fsa_ctx(efsm_fsa_t * _fsa)
+{
+    efsm__fsa_t *fsa = _fsa->data;
+
+    if (!fsa->efsm->fsa_ctx_size || fsa->slot)
+        return NULL;
+
+    return (char *)fsa + fsa->efsm->ctx_offset;
+}
+
+#ifndef EFSM_NO_STATS
+/** Adds one block of counters into a snapshot */
+static void efsm__stats_merge(efsm_stats_t * out, efsm__stats_t * in)
+{
+    int i, b;
+
+    for (i = 0; i < out->n_transitions; i++) {
+        out->transitions[i].count += in->transitions[i];
+        if (in->latency)
+            for (b = 0; b < EFSM_STATS_BUCKETS; b++)
+                out->transitions[i].latency[b] +=
+                    in->latency[i * EFSM_STATS_BUCKETS + b];
+    }
+
+    out->runs += in->runs;
+    out->msgs += in->msgs;
+    out->errors += in->errors;
+    for (b = 0; b < EFSM_STATS_BUCKETS; b++)
+        out->run_msgs[b] += in->run_msgs[b];
+
+    if (in->mailbox_high_water > out->mailbox_high_water)
+        out->mailbox_high_water = in->mailbox_high_water;
+}
+
+#endif
+
+int efsm_stats_get(efsm_t * _efsm, efsm_stats_t * stats)
+{
+    memset(stats, 0, sizeof(*stats));
+
+#ifdef EFSM_NO_STATS
+    (void)_efsm;
+    return -1;
+#else
+    efsm__t *efsm = _efsm->data;
+    efsm__def_t *def = efsm->def;
+    int i, j;
+
+    stats->n_transitions = def->n_transitions;
+    stats->transitions = calloc(sizeof(*stats->transitions),
+                                def->n_transitions + 1);
+    if (!stats->transitions)
+        return -1;
+
+    for (i = 0; i < def->n_states; i++) {
+        for (j = def->offsets[i]; j < def->offsets[i + 1]; j++) {
+            stats->transitions[j].state = i == def->root ? EFSM_ANY : i;
+            stats->transitions[j].msg_type = def->transitions[j].msg_type;
+            stats->transitions[j].next_state =
+                def->transitions[j].next_state;
+        }
+    }
+
+    efsm__stats_merge(stats, &efsm->stats);
+    if (efsm->par)
+        for (i = 0; i < efsm->par->n_threads; i++)
+            efsm__stats_merge(stats, &efsm->par->workers[i].stats);
+
+    return 0;
+#endif
+}
+
+void efsm_stats_release(efsm_stats_t * stats)
+{
+    free(stats->transitions);
+
+    memset(stats, 0, sizeof(*stats));
+}
+
+void efsm_msg_pool_stats(efsm_t * _efsm, efsm_pool_stats_t * stats)
+{
+    efsm__t *efsm = _efsm->data;
+
+    *stats = efsm->msg_pool.stats;
+}
+
+/** Writes len bytes, then zeros up to a multiple of 8 */
+static int efsm__snap_put(efsm_writer_t * w, const void *buf, size_t len)
+{
+    static const char zeros[8];
+
+    if (len && w->write(w->ctx, buf, len) < 0)
+        return -1;
+    if (len % 8 && w->write(w->ctx, zeros, 8 - len % 8) < 0)
+        return -1;
+
+    return 0;
+}
+
+/** Reads what efsm__snap_put wrote */
+static int efsm__snap_get(efsm_reader_t * r, void *buf, size_t len)
+{
+    char pad[8];
+
+    if (len && r->read(r->ctx, buf, len) < 0)
+        return -1;
+    if (len % 8 && r->read(r->ctx, pad, 8 - len % 8) < 0)
+        return -1;
+
+    return 0;
+}
+
+/** Writes a message record */
+static int efsm__snap_msg(efsm_writer_t * w, efsm__fsa_t * fsa, int prio,
+                          int type, void *data, int inlined)
+{
+    efsm__snap_msg_t m;
+    const void *blob = &data;
+    size_t len = sizeof(data);
+
+    m.kind = EFSM__SNAP_PTR;
+    if (inlined) {
+        m.kind = EFSM__SNAP_INLINE;
+        blob = data;
+        len = fsa->efsm->inline_size;
+    } else if (w->save_msg) {
+        m.kind = EFSM__SNAP_BLOB;
+        if (w->save_msg(w->ctx, &fsa->wrapper, type, data, &blob, &len) < 0)
+            return -1;
+    }
+
+    m.type = type;
+    m.prio = prio;
+    m.len = len;
+
+    if (efsm__snap_put(w, &m, sizeof(m)) < 0)
+        return -1;
+
+    return efsm__snap_put(w, blob, len);
+}
+
+/** Writes a fsa record and everything in its mailbox */
+static int efsm__snap_fsa(efsm_writer_t * w, efsm__fsa_t * fsa)
+{
+    efsm__t *efsm = fsa->efsm;
+    efsm__mbox_t *mbox = &fsa->mbox;
+    void *ctx = (char *)fsa + efsm->ctx_offset;
+    efsm__snap_fsa_t f;
+    efsm__msg_t *msg;
+    const void *blob = NULL;
+    size_t len = 0;
+    unsigned int i;
+    int l;
+
+    if (w->save_fsa &&
+        w->save_fsa(w->ctx, &fsa->wrapper, fsa->data, &blob, &len) < 0)
+        return -1;
+
+    f.state = fsa->state;
+    f.n_msgs = mbox->count;
+    f.capacity = mbox->ring ? mbox->mask + 1 : 0;
+    f.has_ctx = efsm->fsa_ctx_size && fsa->data == ctx;
+    f.blob_len = len;
+
+    if (efsm__snap_put(w, &f, sizeof(f)) < 0 ||
+        (f.has_ctx && efsm__snap_put(w, ctx, efsm->fsa_ctx_size) < 0) ||
+        efsm__snap_put(w, blob, len) < 0)
+        return -1;
+
+    if (mbox->ring) {
+        for (i = 0; i < mbox->count - mbox->n_urgent; i++) {
+            efsm__slot_t *slot = mbox->ring + ((mbox->head + i) & mbox->mask);
+            if (efsm__snap_msg(w, fsa, 0, slot->type, slot->data,
+                               slot->inlined) < 0)
+                return -1;
+        }
+    } else {
+        DL_FOREACH(mbox->queued, msg) {
+            if (efsm__snap_msg(w, fsa, 0, msg->type, msg->data,
+                               efsm->inline_size &&
+                               msg->data == msg->payload) < 0)
+                return -1;
+        }
+    }
+
+    for (l = 1; l < EFSM_PRIO_LANES; l++) {
+        DL_FOREACH(mbox->lanes[l - 1], msg) {
+            if (efsm__snap_msg(w, fsa, l | msg->flush, msg->type, msg->data,
+                               efsm->inline_size &&
+                               msg->data == msg->payload) < 0)
+                return -1;
+        }
+    }
+
+    return 0;
+}
+
+int efsm_snapshot(efsm_t * _efsm, efsm_writer_t * w)
+{
+    efsm__t *efsm = _efsm->data;
+    efsm__snap_hdr_t hdr;
+    efsm__fsa_t *fsa;
+
+    hdr.magic = EFSM__SNAP_MAGIC;
+    hdr.version = EFSM__SNAP_VERSION;
+    hdr.n_states = efsm->def->n_states;
+    hdr.n_transitions = efsm->def->n_transitions;
+    hdr.n_fsas = 0;
+    hdr.n_msgs = 0;
+    hdr.inline_size = efsm->inline_size;
+    hdr.ctx_size = efsm->fsa_ctx_size;
+
+    DL_FOREACH2(efsm->fsas, fsa, all_next) {
+        hdr.n_fsas++;
+        hdr.n_msgs += fsa->mbox.count;
+    }
+
+    if (efsm__snap_put(w, &hdr, sizeof(hdr)) < 0)
+        return -1;
+
+    DL_FOREACH2(efsm->fsas, fsa, all_next) {
+        if (efsm__snap_fsa(w, fsa) < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+/** Makes sure a pool can hand out n more elements without growing */
+static void efsm__pool_reserve(efsm__pool_t * pool, size_t n)
+{
+    size_t avail = pool->stats.capacity - pool->stats.in_use;
+
+    // A failure here just means growing (or failing) as we go
+    if (n > avail)
+        efsm__pool_grow(pool, n - avail);
+}
+
+/** Reads a blob into a scratch buffer, growing it as needed */
+static int efsm__snap_blob(efsm_reader_t * r, unsigned char **buf,
+                           size_t *size, uint64_t len)
+{
+    if (len > SIZE_MAX - 8)
+        return -1;
+
+    if (len > *size) {
+        unsigned char *grown = realloc(*buf, len);
+        if (!grown)
+            return -1;
+        *buf = grown;
+        *size = len;
+    }
+
+    return efsm__snap_get(r, *buf, len);
+}
+
+/** Recreates one fsa, and its mailbox, from its record
+ *
+ * \param[out] added set once the fsa is in the efsm, so a failure from
+ *              then on leaves it there for the caller to destroy
+ */
+static int efsm__restore_fsa(efsm_reader_t * r, efsm__t * efsm,
+                             efsm__snap_hdr_t * hdr, unsigned char **buf,
+                             size_t *size, int *added)
+{
+    efsm__snap_fsa_t f;
+    efsm__snap_msg_t m;
+    uint32_t i;
+
+    if (efsm__snap_get(r, &f, sizeof(f)) < 0)
+        return -1;
+    if (f.state < 0 || f.state >= efsm->def->n_states ||
+        f.state == efsm->def->root || (f.capacity & (f.capacity - 1)))
+        return -1;
+
+    efsm__fsa_t *fsa = efsm__pool_alloc(&efsm->fsa_pool);
+    if (!fsa)
+        return -1;
+
+    fsa->wrapper.data = fsa;
+    fsa->efsm = efsm;
+    fsa->state = f.state;
+    fsa->status = EFSM_FSA_IDLE;
+    if (efsm->fsa_ctx_size)
+        fsa->data = (char *)fsa + efsm->ctx_offset;
+    if (r->fsa_opts) {
+        fsa->dcb = r->fsa_opts->destroy_cb;
+        fsa->drop_cb = r->fsa_opts->drop_cb;
+        fsa->error_cb = r->fsa_opts->error_cb;
+    }
+    efsm__fsa_limit(fsa, r->fsa_opts);
+
+    fsa->id = efsm->next_id++;
+    DL_APPEND2(efsm->fsas, fsa, all_prev, all_next);
+    *added = 1;
+
+    // From here on the fsa is in the efsm, which cleans it up on failure
+    if (f.capacity) {
+        fsa->mbox.ring = malloc(sizeof(*fsa->mbox.ring) * f.capacity);
+        if (!fsa->mbox.ring)
+            return -1;
+        fsa->mbox.mask = f.capacity - 1;
+    }
+
+    if (f.has_ctx) {
+        if (!hdr->ctx_size ||
+            efsm__snap_get(r, (char *)fsa + efsm->ctx_offset,
+                           hdr->ctx_size) < 0)
+            return -1;
+    } else if (efsm->fsa_ctx_size) {
+        fsa->data = NULL;
+    }
+
+    if (efsm__snap_blob(r, buf, size, f.blob_len) < 0)
+        return -1;
+    if (r->load_fsa &&
+        r->load_fsa(r->ctx, &fsa->wrapper, *buf, f.blob_len, &fsa->data) < 0)
+        return -1;
+
+    for (i = 0; i < f.n_msgs; i++) {
+        void *data = NULL;
+        long len = -1;
+
+        if (efsm__snap_get(r, &m, sizeof(m)) < 0 ||
+            efsm__snap_blob(r, buf, size, m.len) < 0 ||
+            (m.prio & ~EFSM_PRIO_FLUSH) >= EFSM_PRIO_LANES)
+            return -1;
+
+        switch (m.kind) {
+        case EFSM__SNAP_PTR:
+            if (m.len != sizeof(data))
+                return -1;
+            memcpy(&data, *buf, sizeof(data));
+            break;
+        case EFSM__SNAP_INLINE:
+            if (m.len > efsm->inline_size)
+                return -1;
+            data = *buf;
+            len = m.len;
+            break;
+        case EFSM__SNAP_BLOB:
+            if (r->load_msg && r->load_msg(r->ctx, &fsa->wrapper, m.type,
+                                           *buf, m.len, &data) < 0)
+                return -1;
+            break;
+        default:
+            return -1;
+        }
+
+        if (efsm__mbox_push(fsa, m.prio, m.type, data, len) < 0)
+            return -1;
+    }
+
+    if (fsa->mbox.count)
+        efsm__fsa_wake(fsa);
+
+    return 0;
+}
+
+long efsm_restore(efsm_t * _efsm, efsm_reader_t * r)
+{
+    efsm__t *efsm = _efsm->data;
+    efsm__snap_hdr_t hdr;
+    unsigned char *buf = NULL;
+    size_t size = 0;
+    uint64_t i;
+
+    if (efsm__snap_get(r, &hdr, sizeof(hdr)) < 0)
+        return -1;
+
+    if (hdr.magic != EFSM__SNAP_MAGIC || hdr.version != EFSM__SNAP_VERSION ||
+        hdr.n_states != (uint32_t)efsm->def->n_states ||
+        hdr.n_transitions != (uint32_t)efsm->def->n_transitions ||
+        hdr.inline_size > efsm->inline_size ||
+        hdr.ctx_size > efsm->fsa_ctx_size || hdr.n_fsas > LONG_MAX)
+        return -1;
+
+    // Carve everything out of the pools at once, ring messages aside
+    efsm__pool_reserve(&efsm->fsa_pool, hdr.n_fsas);
+    efsm__pool_reserve(&efsm->msg_pool, hdr.n_msgs);
+
+    for (i = 0; i < hdr.n_fsas; i++) {
+        int added = 0;
+
+        if (efsm__restore_fsa(r, efsm, &hdr, &buf, &size, &added) < 0) {
+            // Back out everything we restored, newest first
+            for (i += added; i > 0; i--)
+                efsm__fsa_destroy(efsm->fsas->all_prev);
+            free(buf);
+            return -1;
+        }
+    }
+
+    free(buf);
+
+    return (long)hdr.n_fsas;
+}
+
+int efsm_trace_dump(efsm_t * _efsm, efsm_writer_t * w)
+{
+    efsm__t *efsm = _efsm->data;
+    efsm_trace_hdr_t hdr = { 0 };
+    int i;
+
+    if (!efsm->traces)
+        return -1;
+
+    memcpy(hdr.magic, EFSM_TRACE_MAGIC, sizeof(hdr.magic));
+
+    hdr.ticks0 = efsm->trace_ticks;
+    hdr.ns0 = efsm->trace_ns;
+    hdr.ticks1 = efsm__ticks();
+    hdr.ns1 = efsm__now();
+    hdr.n_rings = efsm->n_traces;
+    hdr.record_size = sizeof(efsm_trace_rec_t);
+
+    if (w->write(w->ctx, &hdr, sizeof(hdr)) < 0)
+        return -1;
+
+    for (i = 0; i < efsm->n_traces; i++) {
+        efsm__trace_t *t = efsm->traces + i;
+        unsigned long long size = efsm->trace_mask + 1;
+        efsm_trace_ring_t ring = { 0 };
+
+        ring.thread = i;
+        ring.n_records = t->n < size ? t->n : size;
+        ring.n_lost = t->n - ring.n_records;
+
+        // Oldest first, which is the end of the ring and then its start
+        size_t first = (t->n - ring.n_records) & efsm->trace_mask;
+        size_t n = size - first < ring.n_records ? size - first :
+            ring.n_records;
+
+        if (w->write(w->ctx, &ring, sizeof(ring)) < 0 ||
+            (n && w->write(w->ctx, t->recs + first, sizeof(*t->recs) * n) < 0)
+            || (ring.n_records > n &&
+                w->write(w->ctx, t->recs,
+                         sizeof(*t->recs) * (ring.n_records - n)) < 0))
+            return -1;
+    }
+
+    return 0;
+}
+
+/** Where efsm_graph formats into before handing chunks to the writer */
+typedef struct efsm__graph_out {
+    efsm_writer_t *w;
+    int failed;
+    size_t len;
+    char buf[4096];
+} efsm__graph_out_t;
+
+static void efsm__graph_flush(efsm__graph_out_t * out)
+{
+    if (out->len && !out->failed &&
+        out->w->write(out->w->ctx, out->buf, out->len) < 0)
+        out->failed = 1;
+
+    out->len = 0;
+}
+
+static void efsm__graph_put(efsm__graph_out_t * out, const void *buf,
+                            size_t len)
+{
+    if (out->len + len > sizeof(out->buf)) {
+        efsm__graph_flush(out);
+
+        // Too big to buffer, which only a very long name is
+        if (len > sizeof(out->buf)) {
+            if (!out->failed && out->w->write(out->w->ctx, buf, len) < 0)
+                out->failed = 1;
+            return;
+        }
+    }
+
+    memcpy(out->buf + out->len, buf, len);
+    out->len += len;
+}
+
+static void efsm__graph_puts(efsm__graph_out_t * out, const char *str)
+{
+    efsm__graph_put(out, str, strlen(str));
+}
+
+/** Writes v in decimal, which vsnprintf is several times slower at */
+static void efsm__graph_unum(efsm__graph_out_t * out, unsigned long long v)
+{
+    char tmp[20], *p = tmp + sizeof(tmp);
+
+    do {
+        *--p = '0' + v % 10;
+        v /= 10;
+    } while (v);
+
+    efsm__graph_put(out, p, tmp + sizeof(tmp) - p);
+}
+
+static void efsm__graph_num(efsm__graph_out_t * out, int v)
+{
+    if (v < 0)
+        efsm__graph_put(out, "-", 1);
+
+    efsm__graph_unum(out, v < 0 ? -(unsigned long long)v :
+                     (unsigned long long)v);
+}
+
+/** Writes names[i], or i if it has none.  Quoted names escape their quotes,
+ *  and for json backslashes and control characters too */
+static void efsm__graph_name(efsm__graph_out_t * out,
+                             const char *const *names, size_t n_names, int i,
+                             int quoted, int json)
+{
+    if (i < 0 || (size_t)i >= n_names || !names || !names[i]) {
+        efsm__graph_num(out, i);
+        return;
+    }
+
+    const char *name = names[i], *p;
+
+    if (!quoted) {
+        efsm__graph_puts(out, name);
+        return;
+    }
+
+    for (p = name; *p; p++) {
+        unsigned char c = *p;
+
+        if (c == '"' || (json && c == '\\')) {
+            efsm__graph_put(out, name, p - name);
+            efsm__graph_put(out, "\\", 1);
+            name = p;
+        } else if (json && c < 0x20) {
+            char esc[] = "\\u0000";
+
+            esc[4] = "0123456789abcdef"[c >> 4];
+            esc[5] = "0123456789abcdef"[c & 0xf];
+            efsm__graph_put(out, name, p - name);
+            efsm__graph_put(out, esc, 6);
+            name = p + 1;
+        }
+    }
+    efsm__graph_put(out, name, p - name);
+}
+
+static void efsm__graph_dot(efsm__graph_out_t * out, efsm__def_t * def,
+                            const efsm_graph_opts_t * opts,
+                            efsm_stats_t * stats)
+{
+    unsigned long long max = 0;
+    int i, j;
+
+    if (stats)
+        for (j = 0; j < def->n_transitions; j++)
+            if (stats->transitions[j].count > max)
+                max = stats->transitions[j].count;
+
+    efsm__graph_puts(out, "digraph G {\n");
+
+    for (i = 0; i < def->n_states; i++) {
+        for (j = def->offsets[i]; j < def->offsets[i + 1]; j++) {
+            efsm__transition_t *transition = def->transitions + j;
+            int next = transition->next_state == EFSM_SAME ? i :
+                transition->next_state;
+
+            efsm__graph_puts(out, "  ");
+            if (i == def->root)
+                efsm__graph_puts(out, "*");
+            else
+                efsm__graph_name(out, opts->state_names, opts->n_state_names,
+                                 i, 0, 0);
+
+            efsm__graph_puts(out, " -> ");
+            if (next == -1)
+                efsm__graph_puts(out, "_");
+            else if (next == def->root)
+                efsm__graph_puts(out, "*");
+            else
+                efsm__graph_name(out, opts->state_names, opts->n_state_names,
+                                 next, 0, 0);
+
+            efsm__graph_puts(out, " [label=\"");
+            if (transition->msg_type == EFSM_ANY)
+                efsm__graph_puts(out, "*");
+            else
+                efsm__graph_name(out, opts->msg_names, opts->n_msg_names,
+                                 transition->msg_type, 1, 0);
+
+            if (stats) {
+                unsigned long long count = stats->transitions[j].count;
+
+                // Width by order of magnitude, so the long tail still shows
+                int bits = count ? 64 - __builtin_clzll(count) : 0;
+                int max_bits = max ? 64 - __builtin_clzll(max) : 1;
+
+                // In tenths, from 1.0 to 8.0
+                int width = 10 + 70 * bits / max_bits;
+
+                efsm__graph_puts(out, " (");
+                efsm__graph_unum(out, count);
+                efsm__graph_puts(out, ")\", penwidth=");
+                efsm__graph_num(out, width / 10);
+                efsm__graph_put(out, ".", 1);
+                efsm__graph_num(out, width % 10);
+                efsm__graph_puts(out, "];\n");
+            } else {
+                efsm__graph_puts(out, "\"];\n");
+            }
+        }
+    }
+
+    efsm__graph_puts(out, "}\n");
+}
+
+static void efsm__graph_json(efsm__graph_out_t * out, efsm__def_t * def,
+                             const efsm_graph_opts_t * opts,
+                             efsm_stats_t * stats)
+{
+    int i, j;
+
+    efsm__graph_puts(out, "{\"states\":[");
+    for (i = 0; i < def->n_states; i++) {
+        if (i == def->root)
+            continue;
+
+        efsm__graph_puts(out, i ? ",\n{\"id\":" : "\n{\"id\":");
+        efsm__graph_num(out, i);
+        efsm__graph_puts(out, ",\"name\":\"");
+        efsm__graph_name(out, opts->state_names, opts->n_state_names, i, 1,
+                         1);
+        efsm__graph_puts(out, "\"}");
+    }
+
+    efsm__graph_puts(out, "\n],\"edges\":[");
+    for (i = 0; i < def->n_states; i++) {
+        for (j = def->offsets[i]; j < def->offsets[i + 1]; j++) {
+            efsm__transition_t *transition = def->transitions + j;
+
+            efsm__graph_puts(out, j ? ",\n{\"from\":" : "\n{\"from\":");
+            efsm__graph_num(out, i == def->root ? EFSM_ANY : i);
+            efsm__graph_puts(out, ",\"msg\":");
+            efsm__graph_num(out, transition->msg_type);
+            efsm__graph_puts(out, ",\"to\":");
+            efsm__graph_num(out, transition->next_state);
+            efsm__graph_puts(out, ",\"label\":\"");
+            if (transition->msg_type == EFSM_ANY)
+                efsm__graph_puts(out, "*");
+            else
+                efsm__graph_name(out, opts->msg_names, opts->n_msg_names,
+                                 transition->msg_type, 1, 1);
+
+            efsm__graph_puts(out, "\"");
+            if (stats) {
+                efsm__graph_puts(out, ",\"count\":");
+                efsm__graph_unum(out, stats->transitions[j].count);
+            }
+            efsm__graph_puts(out, "}");
+        }
+    }
+
+    efsm__graph_puts(out, "\n]}\n");
+}
+
+static void efsm__graph_binary(efsm__graph_out_t * out, efsm__def_t * def,
+                               efsm_stats_t * stats)
+{
+    efsm_graph_hdr_t hdr = { 0 };
+    uint32_t offset;
+    int i, j;
+
+    memcpy(hdr.magic, EFSM_GRAPH_MAGIC, sizeof(hdr.magic));
+    hdr.n_states = def->n_states;
+    hdr.any_state = def->root;
+    hdr.n_edges = def->n_transitions;
+    hdr.edge_size = sizeof(efsm_graph_edge_t);
+    efsm__graph_put(out, &hdr, sizeof(hdr));
+
+    for (i = 0; i <= def->n_states; i++) {
+        offset = def->offsets[i];
+        efsm__graph_put(out, &offset, sizeof(offset));
+    }
+    if ((def->n_states + 1) % 2) {
+        offset = 0;
+        efsm__graph_put(out, &offset, sizeof(offset));
+    }
+
+    for (j = 0; j < def->n_transitions; j++) {
+        efsm_graph_edge_t edge = { 0 };
+
+        edge.msg_type = def->transitions[j].msg_type;
+        edge.next_state = def->transitions[j].next_state;
+        if (stats)
+            edge.count = stats->transitions[j].count;
+        efsm__graph_put(out, &edge, sizeof(edge));
+    }
+}
+
+int efsm_graph(efsm_t * _efsm, efsm_writer_t * w,
+               const efsm_graph_opts_t * opts)
+{
+    efsm__t *efsm = _efsm->data;
+    efsm_graph_opts_t defaults = { 0 };
+    efsm_stats_t stats;
+    efsm__graph_out_t *out;
+
+    if (!opts)
+        opts = &defaults;
+
+    if (!(out = malloc(sizeof(*out))))
+        return -1;
+
+    out->w = w;
+    out->failed = 0;
+    out->len = 0;
+
+    if (opts->counts && efsm_stats_get(_efsm, &stats) < 0) {
+        free(out);
+        return -1;
+    }
+
+    efsm_stats_t *counts = opts->counts ? &stats : NULL;
+
+    switch (opts->format) {
+    case EFSM_GRAPH_DOT:
+        efsm__graph_dot(out, efsm->def, opts, counts);
+        break;
+    case EFSM_GRAPH_JSON:
+        efsm__graph_json(out, efsm->def, opts, counts);
+        break;
+    case EFSM_GRAPH_BINARY:
+        efsm__graph_binary(out, efsm->def, counts);
+        break;
+    default:
+        out->failed = 1;
+        break;
+    }
+    efsm__graph_flush(out);
+
+    int rc = out->failed ? -1 : 0;
+
+    if (counts)
+        efsm_stats_release(counts);
+    free(out);
+
+    return rc;
+}
+
+/** An efsm_writer_t appending to a UT_string, for efsm_pp */
+static int efsm__pp_write(void *ctx, const void *buf, size_t len)
+{
+    utstring_bincpy((UT_string *) ctx, buf, len);
+
+    return 0;
+}
+
+char *efsm_pp(efsm_t * _efsm, char **state_names, char **transition_names)
+{
+    efsm__t *efsm = _efsm->data;
+    efsm_graph_opts_t opts = { 0 };
+    efsm_writer_t w = { 0 };
+    UT_string s;
+
+    utstring_init(&s);
+    w.write = &efsm__pp_write;
+    w.ctx = &s;
+
+    opts.state_names = (const char *const *)state_names;
+    opts.n_state_names = efsm->def->n_states;
+    opts.msg_names = (const char *const *)transition_names;
+    opts.n_msg_names = SIZE_MAX;
+
+    if (efsm_graph(_efsm, &w, &opts) < 0) {
+        utstring_done(&s);
+        return NULL;
+    }
 
-    return out;
+    return utstring_body(&s);
 }
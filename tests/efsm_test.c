@@ -10,12 +10,32 @@
 
 #include <efsm.h>
 #include <efsm_internal.h>
+#include <efsm_static.h>
+#include <utlist.h>
 #include <string.h>
+#include <stdlib.h>
 #include <stdio.h>
 #include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <poll.h>
+#include <unistd.h>
+#include <stdint.h>
 
 #define ASIZE(a) (sizeof(a) / sizeof(*a))
 
+/** Whether an allocation too big to satisfy returns NULL, which the
+ *  sanitizers abort on instead */
+#if defined(__SANITIZE_ADDRESS__) || defined(__SANITIZE_THREAD__)
+#define HUGE_MALLOC_FAILS 0
+#else
+#define HUGE_MALLOC_FAILS 1
+#endif
+
+/** A state and message type whose dense table can't be allocated */
+#define HUGE_STATE 65535
+#define HUGE_MSG (INT32_MAX - 1)
+
 /** The states we can be in */
 enum STATES {
     STATE_A,
@@ -73,42 +93,2339 @@ int state_destroy_on_msg_destroy(efsm_fsa_t * fsa, void *fsa_data, void * transi
     return 1;
 }
 
-int main(void) {
-   /** Our main test case */
+/** Records the order messages are delivered in */
+static long seen[128];
+static int n_seen;
+
+/** Callback that appends msg_data to seen */
+int record_msg(efsm_fsa_t * fsa, void *fsa_data, void *transition_data, int type, void *msg_data)
+{
+    seen[n_seen++] = (long)msg_data;
+    return 0;
+}
+
+/** Exercises the message pool's limits and counters */
+static void test_msg_pool(efsm_transition_rules_t * rules)
+{
+    efsm_opts_t opts = { 0 };
+    opts.msg_pool_initial = 2;
+    opts.msg_pool_max = 4;
+
+    efsm_t *efsm = efsm_new(rules, &opts);
+    efsm_fsa_t *fsa = efsm_fsa_new(efsm, STATE_A, NULL);
+
+    int i;
+    for (i = 0; i < 4; i++)
+        assert(efsm_fsa_send(fsa, MSG_A, NULL) == 0);
+    assert(efsm_fsa_send(fsa, MSG_A, NULL) == -1);
+
+    efsm_pool_stats_t stats;
+    efsm_msg_pool_stats(efsm, &stats);
+    assert(stats.capacity == 4);
+    assert(stats.in_use == 4);
+    assert(stats.high_water == 4);
+    assert(stats.hits == 3);
+    assert(stats.misses == 2);
+
+    efsm_fsa_destroy(fsa);
+    efsm_msg_pool_stats(efsm, &stats);
+    assert(stats.in_use == 0);
+    assert(stats.high_water == 4);
+
+    efsm_destroy(efsm);
+}
+
+/** Runs the A -> B -> DESTROY machine under every dispatch layout */
+static void test_dispatch(efsm_transition_rules_t * rules)
+{
+    efsm_dispatch_t layouts[] = {
+        EFSM_DISPATCH_DENSE,
+        EFSM_DISPATCH_HASH,
+        EFSM_DISPATCH_LINEAR,
+    };
+
+    int i;
+    for (i = 0; i < ASIZE(layouts); i++) {
+        efsm_opts_t opts = { 0 };
+        opts.dispatch = layouts[i];
+
+        efsm_t *efsm = efsm_new(rules, &opts);
+        assert(efsm_dispatch(efsm) == layouts[i]);
+
+        efsm_fsa_t *fsa = efsm_fsa_new(efsm, STATE_A, NULL);
+        efsm__fsa_t *_fsa = (efsm__fsa_t *) fsa->data;
+
+        efsm_fsa_send(fsa, MSG_A, NULL);
+        assert(efsm_run(efsm) == 1);
+        assert(_fsa->state == STATE_B);
+        assert(efsm_run(efsm) == 1);
+        assert(_fsa->state == STATE_DESTROY);
+        assert(efsm_run(efsm) == 0);
+
+        // no transition for MSG_A in STATE_A's successor
+        fsa = efsm_fsa_new(efsm, STATE_B, NULL);
+        efsm_fsa_send(fsa, MSG_A, NULL);
+        assert(efsm_run(efsm) == -1);
+
+        efsm_destroy(efsm);
+    }
+
+    // sparse message ids push auto mode onto the hash
+    efsm_transition_rules_t sparse[] = {
+        {STATE_A, 1000, &state_a_on_msg_a, NULL, STATE_B},
+        {STATE_B, 50000, &state_b_on_msg_b, NULL, STATE_A},
+        {-1},
+    };
+    efsm_t *efsm = efsm_new(sparse, NULL);
+    assert(efsm_dispatch(efsm) == EFSM_DISPATCH_HASH);
+    efsm_destroy(efsm);
+
+    efsm = efsm_new(rules, NULL);
+    assert(efsm_dispatch(efsm) == EFSM_DISPATCH_DENSE);
+    efsm_destroy(efsm);
+
+    // a forced dense table there's no memory for fails the efsm
+    efsm_transition_rules_t huge[] = {
+        {HUGE_STATE, HUGE_MSG, &state_a_on_msg_a, NULL, STATE_B},
+        {-1},
+    };
+    efsm_opts_t opts = { 0 };
+    opts.dispatch = EFSM_DISPATCH_DENSE;
+    if (HUGE_MALLOC_FAILS)
+        assert(!efsm_new(huge, &opts));
+}
+
+/** Fills a ring mailbox past its starting capacity while it wraps */
+static void test_ring_mailbox(void)
+{
     efsm_transition_rules_t rules[] = {
-        {STATE_A, MSG_A, &state_a_on_msg_a, NULL, STATE_B},
-        {STATE_B, MSG_B, &state_b_on_msg_b, NULL, STATE_DESTROY},
-        {STATE_DESTROY, MSG_DESTROY, &state_destroy_on_msg_destroy, NULL, -1},
+        {STATE_A, MSG_A, &record_msg, NULL, STATE_A},
         {-1},
     };
 
     efsm_t *efsm = efsm_new(rules, NULL);
 
-    efsm_fsa_t * fsa;
+    efsm_fsa_opts_t opts = { 0 };
+    opts.mailbox_capacity = 3;
+
+    efsm_fsa_t *fsa = efsm_fsa_new(efsm, STATE_A, &opts);
+    efsm__fsa_t *_fsa = (efsm__fsa_t *) fsa->data;
+    assert(_fsa->mbox.mask == 3);
+
+    long i;
+    n_seen = 0;
+    for (i = 0; i < 3; i++)
+        efsm_fsa_send(fsa, MSG_A, (void *)i);
+    while (efsm_run(efsm) > 0) ;
+    assert(n_seen == 3);
+
+    // head is now mid ring, so growing has to unwrap
+    for (i = 0; i < 10; i++)
+        efsm_fsa_send(fsa, MSG_A, (void *)i);
+    assert(_fsa->mbox.mask == 15);
+    while (efsm_run(efsm) > 0) ;
+
+    assert(n_seen == 13);
+    for (i = 0; i < 10; i++)
+        assert(seen[3 + i] == i);
+
+    efsm_pool_stats_t stats;
+    efsm_msg_pool_stats(efsm, &stats);
+    assert(stats.hits == 0 && stats.misses == 0);
+
+    efsm_fsa_send(fsa, MSG_A, NULL);
+    efsm_destroy(efsm);
+}
+
+/** Splits work over budgeted runs, round robin between fsa's */
+static void test_budget(void)
+{
+    efsm_transition_rules_t rules[] = {
+        {STATE_A, MSG_A, &record_msg, NULL, STATE_A},
+        {-1},
+    };
+
+    efsm_t *efsm = efsm_new(rules, NULL);
 
     efsm_fsa_opts_t opts = { 0 };
-    opts.hint = &fsa;
+    long i, j;
+    for (i = 0; i < 3; i++) {
+        opts.mailbox_capacity = i & 1;
+        efsm_fsa_t *fsa = efsm_fsa_new(efsm, STATE_A, &opts);
+        for (j = 0; j < 10; j++)
+            efsm_fsa_send(fsa, MSG_A, (void *)(i * 100 + j));
+    }
 
-    fsa = efsm_fsa_new(efsm, STATE_A, &opts);
-    efsm__fsa_t * _fsa = (efsm__fsa_t *)fsa->data;
+    n_seen = 0;
+    assert(efsm_run_budget(efsm, 4, 0) == 26);
+    assert(efsm_run_budget(efsm, 4, 0) == 22);
+    assert(efsm_run_budget(efsm, 4, 0) == 18);
+    assert(efsm_run_budget(efsm, 4, 0) == 14);
+    assert(seen[0] == 0 && seen[3] == 3);
+    assert(seen[4] == 100 && seen[8] == 200);
+    assert(seen[12] == 4 && seen[15] == 7);
 
-    assert(_fsa->state == STATE_A);
+    assert(efsm_run_budget(efsm, 0, 0) == 0);
+    assert(n_seen == 30);
+
+    // a deadline that's already passed still lets a slice through
+    efsm_fsa_t *fsa = efsm_fsa_new(efsm, STATE_A, NULL);
+    for (j = 0; j < 100; j++)
+        efsm_fsa_send(fsa, MSG_A, NULL);
+    n_seen = 0;
+    long left = efsm_run_budget(efsm, 0, 1);
+    assert(left > 0 && left < 100 && n_seen == 100 - left);
+    assert(efsm_run_budget(efsm, 0, 0) == 0);
+
+    efsm_destroy(efsm);
+}
+
+/** Batch sends to one fsa, a set of fsa's and every fsa */
+static void test_batch_send(void)
+{
+    efsm_transition_rules_t rules[] = {
+        {STATE_A, MSG_A, &record_msg, NULL, STATE_A},
+        {-1},
+    };
+
+    efsm_opts_t eopts = { 0 };
+    eopts.msg_pool_initial = 8;
+    eopts.msg_pool_max = 8;
+    efsm_t *efsm = efsm_new(rules, &eopts);
+
+    efsm_fsa_opts_t opts = { 0 };
+    efsm_fsa_t *fsas[4];
+    long i;
+    for (i = 0; i < 4; i++) {
+        opts.mailbox_capacity = i & 1;
+        fsas[i] = efsm_fsa_new(efsm, STATE_A, &opts);
+    }
+
+    efsm_msg_t msgs[6];
+    for (i = 0; i < 6; i++) {
+        msgs[i].type = MSG_A;
+        msgs[i].data = (void *)i;
+    }
+
+    n_seen = 0;
+    assert(efsm_fsa_send_many(fsas[1], msgs, 6) == 0);
+    assert(efsm_fsa_send_many(fsas[0], msgs, 6) == 0);
+    // the pool only has 2 messages left, so nothing goes in
+    assert(efsm_fsa_send_many(fsas[2], msgs, 6) == -1);
+    assert(((efsm__fsa_t *) fsas[2]->data)->mbox.count == 0);
+    while (efsm_run(efsm) > 0) ;
+    assert(n_seen == 12);
+    for (i = 0; i < 6; i++)
+        assert(seen[i] == i && seen[6 + i] == i);
+
+    // fsa's in every list get the broadcast, idle ones in a single splice
+    n_seen = 0;
+    efsm_fsa_send(fsas[3], MSG_A, NULL);
+    efsm_fsa_t *fresh = efsm_fsa_new(efsm, STATE_A, NULL);
+    assert(efsm_broadcast(efsm, MSG_A, (void *)7) == 0);
+    while (efsm_run(efsm) > 0) ;
+    assert(n_seen == 6);
+
+    n_seen = 0;
+    assert(efsm_fsa_send_multi(fsas, 3, MSG_A, NULL) == 0);
+    efsm_fsa_send_multi(&fresh, 1, MSG_A, NULL);
+    while (efsm_run(efsm) > 0) ;
+    assert(n_seen == 4);
+
+    efsm_destroy(efsm);
+}
+
+/** Callback that counts deliveries in a co-allocated context */
+int bump_ctx(efsm_fsa_t * fsa, void *fsa_data, void *transition_data, int type, void *msg_data)
+{
+    assert(fsa_data == efsm_fsa_ctx(fsa));
+    (*(int *)fsa_data)++;
+    return 0;
+}
+
+/** Churns fsa's through the pool, with a co-allocated context */
+static void test_fsa_pool(void)
+{
+    efsm_transition_rules_t rules[] = {
+        {STATE_A, MSG_A, &bump_ctx, NULL, STATE_A},
+        {-1},
+    };
+
+    efsm_opts_t eopts = { 0 };
+    eopts.fsa_pool_initial = 4;
+    eopts.fsa_ctx_size = sizeof(int) * 8;
+    efsm_t *efsm = efsm_new(rules, &eopts);
+
+    efsm_fsa_t *fsas[4];
+    int round, i;
+    for (round = 0; round < 3; round++) {
+        for (i = 0; i < 4; i++) {
+            fsas[i] = efsm_fsa_new(efsm, STATE_A, NULL);
+            assert(*(int *)efsm_fsa_ctx(fsas[i]) == 0);
+            efsm_fsa_send(fsas[i], MSG_A, NULL);
+        }
+        while (efsm_run(efsm) > 0) ;
+        for (i = 0; i < 4; i++) {
+            assert(*(int *)efsm_fsa_ctx(fsas[i]) == 1);
+            efsm_fsa_destroy(fsas[i]);
+        }
+    }
+
+    efsm_pool_stats_t stats;
+    efsm_fsa_pool_stats(efsm, &stats);
+    assert(stats.capacity == 4 && stats.in_use == 0);
+    assert(stats.misses == 1 && stats.hits == 11);
+
+    // an explicit hint still wins over the context
+    int hint = 0;
+    efsm_fsa_opts_t opts = { 0 };
+    opts.hint = &hint;
+    efsm_fsa_t *fsa = efsm_fsa_new(efsm, STATE_A, &opts);
+    assert(efsm_fsa_ctx(fsa) != &hint);
+    efsm_destroy(efsm);
+
+    efsm = efsm_new(rules, NULL);
+    assert(efsm_fsa_ctx(efsm_fsa_new(efsm, STATE_A, NULL)) == NULL);
+    efsm_destroy(efsm);
+}
+
+#define ASYNC_THREADS 4
+#define ASYNC_MSGS 10000
+
+/** Last message seen per producer, per fsa (passed as fsa_data) */
+static long async_last[2][ASYNC_THREADS];
+static int async_count;
+
+/** Callback that checks each producer's messages arrive in order */
+int count_async(efsm_fsa_t * fsa, void *fsa_data, void *transition_data, int type, void *msg_data)
+{
+    long *last = fsa_data;
+    long v = (long)msg_data;
+    long thread = v / ASYNC_MSGS;
+
+    assert(v % ASYNC_MSGS > last[thread]);
+    last[thread] = v % ASYNC_MSGS;
+    async_count++;
+
+    return 0;
+}
+
+/** Producer thread for test_async */
+static void *async_producer(void *arg)
+{
+    efsm_fsa_t **fsas = arg;
+    long thread = (long)fsas[2];
+    long i;
+
+    for (i = 0; i < ASYNC_MSGS; i++)
+        assert(efsm_fsa_send_async(fsas[i & 1], MSG_A,
+                                   (void *)(thread * ASYNC_MSGS + i)) == 0);
+
+    return NULL;
+}
+
+/** Sends from several threads while the main thread runs the efsm */
+static void test_async(void)
+{
+    efsm_transition_rules_t rules[] = {
+        {STATE_A, MSG_A, &count_async, NULL, STATE_A},
+        {-1},
+    };
+
+    efsm_t *efsm = efsm_new(rules, NULL);
+
+    long i;
+    for (i = 0; i < ASYNC_THREADS; i++)
+        async_last[0][i] = async_last[1][i] = -1;
+
+    efsm_fsa_opts_t opts = { 0 };
+    opts.hint = async_last[0];
+    efsm_fsa_t *list_fsa = efsm_fsa_new(efsm, STATE_A, &opts);
+    opts.hint = async_last[1];
+    opts.mailbox_capacity = 16;
+    efsm_fsa_t *ring_fsa = efsm_fsa_new(efsm, STATE_A, &opts);
+
+    efsm_fsa_t *args[ASYNC_THREADS][3];
+    pthread_t threads[ASYNC_THREADS];
+    for (i = 0; i < ASYNC_THREADS; i++) {
+        args[i][0] = list_fsa;
+        args[i][1] = ring_fsa;
+        args[i][2] = (efsm_fsa_t *) i;
+        pthread_create(threads + i, NULL, async_producer, args[i]);
+    }
+
+    while (async_count < ASYNC_THREADS * ASYNC_MSGS)
+        assert(efsm_run(efsm) >= 0);
+
+    for (i = 0; i < ASYNC_THREADS; i++)
+        pthread_join(threads[i], NULL);
+
+    assert(efsm_run(efsm) >= 0);
+    assert(async_count == ASYNC_THREADS * ASYNC_MSGS);
+
+    // pending async messages are dropped along with their fsa, which only
+    // goes back to the pool once the run that drops them splices
+    efsm_pool_stats_t stats;
+    efsm_fsa_send_async(list_fsa, MSG_A, NULL);
+    efsm_fsa_destroy(list_fsa);
+    efsm_fsa_pool_stats(efsm, &stats);
+    assert(stats.in_use == 2);
+    assert(efsm_run(efsm) >= 0);
+    assert(async_count == ASYNC_THREADS * ASYNC_MSGS);
+    efsm_fsa_pool_stats(efsm, &stats);
+    assert(stats.in_use == 1);
+
+    efsm_fsa_send_async(ring_fsa, MSG_A, NULL);
+    efsm_destroy(efsm);
+}
+
+#define PAR_FSAS 1000
+#define PAR_HOPS 20
+
+static efsm_fsa_t *par_fsas[PAR_FSAS];
+static atomic_int par_hops;
+static int par_destroyed;
+
+/** Callback that passes a token on to the next fsa until it runs out */
+int forward_token(efsm_fsa_t * fsa, void *fsa_data, void *transition_data, int type, void *msg_data)
+{
+    long i = (long)fsa_data;
+    long hops = (long)msg_data;
+
+    atomic_fetch_add(&par_hops, 1);
+    if (hops > 1)
+        efsm_fsa_send(par_fsas[(i + 1) % PAR_FSAS], MSG_A, (void *)(hops - 1));
+
+    return 0;
+}
+
+/** Destroy callback counting destroyed fsa's */
+void count_destroyed(void *data)
+{
+    par_destroyed++;
+}
+
+/** Runs a token ring and the A -> B -> DESTROY machine on 4 threads */
+static void test_parallel(efsm_transition_rules_t * abd_rules)
+{
+    efsm_transition_rules_t rules[] = {
+        {STATE_A, MSG_A, &forward_token, NULL, STATE_A},
+        {-1},
+    };
+
+    efsm_t *efsm = efsm_new(rules, NULL);
+
+    efsm_fsa_opts_t opts = { 0 };
+    long i;
+    for (i = 0; i < PAR_FSAS; i++) {
+        opts.hint = (void *)i;
+        opts.mailbox_capacity = i & 1;
+        par_fsas[i] = efsm_fsa_new(efsm, STATE_A, &opts);
+        efsm_fsa_send(par_fsas[i], MSG_A, (void *)PAR_HOPS);
+    }
+
+    int passes = 0;
+    while (efsm_run_parallel(efsm, 4) > 0)
+        passes++;
+    // the last hop's pass leaves nothing queued, so it returns 0
+    assert(passes == PAR_HOPS - 1);
+    assert(par_hops == PAR_FSAS * PAR_HOPS);
+
+    efsm_pool_stats_t stats;
+    efsm_msg_pool_stats(efsm, &stats);
+    assert(stats.in_use == 0);
+
+    efsm_destroy(efsm);
+
+    efsm = efsm_new(abd_rules, NULL);
+    opts.hint = NULL;
+    opts.destroy_cb = &count_destroyed;
+    for (i = 0; i < PAR_FSAS; i++) {
+        efsm_fsa_t *fsa = efsm_fsa_new(efsm, STATE_A, &opts);
+        efsm_fsa_send(fsa, MSG_A, NULL);
+    }
+
+    while (efsm_run_parallel(efsm, 4) > 0) ;
+    assert(par_destroyed == PAR_FSAS);
+
+    // a different thread count restarts the pool
+    efsm_fsa_t *fsa = efsm_fsa_new(efsm, STATE_B, NULL);
     efsm_fsa_send(fsa, MSG_A, NULL);
-    assert(_fsa->state == STATE_A);
+    assert(efsm_run_parallel(efsm, 3) == -1);
 
-    int r;
-    r = efsm_run(efsm);
-    assert(r == 1);
-    assert(_fsa->state == STATE_B);
-    r = efsm_run(efsm);
-    assert(r == 1);
-    assert(_fsa->state == STATE_DESTROY);
-    r = efsm_run(efsm);
-    assert(r == 0);
+    efsm_destroy(efsm);
+}
 
-    char * pp_graph = efsm_pp(efsm, (char **)STATES_strings, (char **)MSGS_strings);
-    printf("%s\n", pp_graph);
-    assert(strcmp(pp_graph, GRAPH) == 0);
+static void test_stats(efsm_transition_rules_t * rules)
+{
+    efsm_opts_t opts = { 0 };
+    opts.stats_latency = 1;
+
+    efsm_t *efsm = efsm_new(rules, &opts);
+
+    int i, b;
+    for (i = 0; i < 10; i++) {
+        efsm_fsa_t *fsa = efsm_fsa_new(efsm, STATE_A, NULL);
+        efsm_fsa_send(fsa, MSG_A, NULL);
+        efsm_fsa_send(fsa, MSG_B, NULL);
+        efsm_fsa_send(fsa, MSG_DESTROY, NULL);
+    }
+
+    int runs = 1;
+    while (efsm_run(efsm) > 0)
+        runs++;
+
+    efsm_stats_t stats;
+    assert(efsm_stats_get(efsm, &stats) == 0);
+    assert(stats.n_transitions == 3);
+    assert(stats.runs == (unsigned long long)runs);
+    assert(stats.mailbox_high_water >= 3);
+
+    // the fsas die on the first MSG_DESTROY, dropping what they sent
+    assert(stats.transitions[0].state == STATE_A);
+    assert(stats.transitions[0].msg_type == MSG_A);
+    assert(stats.transitions[0].next_state == STATE_B);
+    assert(stats.transitions[0].count == 10);
+    assert(stats.transitions[1].count == 10);
+    assert(stats.transitions[2].next_state == -1);
+    assert(stats.msgs == 30);
+
+    unsigned long long timed = 0;
+    for (b = 0; b < EFSM_STATS_BUCKETS; b++)
+        timed += stats.transitions[0].latency[b];
+    assert(timed == 10);
+    efsm_stats_release(&stats);
+
+    for (i = 0; i < 100; i++) {
+        efsm_fsa_t *fsa = efsm_fsa_new(efsm, STATE_A, NULL);
+        efsm_fsa_send(fsa, MSG_A, NULL);
+    }
+    while (efsm_run_parallel(efsm, 4) > 0) ;
+
+    assert(efsm_stats_get(efsm, &stats) == 0);
+    assert(stats.transitions[0].count == 110);
+    assert(stats.transitions[1].count == 110);
+    assert(stats.transitions[2].count == 110);
+    assert(stats.msgs == 330);
+    efsm_stats_release(&stats);
+
+    efsm_destroy(efsm);
+}
+
+/** Timers fire in deadline order, cancel cleanly and die with their fsa */
+static void test_timers(void)
+{
+    efsm_transition_rules_t rules[] = {
+        {STATE_A, MSG_A, &record_msg, NULL, STATE_A},
+        {-1},
+    };
+
+    efsm_t *efsm = efsm_new(rules, NULL);
+    efsm_fsa_t *fsa = efsm_fsa_new(efsm, STATE_A, NULL);
 
+    assert(efsm_next_timeout(efsm) == -1);
+
+    // 150ms is past the first level, so it has to cascade down
+    efsm_fsa_send_after(fsa, 150, MSG_A, (void *)3);
+    efsm_fsa_send_after(fsa, 20, MSG_A, (void *)2);
+    efsm_fsa_send_after(fsa, 0, MSG_A, (void *)1);
+    efsm_timer_t dead = efsm_fsa_send_after(fsa, 10, MSG_A, (void *)99);
+    assert(dead.timer);
+    assert(efsm_timer_cancel(fsa, dead) == 0);
+    assert(efsm_timer_cancel(fsa, dead) == -1);
+
+    int timeout = efsm_next_timeout(efsm);
+    assert(timeout >= 0 && timeout <= 1);
+
+    n_seen = 0;
+    while (n_seen < 3) {
+        timeout = efsm_next_timeout(efsm);
+        assert(timeout >= 0 && timeout <= 150);
+        poll(NULL, 0, timeout);
+        while (efsm_run(efsm) > 0) ;
+    }
+    assert(seen[0] == 1 && seen[1] == 2 && seen[2] == 3);
+    assert(efsm_next_timeout(efsm) == -1);
+
+    // a fired timer's handle is stale, even once its memory is reused
+    efsm_timer_t fired = efsm_fsa_send_after(fsa, 0, MSG_A, NULL);
+    poll(NULL, 0, 2);
+    while (efsm_run(efsm) > 0) ;
+    assert(n_seen == 4);
+    efsm_timer_t reused = efsm_fsa_send_after(fsa, 1000, MSG_A, NULL);
+    assert(reused.timer == fired.timer);
+    assert(efsm_timer_cancel(fsa, fired) == -1);
+
+    timeout = efsm_next_timeout(efsm);
+    assert(timeout > 900 && timeout <= 1000);
+
+    // destroying the fsa takes its timers with it
+    efsm_fsa_destroy(fsa);
+    assert(efsm_next_timeout(efsm) == -1);
+
+    efsm_destroy(efsm);
+}
+
+/** Reads a byte off the ready fd, stopping the loop on a 'q' */
+static int read_fd(efsm_fsa_t * fsa, void *fsa_data, void *transition_data,
+                   int type, void *msg_data)
+{
+    char c;
+    assert(read((int)(intptr_t) msg_data, &c, 1) == 1);
+    seen[n_seen++] = c;
+    if (c == 'q')
+        efsm_loop_stop(fsa_data);
+    return 0;
+}
+
+/** Sends MSG_B after a moment, while the loop is waiting */
+static void *wake_loop(void *arg)
+{
+    poll(NULL, 0, 20);
+    efsm_fsa_send_async(arg, MSG_B, (void *)7);
+    return NULL;
+}
+
+/** fd readiness and async sends drive fsas through efsm_loop */
+static void test_loop(void)
+{
+    efsm_transition_rules_t rules[] = {
+        {STATE_A, MSG_A, &read_fd, NULL, STATE_A},
+        {STATE_A, MSG_B, &record_msg, NULL, STATE_A},
+        {-1},
+    };
+
+    efsm_t *efsm = efsm_new(rules, NULL);
+
+    efsm_fsa_opts_t opts = { 0 };
+    opts.hint = efsm;
+    efsm_fsa_t *fsa = efsm_fsa_new(efsm, STATE_A, &opts);
+
+    int p[2];
+    assert(pipe(p) == 0);
+    assert(efsm_fsa_watch_fd(fsa, p[0], EFSM_FD_IN, MSG_A, -1) == 0);
+
+    n_seen = 0;
+    assert(efsm_loop_once(efsm, 0) == 0);
+    assert(write(p[1], "x", 1) == 1);
+    assert(efsm_loop_once(efsm, 1000) == 1);
+    assert(n_seen == 1 && seen[0] == 'x');
+
+    pthread_t thread;
+    pthread_create(&thread, NULL, &wake_loop, fsa);
+    while (n_seen < 2)
+        assert(efsm_loop_once(efsm, -1) >= 0);
+    pthread_join(thread, NULL);
+    assert(seen[1] == 7);
+
+    assert(write(p[1], "yq", 2) == 2);
+    assert(efsm_loop(efsm) == 0);
+    assert(n_seen == 4 && seen[2] == 'y' && seen[3] == 'q');
+
+    // nothing left to wait on once the fd's unwatched
+    assert(efsm_fsa_unwatch_fd(fsa, p[0]) == 0);
+    assert(efsm_fsa_unwatch_fd(fsa, p[0]) == -1);
+    assert(efsm_loop(efsm) == 0);
+
+    // watches die with their fsa
+    assert(efsm_fsa_watch_fd(fsa, p[1], EFSM_FD_OUT | EFSM_FD_EDGE, -1,
+                             MSG_B) == 0);
+    efsm_fsa_destroy(fsa);
+    efsm__t *_efsm = efsm->data;
+    assert(_efsm->loop->n_watches == 0);
+
+    close(p[0]);
+    close(p[1]);
     efsm_destroy(efsm);
 }
+
+static int n_dropped;
+
+/** Counts messages a fsa threw away */
+static void count_dropped(void *fsa_data, int type, void *msg_data)
+{
+    n_dropped++;
+}
+
+/** Records msg_data, sending its own fsa an urgent MSG_B the first time */
+static int escalate(efsm_fsa_t * fsa, void *fsa_data, void *transition_data,
+                    int type, void *msg_data)
+{
+    seen[n_seen++] = (long)msg_data;
+    if (msg_data == (void *)1)
+        efsm_fsa_send_prio(fsa, 1, MSG_B, (void *)2);
+
+    return 0;
+}
+
+/** Higher lanes jump the queue and flushing lanes empty the ones below */
+static void test_prio(void)
+{
+    efsm_transition_rules_t rules[] = {
+        {STATE_A, MSG_A, &record_msg, NULL, STATE_A},
+        {STATE_A, MSG_B, &record_msg, NULL, STATE_A},
+        {STATE_A, MSG_DESTROY, &record_msg, NULL, STATE_A},
+        {-1},
+    };
+    int prios[] = { 0, 0, 3 | EFSM_PRIO_FLUSH };
+
+    efsm_opts_t eopts = { 0 };
+    eopts.msg_prio = prios;
+    eopts.n_msg_prio = ASIZE(prios);
+
+    efsm_t *efsm = efsm_new(rules, &eopts);
+
+    efsm_fsa_opts_t opts = { 0 };
+    opts.drop_cb = &count_dropped;
+
+    long i, ring;
+    for (ring = 0; ring < 2; ring++) {
+        opts.mailbox_capacity = ring * 2;
+        efsm_fsa_t *fsa = efsm_fsa_new(efsm, STATE_A, &opts);
+
+        for (i = 1; i <= 5; i++)
+            efsm_fsa_send(fsa, MSG_A, (void *)i);
+        assert(efsm_fsa_send_prio(fsa, 2, MSG_B, (void *)100) == 0);
+        assert(efsm_fsa_send_prio(fsa, 1, MSG_B, (void *)50) == 0);
+        assert(efsm_fsa_send_prio(fsa, 2, MSG_B, (void *)101) == 0);
+        assert(efsm_fsa_send_prio(fsa, EFSM_PRIO_LANES, MSG_B, NULL) == -1);
+
+        n_seen = 0;
+        while (efsm_run(efsm) > 0) ;
+        assert(n_seen == 8);
+        assert(seen[0] == 100 && seen[1] == 101 && seen[2] == 50);
+        assert(seen[3] == 1 && seen[7] == 5);
+
+        // MSG_DESTROY's lane flushes everything below it
+        for (i = 1; i <= 5; i++)
+            efsm_fsa_send(fsa, MSG_A, (void *)i);
+        efsm_fsa_send_prio(fsa, 1, MSG_B, (void *)50);
+        efsm_fsa_send(fsa, MSG_DESTROY, (void *)9);
+
+        n_seen = 0;
+        n_dropped = 0;
+        while (efsm_run(efsm) > 0) ;
+        assert(n_seen == 1 && seen[0] == 9);
+        assert(n_dropped == 6);
+
+        // what's still queued goes to drop_cb on destroy
+        efsm_fsa_send(fsa, MSG_A, NULL);
+        efsm_fsa_send_prio(fsa, 2, MSG_B, NULL);
+        efsm_fsa_destroy(fsa);
+        assert(n_dropped == 8);
+    }
+
+    efsm_pool_stats_t stats;
+    efsm_msg_pool_stats(efsm, &stats);
+    assert(stats.in_use == 0);
+    assert(((efsm__t *) efsm->data)->n_pending == 0);
+
+    efsm_destroy(efsm);
+
+    // Sending ourselves a higher lane message leaves the current one to pop
+    rules[0].code = &escalate;
+    efsm = efsm_new(rules, NULL);
+    efsm_fsa_send(efsm_fsa_new(efsm, STATE_A, NULL), MSG_A, (void *)1);
+    n_seen = 0;
+    while (efsm_run(efsm) > 0) ;
+    assert(n_seen == 2 && seen[1] == 2);
+    efsm_destroy(efsm);
+}
+
+/** Only fsa's with messages are ever on the run queue, once each */
+static void test_runq(void)
+{
+    efsm_transition_rules_t rules[] = {
+        {STATE_A, MSG_A, &record_msg, NULL, STATE_A},
+        {-1},
+    };
+
+    efsm_t *efsm = efsm_new(rules, NULL);
+    efsm__t *_efsm = efsm->data;
+
+    efsm_fsa_t *fsas[100];
+    long i;
+    for (i = 0; i < 100; i++)
+        fsas[i] = efsm_fsa_new(efsm, STATE_A, NULL);
+    assert(!_efsm->runq);
+
+    efsm_fsa_send(fsas[7], MSG_A, (void *)1);
+    efsm_fsa_send(fsas[3], MSG_A, (void *)2);
+    efsm_fsa_send(fsas[7], MSG_A, (void *)3);
+    efsm_fsa_send(fsas[9], MSG_A, (void *)4);
+
+    efsm__fsa_t *ele;
+    int n = 0;
+    DL_FOREACH(_efsm->runq, ele) {
+        n++;
+    }
+    assert(n == 3 && _efsm->runq == fsas[7]->data);
+
+    // a runnable fsa leaves the queue when it's destroyed
+    efsm_fsa_destroy(fsas[3]);
+
+    n_seen = 0;
+    assert(efsm_run(efsm) == 0);
+    assert(n_seen == 3 && seen[0] == 1 && seen[1] == 3 && seen[2] == 4);
+    assert(!_efsm->runq);
+
+    efsm_destroy(efsm);
+}
+
+/** Records the message, sending MSG_A to itself again when given NULL */
+static int recheck(efsm_fsa_t * fsa, void *fsa_data, void *transition_data,
+                   int type, void *msg_data)
+{
+    seen[n_seen++] = (long)msg_data;
+    if (msg_data == NULL)
+        assert(efsm_fsa_send(fsa, MSG_A, (void *)-1) == 0);
+    return 0;
+}
+
+/** Duplicate sends of a coalescing type collapse into the pending one */
+static void test_coalesce(void)
+{
+    efsm_transition_rules_t rules[] = {
+        {STATE_A, MSG_A, &recheck, NULL, STATE_A},
+        {STATE_A, MSG_B, &record_msg, NULL, STATE_A},
+        {-1},
+    };
+    int coalesce[] = { MSG_A };
+
+    efsm_opts_t eopts = { 0 };
+    eopts.coalesce = coalesce;
+    eopts.n_coalesce = ASIZE(coalesce);
+
+    efsm_t *efsm = efsm_new(rules, &eopts);
+
+    efsm_fsa_opts_t opts = { 0 };
+    opts.drop_cb = &count_dropped;
+
+    long i, ring;
+    for (ring = 0; ring < 2; ring++) {
+        opts.mailbox_capacity = ring * 4;
+        efsm_fsa_t *fsa = efsm_fsa_new(efsm, STATE_A, &opts);
+
+        n_dropped = 0;
+        for (i = 0; i < 50; i++) {
+            efsm_fsa_send(fsa, MSG_A, (void *)i);
+            if (i % 10 == 0)
+                efsm_fsa_send(fsa, MSG_B, (void *)(100 + i));
+        }
+        assert(n_dropped == 49);
+
+        efsm_msg_t batch[] = {
+            {MSG_A, (void *)200}, {MSG_B, (void *)201}, {MSG_A, (void *)202},
+        };
+        assert(efsm_fsa_send_many(fsa, batch, ASIZE(batch)) == 0);
+        assert(n_dropped == 51);
+        assert(((efsm__fsa_t *) fsa->data)->mbox.count == 7);
+
+        n_seen = 0;
+        while (efsm_run(efsm) > 0) ;
+
+        // the callback's own MSG_A isn't swallowed by the one being handled
+        assert(n_seen == 8);
+        assert(seen[0] == 0 && seen[1] == 100 && seen[6] == 201);
+        assert(seen[7] == -1);
+
+        efsm_fsa_send(fsa, MSG_A, (void *)7);
+        n_seen = 0;
+        while (efsm_run(efsm) > 0) ;
+        assert(n_seen == 1 && seen[0] == 7);
+    }
+
+    efsm_pool_stats_t stats;
+    efsm_msg_pool_stats(efsm, &stats);
+    assert(stats.in_use == 0);
+
+    efsm_destroy(efsm);
+}
+
+/** Listed out of state order so rule indices differ from packed ones */
+#define STATIC_RULES(X) \
+    X(STATE_B, MSG_B, &record_msg, NULL, STATE_A) \
+    X(STATE_A, MSG_A, &record_msg, NULL, STATE_B) \
+    X(STATE_A, MSG_DESTROY, &state_destroy_on_msg_destroy, NULL, -1)
+
+EFSM_STATIC_DEFINE(static_ab, STATIC_RULES)
+
+/** Transitions seen by the transition_cb, packed into an int each */
+static int hops[16];
+static int n_hops;
+
+static void record_hop(int pre_state, int msg, int post_state)
+{
+    hops[n_hops++] = pre_state << 16 | msg << 8 | (post_state & 0xff);
+}
+
+/** The generated engine behaves like the table it was generated with */
+static void test_static(void)
+{
+    int engine, i;
+    int table_hops[16];
+
+    for (engine = 0; engine < 2; engine++) {
+        efsm_opts_t opts = { 0 };
+        opts.transition_cb = &record_hop;
+        if (engine)
+            opts.engine = &static_ab_engine;
+
+        efsm_t *efsm = efsm_new(static_ab_rules, &opts);
+        efsm_fsa_t *fsa = efsm_fsa_new(efsm, STATE_A, NULL);
+
+        n_seen = n_hops = 0;
+        for (i = 0; i < 4; i++)
+            efsm_fsa_send(fsa, i & 1 ? MSG_B : MSG_A, (void *)(long)i);
+        while (efsm_run(efsm) > 0) ;
+        assert(n_seen == 4 && seen[3] == 3);
+
+        // MSG_B isn't handled in STATE_A
+        efsm_fsa_send(fsa, MSG_B, NULL);
+        assert(efsm_run(efsm) == -1);
+        assert(n_seen == 4);
+
+        efsm_stats_t stats;
+        assert(efsm_stats_get(efsm, &stats) == 0);
+        assert(stats.msgs == 4);
+        for (i = 0; i < (int)stats.n_transitions; i++) {
+            if (stats.transitions[i].msg_type == MSG_A ||
+                stats.transitions[i].msg_type == MSG_B)
+                assert(stats.transitions[i].count == 2);
+            else
+                assert(stats.transitions[i].count == 0);
+        }
+        efsm_stats_release(&stats);
+
+        ((efsm__fsa_t *) fsa->data)->state = STATE_A;
+        efsm_fsa_send_prio(fsa, 1, MSG_DESTROY, NULL);
+        while (efsm_run(efsm) > 0) ;
+
+        assert(n_hops == 5);
+        if (engine)
+            assert(memcmp(hops, table_hops, sizeof(*hops) * n_hops) == 0);
+        else
+            memcpy(table_hops, hops, sizeof(hops));
+
+        efsm_destroy(efsm);
+    }
+}
+
+/** An inline payload */
+typedef struct hdr {
+    long seq;
+    int hops;
+} hdr_t;
+
+/** Records seq (in seen, or adds it to fsa_data if there is one), resending
+ *  the payload to itself enough times on the first hop to grow a ring under
+ *  the callback, then checks it's still intact */
+static int bounce(efsm_fsa_t * fsa, void *fsa_data, void *transition_data,
+                  int type, void *msg_data)
+{
+    hdr_t *h = msg_data;
+    hdr_t next = *h;
+    long seq = h->seq;
+    int i;
+
+    if (fsa_data)
+        *(long *)fsa_data += seq;
+    else
+        seen[n_seen++] = seq;
+
+    if (next.hops) {
+        next.hops = 0;
+        for (i = 0; i < 4; i++) {
+            next.seq = h->seq * 10 + i;
+            assert(efsm_fsa_send_inline(fsa, type, &next, sizeof(next)) == 0);
+        }
+    }
+    assert(h->seq == seq);
+
+    return 0;
+}
+
+/** Adds up the seqs of dropped inline payloads */
+static void sum_dropped(void *fsa_data, int type, void *msg_data)
+{
+    n_dropped += ((hdr_t *) msg_data)->seq;
+}
+
+/** Inline payloads are copies that live for the length of the callback */
+static void test_inline(void)
+{
+    efsm_transition_rules_t rules[] = {
+        {STATE_A, MSG_A, &bounce, NULL, STATE_A},
+        {-1},
+    };
+    efsm_opts_t eopts = { 0 };
+    eopts.inline_size = 12;
+
+    efsm_t *efsm = efsm_new(rules, &eopts);
+    efsm_fsa_opts_t opts = { 0 };
+    opts.drop_cb = &sum_dropped;
+
+    long i, ring;
+    char big[17] = { 0 };
+    hdr_t h = { 0, 1 };
+
+    for (ring = 0; ring < 2; ring++) {
+        opts.mailbox_capacity = ring * 2;
+        efsm_fsa_t *fsa = efsm_fsa_new(efsm, STATE_A, &opts);
+
+        // 12 rounds up to 16, but no further
+        assert(efsm_fsa_send_inline(fsa, MSG_A, big, 16) == 0);
+        efsm_fsa_destroy(fsa);
+        assert(efsm_fsa_send_inline(fsa = efsm_fsa_new(efsm, STATE_A, &opts),
+                                    MSG_A, big, 17) == -1);
+
+        n_seen = 0;
+        for (i = 1; i <= 2; i++) {
+            h.seq = i;
+            assert(efsm_fsa_send_inline(fsa, MSG_A, &h, sizeof(h)) == 0);
+        }
+        h.seq = 99;
+        while (efsm_run(efsm) > 0) ;
+
+        assert(n_seen == 10);
+        assert(seen[0] == 1 && seen[1] == 2 && seen[2] == 10);
+        assert(seen[5] == 13 && seen[9] == 23);
+
+        // whatever is still queued reaches drop_cb as a payload
+        n_dropped = 0;
+        h.hops = 0;
+        h.seq = 5;
+        efsm_fsa_send_inline(fsa, MSG_A, &h, sizeof(h));
+        h.seq = 6;
+        efsm_fsa_send_inline(fsa, MSG_A, &h, sizeof(h));
+        efsm_fsa_destroy(fsa);
+        assert(n_dropped == 11);
+        h.hops = 1;
+    }
+
+    // Sends from workers are copied before the sender's buffer goes away
+    efsm_fsa_t *fsas[64];
+    long sums[64] = { 0 };
+    for (i = 0; i < 64; i++) {
+        opts.hint = sums + i;
+        fsas[i] = efsm_fsa_new(efsm, STATE_A, &opts);
+        h.seq = i;
+        efsm_fsa_send_inline(fsas[i], MSG_A, &h, sizeof(h));
+    }
+    while (efsm_run_parallel(efsm, 4) > 0) ;
+    for (i = 0; i < 64; i++) {
+        assert(sums[i] == i + 40 * i + 6);
+        efsm_fsa_destroy(fsas[i]);
+    }
+
+    efsm_pool_stats_t stats;
+    efsm_msg_pool_stats(efsm, &stats);
+    assert(stats.in_use == 0);
+
+    efsm_destroy(efsm);
+
+    efsm = efsm_new(rules, NULL);
+    efsm_fsa_t *fsa = efsm_fsa_new(efsm, STATE_A, NULL);
+    assert(efsm_fsa_send_inline(fsa, MSG_A, &h, sizeof(h)) == -1);
+    efsm_destroy(efsm);
+}
+
+/** Records which rule ran, by its transition data */
+static int record_rule(efsm_fsa_t * fsa, void *fsa_data, void *transition_data,
+                       int type, void *msg_data)
+{
+    seen[n_seen++] = (long)transition_data;
+    return 0;
+}
+
+/** Wildcard rules and parents resolve to the nearest match */
+static void test_wildcard(void)
+{
+    enum { W_A, W_B, W_C, W_D };
+    enum { W_TIMEOUT = 7 };
+
+    efsm_transition_rules_t rules[] = {
+        {W_A, MSG_A, &record_rule, (void *)1, W_B},
+        {W_B, MSG_B, &record_rule, (void *)2, W_A},
+        {W_B, EFSM_ANY, &record_rule, (void *)3, EFSM_SAME},
+        {W_C, MSG_A, &record_rule, (void *)4, W_A},
+        {EFSM_ANY, MSG_DESTROY, &state_destroy_on_msg_destroy, NULL, -1},
+        {EFSM_ANY, W_TIMEOUT, &record_rule, (void *)5, EFSM_SAME},
+        {-1},
+    };
+    // C inherits from B, and D from C without any rules of its own
+    int parents[] = { -1, -1, W_B, W_C };
+    efsm_dispatch_t layouts[] = {
+        EFSM_DISPATCH_DENSE, EFSM_DISPATCH_HASH, EFSM_DISPATCH_LINEAR,
+    };
+
+    size_t l;
+    for (l = 0; l < ASIZE(layouts); l++) {
+        efsm_opts_t opts = { 0 };
+        opts.dispatch = layouts[l];
+        opts.state_parents = parents;
+        opts.n_state_parents = ASIZE(parents);
+        opts.transition_cb = &record_hop;
+
+        efsm_t *efsm = efsm_new(rules, &opts);
+        assert(efsm_dispatch(efsm) == layouts[l]);
+
+        efsm_fsa_t *fsa = efsm_fsa_new(efsm, W_A, NULL);
+        efsm__fsa_t *_fsa = fsa->data;
+
+        n_seen = n_hops = 0;
+        efsm_fsa_send(fsa, W_TIMEOUT, NULL);
+        efsm_fsa_send(fsa, MSG_A, NULL);
+        efsm_fsa_send(fsa, W_TIMEOUT, NULL);
+        efsm_fsa_send(fsa, MSG_A, NULL);
+        while (efsm_run(efsm) > 0) ;
+
+        // B's own catch all beats the global W_TIMEOUT rule
+        assert(n_seen == 4);
+        assert(seen[0] == 5 && seen[1] == 1 && seen[2] == 3 && seen[3] == 3);
+        assert(_fsa->state == W_B);
+        assert(hops[0] == (W_A << 16 | W_TIMEOUT << 8 | W_A));
+        assert(hops[2] == (W_B << 16 | W_TIMEOUT << 8 | W_B));
+
+        // MSG_B has no rule in A
+        _fsa->state = W_A;
+        efsm_fsa_send(fsa, MSG_B, NULL);
+        assert(efsm_run(efsm) == -1);
+        efsm_fsa_destroy(fsa);
+
+        fsa = efsm_fsa_new(efsm, W_D, NULL);
+        _fsa = fsa->data;
+        n_seen = 0;
+
+        efsm_fsa_send(fsa, W_TIMEOUT, NULL);
+        while (efsm_run(efsm) > 0) ;
+        assert(n_seen == 1 && seen[0] == 3 && _fsa->state == W_D);
+
+        efsm_fsa_send(fsa, MSG_A, NULL);
+        while (efsm_run(efsm) > 0) ;
+        assert(n_seen == 2 && seen[1] == 4 && _fsa->state == W_A);
+
+        efsm_fsa_send(fsa, MSG_DESTROY, NULL);
+        while (efsm_run(efsm) > 0) ;
+
+        efsm_stats_t stats;
+        assert(efsm_stats_get(efsm, &stats) == 0);
+        assert(stats.n_transitions == 6);
+        assert(stats.transitions[5].state == EFSM_ANY);
+        assert(stats.transitions[5].msg_type == W_TIMEOUT);
+        assert(stats.transitions[5].count == 1);
+        assert(stats.transitions[4].count == 1);
+        efsm_stats_release(&stats);
+
+        efsm_destroy(efsm);
+    }
+
+    int cycle[] = { W_B, W_C, W_A };
+    efsm_opts_t opts = { 0 };
+    opts.state_parents = cycle;
+    opts.n_state_parents = ASIZE(cycle);
+    assert(efsm_new(rules, &opts) == NULL);
+}
+
+#define DEF_THREADS 4
+
+/** Runs a chain of A -> B -> DESTROY fsa's in an efsm of its own */
+static void *def_worker(void *arg)
+{
+    efsm_t *efsm = efsm_new_from_def(arg, NULL);
+    int i;
+
+    for (i = 0; i < 1000; i++)
+        efsm_fsa_send(efsm_fsa_new(efsm, STATE_A, NULL), MSG_A, NULL);
+    while (efsm_run(efsm) > 0) ;
+
+    efsm_stats_t stats;
+    assert(efsm_stats_get(efsm, &stats) == 0);
+    assert(stats.msgs == 3000);
+    efsm_stats_release(&stats);
+    assert(((efsm__t *) efsm->data)->fsas == NULL);
+
+    efsm_destroy(efsm);
+
+    return NULL;
+}
+
+/** efsm's share one compiled def across threads and outlive its creator's
+ *  reference */
+static void test_def(efsm_transition_rules_t * rules)
+{
+    efsm_opts_t opts = { 0 };
+    opts.dispatch = EFSM_DISPATCH_HASH;
+
+    efsm_def_t *def = efsm_def_compile(rules, &opts);
+    assert(def);
+
+    pthread_t threads[DEF_THREADS];
+    int i;
+    for (i = 0; i < DEF_THREADS; i++)
+        pthread_create(threads + i, NULL, &def_worker, def);
+
+    efsm_t *efsm = efsm_new_from_def(def, &opts);
+    efsm_def_release(def);
+    assert(efsm_dispatch(efsm) == EFSM_DISPATCH_HASH);
+    assert(((efsm__t *) efsm->data)->def == def->data);
+
+    for (i = 0; i < DEF_THREADS; i++)
+        pthread_join(threads[i], NULL);
+
+    efsm_destroy(efsm);
+}
+
+/** A snapshot in memory */
+typedef struct membuf {
+    unsigned char *buf;
+    size_t len;
+    size_t pos;
+} membuf_t;
+
+static int mem_write(void *ctx, const void *buf, size_t len)
+{
+    membuf_t *m = ctx;
+
+    m->buf = realloc(m->buf, m->len + len);
+    memcpy(m->buf + m->len, buf, len);
+    m->len += len;
+
+    return 0;
+}
+
+static int mem_read(void *ctx, void *buf, size_t len)
+{
+    membuf_t *m = ctx;
+
+    if (len > m->len - m->pos)
+        return -1;
+
+    memcpy(buf, m->buf + m->pos, len);
+    m->pos += len;
+
+    return 0;
+}
+
+/** fsa data that lives outside the fsa, saved by value */
+static long snap_data;
+
+static int save_long(void *ctx, efsm_fsa_t * fsa, void *fsa_data,
+                     const void **blob, size_t *len)
+{
+    if (fsa_data != &snap_data)
+        return 0;
+
+    *blob = fsa_data;
+    *len = sizeof(long);
+
+    return 0;
+}
+
+static int load_long(void *ctx, efsm_fsa_t * fsa, const void *blob,
+                     size_t len, void **fsa_data)
+{
+    if (len) {
+        memcpy(&snap_data, blob, len);
+        *fsa_data = &snap_data;
+    }
+
+    return 0;
+}
+
+/** Records the fsa's long plus the message, which is inline for MSG_B */
+static int record_snap(efsm_fsa_t * fsa, void *fsa_data, void *transition_data,
+                       int type, void *msg_data)
+{
+    long v = type == MSG_B ? *(long *)msg_data : (long)msg_data;
+
+    seen[n_seen++] = *(long *)fsa_data + v;
+
+    return 0;
+}
+
+/** A restored efsm delivers what the snapshotted one would have */
+static void test_snapshot(void)
+{
+    efsm_transition_rules_t rules[] = {
+        {STATE_A, MSG_A, &record_snap, NULL, STATE_A},
+        {STATE_A, MSG_B, &record_snap, NULL, STATE_B},
+        {STATE_B, MSG_A, &record_snap, NULL, STATE_B},
+        {-1},
+    };
+    efsm_opts_t eopts = { 0 };
+    eopts.inline_size = sizeof(long);
+    eopts.fsa_ctx_size = sizeof(long);
+
+    efsm_t *efsm = efsm_new(rules, &eopts);
+    efsm_fsa_opts_t opts = { 0 };
+    efsm_fsa_t *fsa;
+    long v;
+
+    // A list mailbox with a message in a lane
+    fsa = efsm_fsa_new(efsm, STATE_A, NULL);
+    *(long *)efsm_fsa_ctx(fsa) = 100;
+    efsm_fsa_send(fsa, MSG_A, (void *)1);
+    v = 2;
+    efsm_fsa_send_inline(fsa, MSG_B, &v, sizeof(v));
+    efsm_fsa_send(fsa, MSG_A, (void *)3);
+    efsm_fsa_send_prio(fsa, 2, MSG_A, (void *)4);
+
+    // A ring, already in B
+    opts.mailbox_capacity = 2;
+    fsa = efsm_fsa_new(efsm, STATE_B, &opts);
+    *(long *)efsm_fsa_ctx(fsa) = 200;
+    efsm_fsa_send(fsa, MSG_A, (void *)5);
+    efsm_fsa_send(fsa, MSG_A, (void *)6);
+    efsm_fsa_send(fsa, MSG_A, (void *)7);
+
+    // Data of its own, through save_fsa
+    snap_data = 300;
+    opts.mailbox_capacity = 0;
+    opts.hint = &snap_data;
+    fsa = efsm_fsa_new(efsm, STATE_A, &opts);
+    v = 8;
+    efsm_fsa_send_inline(fsa, MSG_B, &v, sizeof(v));
+
+    membuf_t m = { 0 };
+    efsm_writer_t w = { &mem_write, &m, &save_long, NULL };
+    assert(efsm_snapshot(efsm, &w) == 0);
+    assert(m.len % 8 == 0);
+
+    long expect[16];
+    int n_expect;
+    n_seen = 0;
+    while (efsm_run(efsm) > 0) ;
+    n_expect = n_seen;
+    memcpy(expect, seen, sizeof(*seen) * n_seen);
+    assert(n_expect == 8);
+    assert(expect[0] == 104 && expect[2] == 102 && expect[7] == 308);
+    efsm_destroy(efsm);
+
+    efsm = efsm_new(rules, &eopts);
+    efsm__t *_efsm = efsm->data;
+    efsm_reader_t r = { &mem_read, &m, &load_long, NULL, NULL };
+
+    snap_data = 0;
+    assert(efsm_restore(efsm, &r) == 3);
+    efsm_pool_stats_t stats;
+    efsm_fsa_pool_stats(efsm, &stats);
+    assert(stats.misses == 0 && stats.in_use == 3);
+    assert(_efsm->fsas->all_next->mbox.ring);
+    assert(snap_data == 300);
+
+    n_seen = 0;
+    while (efsm_run(efsm) > 0) ;
+    assert(n_seen == n_expect);
+    assert(memcmp(seen, expect, sizeof(*seen) * n_seen) == 0);
+    assert(_efsm->fsas->state == STATE_B);
+
+    // Cut short, the fsa's restored so far are backed out
+    efsm_fsa_t *keep = efsm_fsa_new(efsm, STATE_A, NULL);
+    m.pos = 0;
+    m.len -= 8;
+    assert(efsm_restore(efsm, &r) == -1);
+    assert(_efsm->fsas->all_prev == keep->data);
+    efsm_fsa_pool_stats(efsm, &stats);
+    assert(stats.in_use == 4);
+
+    // And cut inside the first record, before any fsa is added, the ones
+    // that were already there are left alone
+    size_t len = m.len;
+    m.pos = 0;
+    m.len = sizeof(efsm__snap_hdr_t) + 4;
+    assert(efsm_restore(efsm, &r) == -1);
+    assert(_efsm->fsas->all_prev == keep->data);
+    efsm_fsa_pool_stats(efsm, &stats);
+    assert(stats.in_use == 4);
+
+    efsm_t *empty = efsm_new(rules, &eopts);
+    m.pos = 0;
+    assert(efsm_restore(empty, &r) == -1);
+    assert(!((efsm__t *) empty->data)->fsas);
+    efsm_destroy(empty);
+    m.len = len;
+
+    m.pos = 0;
+    m.buf[0] ^= 1;
+    assert(efsm_restore(efsm, &r) == -1);
+
+    free(m.buf);
+    efsm_destroy(efsm);
+}
+
+/** Records msg_data and counts it down to 0 by resending it, or sends
+ *  itself a MSG_DESTROY if it's negative */
+static int countdown(efsm_fsa_t * fsa, void *fsa_data, void *transition_data,
+                     int type, void *msg_data)
+{
+    long n = (long)msg_data;
+
+    seen[n_seen++] = n;
+    if (n > 0)
+        efsm_fsa_send(fsa, MSG_A, (void *)(n - 1));
+    else if (n < 0)
+        efsm_fsa_send(fsa, MSG_DESTROY, NULL);
+
+    return 0;
+}
+
+/** Self sends run within the pass that made them, without reordering */
+static void test_rtc(efsm_transition_rules_t * chain)
+{
+    efsm_opts_t opts = { 0 };
+    opts.run_to_completion = 3;
+
+    efsm_t *efsm = efsm_new(chain, &opts);
+    efsm__t *_efsm = efsm->data;
+    efsm_pool_stats_t pool;
+    int i;
+
+    for (i = 0; i < 100; i++)
+        efsm_fsa_send(efsm_fsa_new(efsm, STATE_A, NULL), MSG_A, NULL);
+
+    // The whole chain happens in one go, off the first message's slot
+    assert(efsm_run(efsm) == 0);
+    assert(_efsm->fsas == NULL && _efsm->n_pending == 0);
+    efsm_msg_pool_stats(efsm, &pool);
+    assert(pool.high_water == 100 && pool.in_use == 0);
+    efsm_destroy(efsm);
+
+    efsm_transition_rules_t rules[] = {
+        {STATE_A, MSG_A, &countdown, NULL, STATE_A},
+        {STATE_A, MSG_B, &record_msg, NULL, STATE_A},
+        {-1},
+    };
+    efsm = efsm_new(rules, &opts);
+    _efsm = efsm->data;
+    efsm_fsa_t *fsa = efsm_fsa_new(efsm, STATE_A, NULL);
+
+    // Three hops per message, then the rest waits for the next pass
+    n_seen = 0;
+    efsm_fsa_send(fsa, MSG_A, (void *)9);
+    assert(efsm_run(efsm) == 1);
+    assert(n_seen == 4 && seen[3] == 6);
+    while (efsm_run(efsm) > 0) ;
+    assert(n_seen == 10);
+    for (i = 0; i < 10; i++)
+        assert(seen[i] == 9 - i);
+
+    // A self send can't jump the queue
+    n_seen = 0;
+    efsm_fsa_send(fsa, MSG_A, (void *)1);
+    efsm_fsa_send(fsa, MSG_B, (void *)50);
+    assert(efsm_run(efsm) == 1);
+    while (efsm_run(efsm) > 0) ;
+    assert(n_seen == 3 && seen[0] == 1 && seen[1] == 50 && seen[2] == 0);
+
+    // A failed continuation is left queued
+    efsm_fsa_send(fsa, MSG_A, (void *)-1);
+    assert(efsm_run(efsm) == -1);
+    assert(((efsm__fsa_t *) fsa->data)->mbox.count == 1);
+    assert(_efsm->n_pending == 1);
+
+    efsm_fsa_destroy(fsa);
+    efsm_destroy(efsm);
+}
+
+static int n_batches;
+static size_t batch_n;
+static long batch_sum;
+
+/** Sums a batch's msg_data, failing any message that's -1 */
+static void sum_batch(efsm_fsa_t ** fsas, void **fsa_data,
+                      void *transition_data, int type, void **msg_data,
+                      int *results, size_t n)
+{
+    size_t i;
+
+    assert(transition_data == &n_batches && type == MSG_A);
+
+    n_batches++;
+    batch_n = n;
+    for (i = 0; i < n; i++) {
+        batch_sum += (long)msg_data[i];
+        results[i] = msg_data[i] == (void *)-1 ? -1 : 0;
+    }
+}
+
+/** fsa's due the same transition are delivered to with one call */
+static void test_batch(void)
+{
+    efsm_transition_rules_t rules[] = {
+        {STATE_A, MSG_A, NULL, &n_batches, STATE_B},
+        {STATE_B, MSG_A, &record_msg, NULL, STATE_A},
+        {-1},
+    };
+    efsm_batch_rule_t batch[] = {
+        {STATE_A, MSG_A, &sum_batch},
+    };
+    efsm_opts_t opts = { 0 };
+    opts.batch = batch;
+    opts.n_batch = ASIZE(batch);
+
+    efsm_t *efsm = efsm_new(rules, &opts);
+    efsm_fsa_t *fsas[100];
+    long i;
+
+    for (i = 0; i < 100; i++) {
+        fsas[i] = efsm_fsa_new(efsm, STATE_A, NULL);
+        efsm_fsa_send(fsas[i], MSG_A, (void *)i);
+    }
+
+    assert(efsm_run(efsm) == 0);
+    assert(n_batches == 1 && batch_n == 100 && batch_sum == 4950);
+    for (i = 0; i < 100; i++)
+        assert(((efsm__fsa_t *) fsas[i]->data)->state == STATE_B);
+
+    efsm_stats_t stats;
+    assert(efsm_stats_get(efsm, &stats) == 0);
+    assert(stats.msgs == 100 && stats.transitions[0].count == 100);
+    efsm_stats_release(&stats);
+
+    // Delivered on their own, batch callbacks get one at a time
+    n_seen = 0;
+    efsm_fsa_send(fsas[0], MSG_A, (void *)1);
+    efsm_fsa_send(fsas[0], MSG_A, (void *)2);
+    assert(efsm_run(efsm) == 0);
+    assert(n_seen == 1 && seen[0] == 1);
+    assert(n_batches == 2 && batch_n == 1 && batch_sum == 4952);
+
+    // A batched fsa's next message waits for the next pass
+    efsm_fsa_send(fsas[0], MSG_A, (void *)3);
+    assert(efsm_run(efsm) == 0);
+    efsm_fsa_send(fsas[0], MSG_A, (void *)4);
+    efsm_fsa_send(fsas[0], MSG_A, (void *)5);
+    assert(efsm_run(efsm) == 1);
+    assert(n_seen == 2 && n_batches == 3 && batch_sum == 4956);
+    assert(efsm_run(efsm) == 0);
+    assert(n_seen == 3 && seen[1] == 3 && seen[2] == 5);
+
+    efsm_fsa_send(fsas[1], MSG_A, (void *)6);
+    efsm_fsa_send(fsas[1], MSG_A, (void *)7);
+    assert(efsm_run_budget(efsm, 0, 0) == 0);
+    assert(n_seen == 4 && n_batches == 4 && batch_sum == 4963);
+
+    // Failures stay queued
+    efsm_fsa_send(fsas[0], MSG_A, (void *)-1);
+    assert(efsm_run(efsm) == -1);
+    assert(((efsm__fsa_t *) fsas[0]->data)->state == STATE_A);
+    assert(((efsm__fsa_t *) fsas[0]->data)->mbox.count == 1);
+
+    efsm_destroy(efsm);
+
+    batch[0].current_state = STATE_B;
+    batch[0].msg_type = MSG_B;
+    assert(efsm_new(rules, &opts) == NULL);
+}
+
+#define ID_FSAS 1000
+
+static efsm_t *id_efsm;
+static int id_hops;
+static int n_id_dcb;
+
+static void count_id_dcb(void *data)
+{
+    n_id_dcb++;
+}
+
+/** Passes msg_data hops along to the next id over */
+static int id_hop(efsm_fsa_t * fsa, void *fsa_data, void *transition_data,
+                  int type, void *msg_data)
+{
+    long hops = (long)msg_data;
+    efsm_id_t id = efsm_fsa_id(fsa);
+
+    assert(id != EFSM_ID_NONE && fsa_data == (void *)(long)(id * 2));
+    __atomic_fetch_add(&id_hops, 1, __ATOMIC_RELAXED);
+
+    if (hops > 1)
+        return efsm_id_send(id_efsm, (id + 1) % ID_FSAS, MSG_A,
+                            (void *)(hops - 1));
+    return 0;
+}
+
+/** Ids are only fsa's while they've got something to do */
+static void test_id(void)
+{
+    efsm_transition_rules_t rules[] = {
+        {STATE_A, MSG_A, &id_hop, NULL, STATE_B},
+        {STATE_B, MSG_A, &id_hop, NULL, STATE_A},
+        {-1},
+    };
+    efsm_fsa_opts_t fsa_opts = { 0 };
+    fsa_opts.destroy_cb = &count_id_dcb;
+    efsm_opts_t opts = { 0 };
+    opts.id_data = 1;
+    opts.id_fsa_opts = &fsa_opts;
+
+    efsm_t *efsm = id_efsm = efsm_new(rules, &opts);
+    efsm__ids_t *ids = &((efsm__t *) efsm->data)->ids;
+    efsm_pool_stats_t stats;
+    long i;
+
+    for (i = 0; i < ID_FSAS; i++)
+        assert(efsm_id_new(efsm, STATE_A, (void *)(i * 2)) == i);
+    assert(efsm_id_state(efsm, 0) == STATE_A);
+    assert(efsm_id_state(efsm, ID_FSAS) == -1);
+    efsm_fsa_pool_stats(efsm, &stats);
+    assert(ids->n_live == 0 && stats.in_use == 0);
+
+    assert(efsm_id_send(efsm, 0, MSG_A, (void *)1) == 0);
+    assert(ids->n_live == 1);
+    assert(efsm_run(efsm) == 0);
+    assert(id_hops == 1 && efsm_id_state(efsm, 0) == STATE_B);
+    efsm_fsa_pool_stats(efsm, &stats);
+    assert(ids->n_live == 0 && stats.in_use == 0);
+
+    // Workers materialize the ids they send to
+    for (i = 0; i < ID_FSAS; i++)
+        efsm_id_send(efsm, i, MSG_A, (void *)3);
+    while (efsm_run_parallel(efsm, 4) > 0);
+    assert(id_hops == 1 + 3 * ID_FSAS);
+    assert(efsm_id_state(efsm, 0) == STATE_A);
+    assert(efsm_id_state(efsm, 1) == STATE_B);
+    efsm_fsa_pool_stats(efsm, &stats);
+    assert(ids->n_live == 0 && stats.in_use == 0);
+
+    efsm_fsa_t *fsa = efsm_id_fsa(efsm, 5);
+    assert(fsa && efsm_fsa_id(fsa) == 5 && !efsm_fsa_ctx(fsa));
+    assert(efsm_id_fsa(efsm, 5) == fsa);
+    efsm_fsa_send(fsa, MSG_A, (void *)1);
+    assert(efsm_run(efsm) == 0);
+    assert(ids->n_live == 0 && efsm_id_state(efsm, 5) == STATE_A);
+
+    // A handle nothing's sent to is parked by the next run
+    assert(efsm_id_fsa(efsm, 6) && efsm_id_fsa(efsm, 8));
+    assert(ids->n_live == 2 && ids->n_handed == 2);
+    assert(efsm_run(efsm) == 0);
+    efsm_fsa_pool_stats(efsm, &stats);
+    assert(ids->n_live == 0 && ids->n_handed == 0 && stats.in_use == 0);
+    assert(efsm_id_state(efsm, 6) == STATE_B);
+
+    // Destroyed ids are reused, parked or not
+    efsm_id_destroy(efsm, 7);
+    assert(n_id_dcb == 1 && efsm_id_state(efsm, 7) == -1);
+    assert(efsm_id_send(efsm, 7, MSG_A, (void *)1) == -1);
+    efsm_id_send(efsm, 9, MSG_A, (void *)1);
+    efsm_id_destroy(efsm, 9);
+    assert(n_id_dcb == 2 && ids->n_live == 0);
+    assert(efsm_run(efsm) == 0 && id_hops == 2 + 3 * ID_FSAS);
+    assert(efsm_id_new(efsm, STATE_B, (void *)18) == 9);
+    assert(efsm_id_new(efsm, STATE_B, (void *)14) == 7);
+    assert(efsm_id_new(efsm, STATE_B, (void *)(ID_FSAS * 2)) == ID_FSAS);
+
+    efsm_id_send(efsm, 3, MSG_A, (void *)2);
+    efsm_destroy(efsm);
+    assert(n_id_dcb == 2 + ID_FSAS + 1);
+
+    opts.id_data = 0;
+    opts.id_state_size = 2;
+    opts.id_fsa_opts = NULL;
+    efsm = efsm_new(rules, &opts);
+    assert(efsm_id_new(efsm, 0xffff, NULL) == EFSM_ID_NONE);
+    assert(efsm_id_new(efsm, -1, NULL) == EFSM_ID_NONE);
+    assert(efsm_id_new(efsm, 0xfffe, NULL) == 0);
+    assert(efsm_id_state(efsm, 0) == 0xfffe);
+    assert(((efsm__t *) efsm->data)->ids.data == NULL);
+    efsm_destroy(efsm);
+}
+
+static long dropped[16];
+
+/** Records the msg_data of messages a fsa threw away */
+static void record_dropped(void *fsa_data, int type, void *msg_data)
+{
+    dropped[n_dropped++] = (long)msg_data;
+}
+
+/** Records msg_data, sending its own fsa a 3 when it's a 1 */
+static int push_self(efsm_fsa_t * fsa, void *fsa_data, void *transition_data,
+                     int type, void *msg_data)
+{
+    seen[n_seen++] = (long)msg_data;
+
+    if (msg_data == (void *)1)
+        assert(efsm_fsa_send(fsa, MSG_A, (void *)3) == 0);
+
+    return 0;
+}
+
+/** Full mailboxes go by their overflow policy */
+static void test_mailbox_limit(void)
+{
+    efsm_transition_rules_t rules[] = {
+        {STATE_A, MSG_A, &push_self, NULL, STATE_A},
+        {STATE_A, MSG_B, &record_msg, NULL, STATE_A},
+        {STATE_A, MSG_DESTROY, &record_msg, NULL, STATE_A},
+        {-1},
+    };
+    efsm_opts_t opts = { 0 };
+    opts.mailbox_limit = 3;
+    opts.overflow = EFSM_OVERFLOW_DROP_OLDEST;
+    efsm_t *efsm = efsm_new(rules, &opts);
+    efsm_fsa_opts_t fopts = { 0 };
+    fopts.drop_cb = &record_dropped;
+    efsm_fsa_t *fsa;
+    int ring;
+
+    for (ring = 0; ring < 2; ring++) {
+        fopts.mailbox_capacity = ring ? 2 : 0;
+
+        fopts.mailbox_limit = 3;
+        fopts.overflow = EFSM_OVERFLOW_REJECT;
+        fsa = efsm_fsa_new(efsm, STATE_A, &fopts);
+        assert(efsm_fsa_send(fsa, MSG_A, (void *)10) == 0);
+        assert(efsm_fsa_send(fsa, MSG_A, (void *)11) == 0);
+        assert(efsm_fsa_send(fsa, MSG_A, (void *)12) == 0);
+        errno = 0;
+        assert(efsm_fsa_send(fsa, MSG_A, (void *)13) == -1 && errno == EAGAIN);
+        assert(efsm_fsa_send_prio(fsa, 1, MSG_B, NULL) == -1);
+        efsm_msg_t msg = { MSG_A, (void *)14 };
+        assert(efsm_fsa_send_many(fsa, &msg, 1) == -1);
+        assert(efsm_fsa_pending(fsa) == 3);
+        n_seen = 0;
+        assert(efsm_run(efsm) == 0);
+        assert(n_seen == 3 && seen[2] == 12 && efsm_fsa_pending(fsa) == 0);
+        efsm_fsa_destroy(fsa);
+
+        // Without a limit of its own the fsa gets the efsm's
+        fopts.mailbox_limit = 0;
+        fsa = efsm_fsa_new(efsm, STATE_A, &fopts);
+        n_dropped = 0;
+        efsm_fsa_send(fsa, MSG_A, (void *)2);
+        efsm_fsa_send(fsa, MSG_B, (void *)4);
+        efsm_fsa_send(fsa, MSG_A, (void *)5);
+        assert(efsm_fsa_send(fsa, MSG_A, (void *)6) == 0);
+        assert(n_dropped == 1 && dropped[0] == 2);
+        n_seen = 0;
+        assert(efsm_run(efsm) == 0);
+        assert(n_seen == 3 && seen[0] == 4 && seen[1] == 5 && seen[2] == 6);
+
+        // A message that's being delivered isn't the oldest
+        efsm_fsa_send(fsa, MSG_A, (void *)1);
+        efsm_fsa_send(fsa, MSG_A, (void *)2);
+        efsm_fsa_send(fsa, MSG_A, (void *)4);
+        n_seen = n_dropped = 0;
+        assert(efsm_run(efsm) == 0);
+        assert(n_dropped == 1 && dropped[0] == 2);
+        assert(n_seen == 3 && seen[0] == 1 && seen[1] == 4 && seen[2] == 3);
+
+        efsm_msg_t msgs[] = {
+            {MSG_A, (void *)5}, {MSG_A, (void *)6}, {MSG_A, (void *)7},
+            {MSG_A, (void *)8},
+        };
+        n_dropped = 0;
+        assert(efsm_fsa_send_many(fsa, msgs, 4) == 0);
+        assert(efsm_fsa_pending(fsa) == 3 && dropped[0] == 5);
+        assert(efsm_run(efsm) == 0);
+        efsm_fsa_destroy(fsa);
+
+        fopts.mailbox_limit = 2;
+        fopts.overflow = EFSM_OVERFLOW_COALESCE;
+        fsa = efsm_fsa_new(efsm, STATE_A, &fopts);
+        n_dropped = 0;
+        efsm_fsa_send(fsa, MSG_A, (void *)10);
+        efsm_fsa_send(fsa, MSG_B, (void *)11);
+        assert(efsm_fsa_send(fsa, MSG_A, (void *)12) == 0);
+        assert(efsm_fsa_send(fsa, MSG_DESTROY, NULL) == -1);
+        assert(n_dropped == 1 && dropped[0] == 10);
+        n_seen = 0;
+        assert(efsm_run(efsm) == 0);
+        assert(n_seen == 2 && seen[0] == 12 && seen[1] == 11);
+        efsm_fsa_destroy(fsa);
+
+        fopts.overflow = EFSM_OVERFLOW_NOTIFY;
+        fopts.overflow_msg = MSG_DESTROY;
+        fsa = efsm_fsa_new(efsm, STATE_A, &fopts);
+        n_dropped = 0;
+        efsm_fsa_send(fsa, MSG_A, (void *)10);
+        efsm_fsa_send(fsa, MSG_A, (void *)11);
+        assert(efsm_fsa_send(fsa, MSG_A, (void *)12) == 0);
+        assert(efsm_fsa_send(fsa, MSG_A, (void *)13) == 0);
+        assert(n_dropped == 2 && efsm_fsa_pending(fsa) == 3);
+        n_seen = 0;
+        assert(efsm_run(efsm) == 0);
+        assert(n_seen == 3 && seen[1] == 11 && seen[2] == 0);
+        efsm_fsa_send(fsa, MSG_A, (void *)10);
+        efsm_fsa_send(fsa, MSG_A, (void *)11);
+        efsm_fsa_send(fsa, MSG_A, (void *)12);
+        assert(efsm_fsa_pending(fsa) == 3);
+        efsm_fsa_destroy(fsa);
+
+        // Async sends have no one to fail back to
+        fopts.mailbox_limit = 1;
+        fopts.overflow = EFSM_OVERFLOW_REJECT;
+        fsa = efsm_fsa_new(efsm, STATE_A, &fopts);
+        n_dropped = 0;
+        efsm_fsa_send(fsa, MSG_A, (void *)10);
+        assert(efsm_fsa_send_async(fsa, MSG_A, (void *)11) == 0);
+        n_seen = 0;
+        assert(efsm_run(efsm) == 0);
+        assert(n_seen == 1 && n_dropped == 1 && dropped[0] == 11);
+        efsm_fsa_destroy(fsa);
+    }
+
+    efsm_destroy(efsm);
+}
+
+/** Transitions are recorded per thread, the newest overwriting the oldest */
+static void test_trace(void)
+{
+    efsm_transition_rules_t rules[] = {
+        {STATE_A, MSG_A, &record_msg, NULL, STATE_B},
+        {STATE_B, MSG_A, &record_msg, NULL, STATE_A},
+        {STATE_B, MSG_DESTROY, &state_destroy_on_msg_destroy, NULL, -1},
+        {-1},
+    };
+    efsm_opts_t opts = { 0 };
+    opts.trace_records = 5;
+
+    efsm_t *efsm = efsm_new(rules, &opts);
+    efsm_fsa_t *fsa = efsm_fsa_new(efsm, STATE_A, NULL);
+    membuf_t m = { 0 };
+    efsm_writer_t w = { &mem_write, &m };
+    efsm_trace_hdr_t hdr;
+    efsm_trace_ring_t ring;
+    efsm_trace_rec_t *recs;
+    int i;
+
+    for (i = 0; i < 9; i++)
+        efsm_fsa_send(fsa, MSG_A, NULL);
+    efsm_fsa_send(fsa, MSG_DESTROY, NULL);
+    n_seen = 0;
+    assert(efsm_run(efsm) == 0);
+
+    assert(efsm_trace_dump(efsm, &w) == 0);
+    assert(m.len == sizeof(hdr) + sizeof(ring) + 8 * sizeof(*recs));
+    memcpy(&hdr, m.buf, sizeof(hdr));
+    memcpy(&ring, m.buf + sizeof(hdr), sizeof(ring));
+    recs = (efsm_trace_rec_t *) (m.buf + sizeof(hdr) + sizeof(ring));
+    assert(memcmp(hdr.magic, EFSM_TRACE_MAGIC, 8) == 0);
+    assert(hdr.n_rings == 1 && hdr.record_size == 32);
+    assert(hdr.ticks1 >= hdr.ticks0 && hdr.ns1 >= hdr.ns0);
+    assert(ring.thread == 0 && ring.n_records == 8 && ring.n_lost == 2);
+
+    // The third transition on, which is from A again
+    for (i = 0; i < 7; i++) {
+        assert(recs[i].pre_state == (i & 1 ? STATE_B : STATE_A));
+        assert(recs[i].post_state == (i & 1 ? STATE_A : STATE_B));
+        assert(recs[i].msg == MSG_A && recs[i].fsa == recs[0].fsa);
+        assert(recs[i + 1].start >= recs[i].start);
+    }
+    assert(recs[7].pre_state == STATE_B && recs[7].msg == MSG_DESTROY);
+    assert(recs[7].post_state == -1);
+
+    // Workers get rings of their own and ids are marked
+    efsm_id_t id = efsm_id_new(efsm, STATE_A, NULL);
+    efsm_id_send(efsm, id, MSG_A, NULL);
+    assert(efsm_run_parallel(efsm, 2) == 0);
+
+    m.len = 0;
+    assert(efsm_trace_dump(efsm, &w) == 0);
+    memcpy(&hdr, m.buf, sizeof(hdr));
+    assert(hdr.n_rings == 3);
+
+    size_t pos = sizeof(hdr), n_recs = 0;
+    for (i = 0; i < 3; i++) {
+        memcpy(&ring, m.buf + pos, sizeof(ring));
+        assert(ring.thread == (uint32_t)i);
+        recs = (efsm_trace_rec_t *) (m.buf + pos + sizeof(ring));
+        if (i && ring.n_records) {
+            assert(ring.n_records == 1 && recs[0].fsa == (id | EFSM_TRACE_ID));
+            assert(recs[0].post_state == STATE_B);
+        }
+        n_recs += i ? ring.n_records : 0;
+        pos += sizeof(ring) + ring.n_records * sizeof(*recs);
+    }
+    assert(pos == m.len && n_recs == 1);
+    efsm_destroy(efsm);
+
+    // Sampling records the first transition and every third after it
+    opts.trace_sample = 3;
+    efsm = efsm_new(rules, &opts);
+    fsa = efsm_fsa_new(efsm, STATE_A, NULL);
+    for (i = 0; i < 7; i++)
+        efsm_fsa_send(fsa, MSG_A, NULL);
+    assert(efsm_run(efsm) == 0);
+    m.len = 0;
+    assert(efsm_trace_dump(efsm, &w) == 0);
+    memcpy(&ring, m.buf + sizeof(hdr), sizeof(ring));
+    recs = (efsm_trace_rec_t *) (m.buf + sizeof(hdr) + sizeof(ring));
+    assert(ring.n_records == 3 && ring.n_lost == 0);
+    assert(recs[0].pre_state == STATE_A && recs[1].pre_state == STATE_B);
+    efsm_destroy(efsm);
+
+    free(m.buf);
+    efsm = efsm_new(rules, NULL);
+    assert(efsm_trace_dump(efsm, &w) == -1);
+    efsm_destroy(efsm);
+}
+
+static efsm_t *edit_efsm;
+static int edit_transitions;
+
+/** How many times the efsm's rule for (state, type) has run */
+static unsigned long long rule_count(efsm_t * efsm, int state, int type)
+{
+    efsm_stats_t stats;
+    unsigned long long count = 0;
+    int i;
+
+    assert(efsm_stats_get(efsm, &stats) == 0);
+    for (i = 0; i < stats.n_transitions; i++)
+        if (stats.transitions[i].state == state &&
+            stats.transitions[i].msg_type == type)
+            count += stats.transitions[i].count;
+    efsm_stats_release(&stats);
+
+    return count;
+}
+
+/** Adds a rule from inside a pass, noting the table it's still on */
+static int add_from_cb(efsm_fsa_t * fsa, void *fsa_data, void *transition_data,
+                       int type, void *msg_data)
+{
+    efsm_stats_t stats;
+
+    assert(efsm_add_rules(edit_efsm, transition_data) == 0);
+    assert(efsm_stats_get(edit_efsm, &stats) == 0);
+    edit_transitions = stats.n_transitions;
+    efsm_stats_release(&stats);
+
+    return 0;
+}
+
+/** Rules added and removed under live fsa's */
+static void test_add_rules(void)
+{
+    enum { R_A, R_B, R_C };
+    enum { R_GO = 7 };
+
+    efsm_transition_rules_t rules[] = {
+        {R_A, MSG_A, &record_rule, (void *)1, R_B},
+        {R_B, MSG_B, &record_rule, (void *)2, R_A},
+        {-1},
+    };
+    efsm_transition_rules_t more[] = {
+        {R_B, R_GO, &record_rule, (void *)3, R_C},
+        {R_C, MSG_A, &record_rule, (void *)4, R_A},
+        {-1},
+    };
+    efsm_transition_rules_t replace[] = {
+        {R_B, MSG_B, &record_rule, (void *)5, R_C},
+        {-1},
+    };
+    efsm_transition_rules_t late[] = {
+        {R_A, R_GO, &record_rule, (void *)6, R_B},
+        {-1},
+    };
+    efsm_transition_rules_t from_cb[] = {
+        {R_A, MSG_B, &add_from_cb, late, R_A},
+        {-1},
+    };
+
+    efsm_t *efsm = edit_efsm = efsm_new(rules, NULL);
+    efsm_fsa_t *fsa = efsm_fsa_new(efsm, R_A, NULL);
+    efsm__fsa_t *_fsa = fsa->data;
+
+    n_seen = 0;
+    efsm_fsa_send(fsa, MSG_A, NULL);
+    while (efsm_run(efsm) > 0) ;
+    assert(_fsa->state == R_B);
+
+    // A new state, entered from where the fsa is waiting
+    assert(efsm_add_rules(efsm, more) == 0);
+    efsm_fsa_send(fsa, R_GO, NULL);
+    efsm_fsa_send(fsa, MSG_A, NULL);
+    efsm_fsa_send(fsa, MSG_A, NULL);
+    while (efsm_run(efsm) > 0) ;
+    assert(n_seen == 4);
+    assert(seen[1] == 3 && seen[2] == 4 && seen[3] == 1);
+    assert(_fsa->state == R_B);
+    assert(rule_count(efsm, R_A, MSG_A) == 2);
+
+    // Same (state, type) replaces, and the old rule's count goes with it
+    assert(efsm_add_rules(efsm, replace) == 0);
+    assert(rule_count(efsm, R_B, MSG_B) == 0);
+    efsm_fsa_send(fsa, MSG_B, NULL);
+    while (efsm_run(efsm) > 0) ;
+    assert(n_seen == 5 && seen[4] == 5 && _fsa->state == R_C);
+
+    assert(efsm_remove_rule(efsm, R_C, MSG_A) == 0);
+    assert(efsm_remove_rule(efsm, R_C, MSG_A) == -1);
+    efsm_fsa_send(fsa, MSG_A, NULL);
+    assert(efsm_run(efsm) == -1);
+    efsm_fsa_destroy(fsa);
+
+    // From a callback the pass finishes on the table it started with
+    assert(efsm_add_rules(efsm, from_cb) == 0);
+    fsa = efsm_fsa_new(efsm, R_A, NULL);
+    _fsa = fsa->data;
+    efsm_fsa_send(fsa, MSG_B, NULL);
+    assert(efsm_run(efsm) == 0);
+    assert(edit_transitions == 4);
+    assert(rule_count(efsm, R_A, MSG_B) == 1);
+
+    // Parallel workers' counters move over too
+    efsm_fsa_send(fsa, R_GO, NULL);
+    assert(efsm_run_parallel(efsm, 2) == 0);
+    assert(n_seen == 6 && seen[5] == 6 && _fsa->state == R_B);
+    assert(efsm_remove_rule(efsm, R_A, MSG_B) == 0);
+    assert(rule_count(efsm, R_A, R_GO) == 1);
+    assert(rule_count(efsm, R_A, MSG_A) == 2);
+
+    efsm_destroy(efsm);
+
+    // An edit that can't be compiled leaves the old rules running
+    efsm_transition_rules_t huge[] = {
+        {HUGE_STATE, HUGE_MSG, &record_rule, (void *)7, R_A},
+        {-1},
+    };
+    efsm_opts_t opts = { 0 };
+    opts.dispatch = EFSM_DISPATCH_DENSE;
+
+    efsm = efsm_new(rules, &opts);
+    fsa = efsm_fsa_new(efsm, R_A, NULL);
+    _fsa = fsa->data;
+    if (HUGE_MALLOC_FAILS)
+        assert(efsm_add_rules(efsm, huge) == -1);
+    n_seen = 0;
+    efsm_fsa_send(fsa, MSG_A, NULL);
+    efsm_fsa_send(fsa, MSG_B, NULL);
+    while (efsm_run(efsm) > 0) ;
+    assert(n_seen == 2 && seen[0] == 1 && seen[1] == 2);
+    assert(_fsa->state == R_A && rule_count(efsm, R_A, MSG_A) == 1);
+    efsm_destroy(efsm);
+}
+
+/** Findings on a table with a gap of each kind, and strict mode */
+static void test_verify(void)
+{
+    enum { V_A, V_B, V_C, V_D, V_E };
+    enum { V_ORPHAN = 9 };
+
+    efsm_transition_rules_t rules[] = {
+        {V_A, MSG_A, &record_rule, NULL, V_B},
+        {V_B, MSG_B, &record_rule, NULL, V_C},
+        {V_B, MSG_DESTROY, &record_rule, NULL, -1},
+        {V_C, MSG_A, &record_rule, NULL, EFSM_SAME},
+        {V_E, V_ORPHAN, &record_rule, NULL, V_A},
+        {-1},
+    };
+
+    efsm_t *efsm = efsm_new(rules, NULL);
+    efsm_verify_report_t report;
+
+    assert(efsm_verify(efsm, &report) == 12);
+    assert(report.n_unreachable == 2);
+    assert(report.unreachable[0] == V_D && report.unreachable[1] == V_E);
+    assert(report.n_missing == 8);
+    assert(report.missing[0].state == V_A);
+    assert(report.missing[0].msg_type == MSG_B);
+    assert(report.missing[4].state == V_B);
+    assert(report.missing[4].msg_type == V_ORPHAN);
+    assert(report.n_dead_msgs == 1 && report.dead_msgs[0] == V_ORPHAN);
+    assert(report.n_no_exit == 1 && report.no_exit[0] == V_C);
+    efsm_verify_release(&report);
+    efsm_destroy(efsm);
+
+    efsm_opts_t opts = { 0 };
+    opts.verify = EFSM_VERIFY_UNREACHABLE;
+    assert(efsm_new(rules, &opts) == NULL);
+
+    // Starting in D and E too reaches everything, and E handles V_ORPHAN
+    int starts[] = { V_A, V_D, V_E };
+    opts.start_states = starts;
+    opts.n_start_states = ASIZE(starts);
+    opts.verify = EFSM_VERIFY_UNREACHABLE | EFSM_VERIFY_DEAD_MSGS;
+    efsm = efsm_new(rules, &opts);
+    assert(efsm);
+
+    assert(efsm_verify(efsm, &report) == 17);
+    assert(report.n_unreachable == 0 && report.n_dead_msgs == 0);
+    assert(report.n_no_exit == 2 && report.no_exit[1] == V_D);
+    efsm_verify_release(&report);
+
+    // Edits are held to it too, leaving the table as it was
+    assert(efsm_remove_rule(efsm, V_A, MSG_A) == -1);
+    assert(efsm_remove_rule(efsm, V_B, MSG_DESTROY) == 0);
+
+    // No rule names MSG_DESTROY now, so it isn't checked
+    assert(efsm_verify(efsm, &report) == 13);
+    efsm_verify_release(&report);
+
+    // A type the rules don't name
+    int types[] = { MSG_A, MSG_B, MSG_DESTROY, V_ORPHAN, 12 };
+    opts.msg_types = types;
+    opts.n_msg_types = ASIZE(types);
+    assert(efsm_new(rules, &opts) == NULL);
+
+    efsm_destroy(efsm);
+}
+
+static int n_errors;
+static int error_types[8];
+
+static void record_error(void *fsa_data, int state, int type, void *msg_data)
+{
+    assert(state == STATE_A || state == STATE_B);
+    error_types[n_errors++] = type;
+}
+
+/** Fails the message whose data is -1 */
+static int fail_on(efsm_fsa_t * fsa, void *fsa_data, void *transition_data,
+                   int type, void *msg_data)
+{
+    n_seen++;
+    return msg_data == (void *)-1L ? -1 : 0;
+}
+
+/** A failing fsa is set aside while the rest of the pass goes on */
+static void test_on_error(void)
+{
+    enum { E_ERROR = 9 };
+
+    efsm_transition_rules_t rules[] = {
+        {STATE_A, MSG_A, &fail_on, NULL, STATE_A},
+        {STATE_B, MSG_A, &fail_on, NULL, STATE_B},
+        {STATE_A, E_ERROR, &fail_on, NULL, STATE_B},
+        {STATE_B, E_ERROR, &fail_on, NULL, -1},
+        {-1},
+    };
+    efsm_opts_t opts = { 0 };
+    opts.on_error = EFSM_ERROR_QUARANTINE;
+
+    efsm_fsa_opts_t fsa_opts = { 0 };
+    fsa_opts.error_cb = &record_error;
+    fsa_opts.drop_cb = &record_dropped;
+
+    int threads;
+    for (threads = 1; threads <= 2; threads++) {
+        efsm_t *efsm = efsm_new(rules, &opts);
+        efsm_fsa_t *fsas[4];
+        int i;
+
+        for (i = 0; i < 4; i++) {
+            fsas[i] = efsm_fsa_new(efsm, STATE_A, &fsa_opts);
+            efsm_fsa_send(fsas[i], MSG_A, NULL);
+        }
+        efsm_fsa_send(fsas[1], MSG_A, (void *)-1L);
+        efsm_fsa_send(fsas[1], MSG_A, NULL);
+        efsm_fsa_send(fsas[2], MSG_B, NULL);
+
+        n_seen = n_errors = n_dropped = 0;
+        assert(efsm_run_parallel(efsm, threads) == 0);
+        assert(n_seen == 5 && n_errors == 2);
+        assert(error_types[0] + error_types[1] == MSG_A + MSG_B);
+
+        // Then to drop_cb
+        assert(n_dropped == 2 && dropped[0] + dropped[1] == -1);
+
+        // Sends wait along with what's left, and aren't pending
+        efsm__fsa_t *_fsa = fsas[1]->data;
+        assert(_fsa->status == EFSM_FSA_QUARANTINED);
+        efsm_fsa_send(fsas[1], MSG_A, NULL);
+        assert(_fsa->mbox.count == 2);
+        assert(efsm_run_budget(efsm, 0, 0) == 0);
+
+        efsm_stats_t stats;
+        assert(efsm_stats_get(efsm, &stats) == 0);
+        assert(stats.errors == 2);
+        efsm_stats_release(&stats);
+
+        assert(efsm_fsa_resume(fsas[3]) == -1);
+        assert(efsm_fsa_resume(fsas[1]) == 0);
+        assert(efsm_fsa_resume(fsas[2]) == 0);
+        while (efsm_run(efsm) > 0) ;
+        assert(n_seen == 7);
+
+        efsm_destroy(efsm);
+    }
+
+    // An error transition, which quarantines the fsa if it fails too
+    opts.on_error = EFSM_ERROR_MSG;
+    opts.error_msg = E_ERROR;
+    efsm_t *efsm = efsm_new(rules, &opts);
+    efsm_fsa_t *fsa = efsm_fsa_new(efsm, STATE_A, &fsa_opts);
+    efsm__fsa_t *_fsa = fsa->data;
+
+    n_seen = n_errors = 0;
+    efsm_fsa_send(fsa, MSG_A, (void *)-1L);
+    efsm_fsa_send(fsa, MSG_A, NULL);
+    while (efsm_run(efsm) > 0) ;
+    assert(n_errors == 1 && n_seen == 3 && _fsa->state == STATE_B);
+
+    efsm_fsa_send(fsa, E_ERROR, (void *)-1L);
+    while (efsm_run(efsm) > 0) ;
+    assert(_fsa->status == EFSM_FSA_QUARANTINED && _fsa->state == STATE_B);
+
+    efsm_destroy(efsm);
+}
+
+static int fail_write(void *ctx, const void *buf, size_t len)
+{
+    return -1;
+}
+
+/** Exports in each format, with partial names and with counts */
+static void test_graph(void)
+{
+    efsm_transition_rules_t rules[] = {
+        {STATE_A, MSG_A, &fail_on, NULL, STATE_B},
+        {STATE_B, MSG_B, &fail_on, NULL, EFSM_SAME},
+        {EFSM_ANY, MSG_DESTROY, &fail_on, NULL, -1},
+        {-1},
+    };
+    const char *state_names[] = { "A" };
+    const char *msg_names[] = { "MSG_A", "MSG_\"B\"" };
+
+    efsm_t *efsm = efsm_new(rules, NULL);
+    efsm_fsa_t *fsa = efsm_fsa_new(efsm, STATE_A, NULL);
+
+    efsm_fsa_send(fsa, MSG_A, NULL);
+    efsm_fsa_send(fsa, MSG_B, NULL);
+    efsm_fsa_send(fsa, MSG_B, NULL);
+    efsm_fsa_send(fsa, MSG_DESTROY, NULL);
+    while (efsm_run(efsm) > 0) ;
+
+    efsm_graph_opts_t opts = { 0 };
+    opts.state_names = state_names;
+    opts.n_state_names = ASIZE(state_names);
+    opts.msg_names = msg_names;
+    opts.n_msg_names = ASIZE(msg_names);
+
+    membuf_t m = { 0 };
+    efsm_writer_t w = { &mem_write, &m };
+
+    assert(efsm_graph(efsm, &w, &opts) == 0);
+    mem_write(&m, "", 1);
+    assert(strcmp((char *)m.buf,
+                  "digraph G {\n"
+                  "  A -> 1 [label=\"MSG_A\"];\n"
+                  "  1 -> 1 [label=\"MSG_\\\"B\\\"\"];\n"
+                  "  * -> _ [label=\"2\"];\n"
+                  "}\n") == 0);
+
+    opts.counts = 1;
+    m.len = 0;
+    assert(efsm_graph(efsm, &w, &opts) == 0);
+    mem_write(&m, "", 1);
+    assert(strcmp((char *)m.buf,
+                  "digraph G {\n"
+                  "  A -> 1 [label=\"MSG_A (1)\", penwidth=4.5];\n"
+                  "  1 -> 1 [label=\"MSG_\\\"B\\\" (2)\", penwidth=8.0];\n"
+                  "  * -> _ [label=\"2 (1)\", penwidth=4.5];\n"
+                  "}\n") == 0);
+
+    opts.format = EFSM_GRAPH_JSON;
+    m.len = 0;
+    assert(efsm_graph(efsm, &w, &opts) == 0);
+    mem_write(&m, "", 1);
+    assert(strcmp((char *)m.buf,
+                  "{\"states\":[\n"
+                  "{\"id\":0,\"name\":\"A\"},\n"
+                  "{\"id\":1,\"name\":\"1\"}\n"
+                  "],\"edges\":[\n"
+                  "{\"from\":0,\"msg\":0,\"to\":1,\"label\":\"MSG_A\","
+                  "\"count\":1},\n"
+                  "{\"from\":1,\"msg\":1,\"to\":-3,\"label\":\"MSG_\\\"B\\\"\","
+                  "\"count\":2},\n"
+                  "{\"from\":-2,\"msg\":2,\"to\":-1,\"label\":\"2\","
+                  "\"count\":1}\n"
+                  "]}\n") == 0);
+
+    opts.format = EFSM_GRAPH_BINARY;
+    m.len = 0;
+    assert(efsm_graph(efsm, &w, &opts) == 0);
+
+    efsm_graph_hdr_t *hdr = (efsm_graph_hdr_t *)m.buf;
+    uint32_t *offsets = (uint32_t *)(hdr + 1);
+    efsm_graph_edge_t *edges = (efsm_graph_edge_t *)(offsets + 4);
+
+    assert(m.len == sizeof(*hdr) + 4 * sizeof(*offsets) + 3 * sizeof(*edges));
+    assert(memcmp(hdr->magic, EFSM_GRAPH_MAGIC, sizeof(hdr->magic)) == 0);
+    assert(hdr->n_states == 3 && hdr->any_state == 2 && hdr->n_edges == 3);
+    assert(offsets[0] == 0 && offsets[1] == 1 && offsets[2] == 2 &&
+           offsets[3] == 3);
+    assert(edges[1].msg_type == MSG_B && edges[1].next_state == EFSM_SAME &&
+           edges[1].count == 2);
+    assert(edges[2].msg_type == MSG_DESTROY && edges[2].next_state == -1 &&
+           edges[2].count == 1);
+
+    w.write = &fail_write;
+    assert(efsm_graph(efsm, &w, &opts) == -1);
+
+    free(m.buf);
+    efsm_destroy(efsm);
+}
+
+int main(void) {
+   /** Our main test case */
+    efsm_transition_rules_t rules[] = {
+        {STATE_A, MSG_A, &state_a_on_msg_a, NULL, STATE_B},
+        {STATE_B, MSG_B, &state_b_on_msg_b, NULL, STATE_DESTROY},
+        {STATE_DESTROY, MSG_DESTROY, &state_destroy_on_msg_destroy, NULL, -1},
+        {-1},
+    };
+
+    efsm_t *efsm = efsm_new(rules, NULL);
+
+    efsm_fsa_t * fsa;
+
+    efsm_fsa_opts_t opts = { 0 };
+    opts.hint = &fsa;
+
+    fsa = efsm_fsa_new(efsm, STATE_A, &opts);
+    efsm__fsa_t * _fsa = (efsm__fsa_t *)fsa->data;
+
+    assert(_fsa->state == STATE_A);
+    efsm_fsa_send(fsa, MSG_A, NULL);
+    assert(_fsa->state == STATE_A);
+
+    int r;
+    r = efsm_run(efsm);
+    assert(r == 1);
+    assert(_fsa->state == STATE_B);
+    r = efsm_run(efsm);
+    assert(r == 1);
+    assert(_fsa->state == STATE_DESTROY);
+    r = efsm_run(efsm);
+    assert(r == 0);
+
+    char * pp_graph = efsm_pp(efsm, (char **)STATES_strings, (char **)MSGS_strings);
+    printf("%s\n", pp_graph);
+    assert(strcmp(pp_graph, GRAPH) == 0);
+
+    efsm_destroy(efsm);
+
+    test_msg_pool(rules);
+    test_dispatch(rules);
+    test_ring_mailbox();
+    test_budget();
+    test_batch_send();
+    test_fsa_pool();
+    test_async();
+    test_parallel(rules);
+    test_stats(rules);
+    test_timers();
+    test_loop();
+    test_prio();
+    test_runq();
+    test_coalesce();
+    test_static();
+    test_inline();
+    test_wildcard();
+    test_def(rules);
+    test_snapshot();
+    test_rtc(rules);
+    test_batch();
+    test_id();
+    test_mailbox_limit();
+    test_trace();
+    test_add_rules();
+    test_verify();
+    test_on_error();
+    test_graph();
+}
@@ -0,0 +1,127 @@
+/**
+ * \file efsm_trace.c
+ * \brief Converts efsm_trace_dump output for other tools
+ * \author Jason Carey
+ *
+ * Reads a dump from a file or stdin and writes either a Chrome trace (the
+ * JSON chrome://tracing and Perfetto load, one complete event per
+ * transition with a track per thread) or plain text, one transition per
+ * line, which sorts and awks well:
+ *
+ *   thread seconds fsa pre_state msg post_state duration_ns
+ *
+ * Times are CLOCK_MONOTONIC, the clock perf uses with -k CLOCK_MONOTONIC, so
+ * the two can be lined up.  Ids from efsm_id_new show as "id:N".
+ *
+ * Usage: efsm_trace [-t] [dump]
+ *
+ *   -t    plain text instead of a Chrome trace
+ *   dump  the file to read, stdin without one
+ */
+
+#include <efsm.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/** Maps ticks onto the monotonic clock, from the two pairs in the header */
+static double to_ns(const efsm_trace_hdr_t * hdr, uint64_t ticks)
+{
+    double per_ns = 1;
+
+    if (hdr->ticks1 > hdr->ticks0 && hdr->ns1 > hdr->ns0)
+        per_ns = (double)(hdr->ticks1 - hdr->ticks0) /
+            (double)(hdr->ns1 - hdr->ns0);
+
+    return hdr->ns0 + ((double)ticks - (double)hdr->ticks0) / per_ns;
+}
+
+static void fsa_name(char *buf, size_t size, uint64_t fsa)
+{
+    if (fsa & EFSM_TRACE_ID)
+        snprintf(buf, size, "id:%llu",
+                 (unsigned long long)(fsa & ~EFSM_TRACE_ID));
+    else
+        snprintf(buf, size, "%llu", (unsigned long long)fsa);
+}
+
+int main(int argc, char **argv)
+{
+    int text = 0;
+    FILE *in = stdin;
+    efsm_trace_hdr_t hdr;
+    efsm_trace_ring_t ring;
+    efsm_trace_rec_t rec;
+    unsigned long long lost = 0;
+    int first = 1;
+    uint32_t i;
+    uint64_t j;
+
+    if (argc > 1 && strcmp(argv[1], "-t") == 0) {
+        text = 1;
+        argc--;
+        argv++;
+    }
+
+    if (argc > 2 || (argc == 2 && argv[1][0] == '-')) {
+        fprintf(stderr, "usage: efsm_trace [-t] [dump]\n");
+        return 1;
+    }
+
+    if (argc == 2 && !(in = fopen(argv[1], "rb"))) {
+        perror(argv[1]);
+        return 1;
+    }
+
+    if (fread(&hdr, sizeof(hdr), 1, in) != 1 ||
+        memcmp(hdr.magic, EFSM_TRACE_MAGIC, sizeof(hdr.magic)) != 0 ||
+        hdr.record_size != sizeof(rec)) {
+        fprintf(stderr, "efsm_trace: not a trace dump\n");
+        return 1;
+    }
+
+    if (!text)
+        printf("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+
+    for (i = 0; i < hdr.n_rings; i++) {
+        if (fread(&ring, sizeof(ring), 1, in) != 1) {
+            fprintf(stderr, "efsm_trace: truncated dump\n");
+            return 1;
+        }
+        lost += ring.n_lost;
+
+        for (j = 0; j < ring.n_records; j++) {
+            char fsa[32];
+
+            if (fread(&rec, sizeof(rec), 1, in) != 1) {
+                fprintf(stderr, "efsm_trace: truncated dump\n");
+                return 1;
+            }
+
+            double ns = to_ns(&hdr, rec.start);
+            double dur = to_ns(&hdr, rec.start + rec.ticks) - ns;
+            fsa_name(fsa, sizeof(fsa), rec.fsa);
+
+            if (text) {
+                printf("%u %.9f %s %d %d %d %.0f\n", ring.thread, ns / 1e9,
+                       fsa, rec.pre_state, rec.msg, rec.post_state, dur);
+            } else {
+                printf("%s{\"name\":\"%d -%d-> %d\",\"ph\":\"X\",\"pid\":1,"
+                       "\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f,"
+                       "\"args\":{\"fsa\":\"%s\"}}", first ? "" : ",\n",
+                       rec.pre_state, rec.msg, rec.post_state, ring.thread,
+                       ns / 1e3, dur / 1e3, fsa);
+                first = 0;
+            }
+        }
+    }
+
+    if (!text)
+        printf("\n]}\n");
+
+    if (lost)
+        fprintf(stderr, "efsm_trace: %llu older records were overwritten\n",
+                lost);
+
+    return 0;
+}